@@ -6,15 +6,24 @@
  *	CFNotificationCenter's distributed version, in a similar fashion to
  *	distnoted under OS X.
  *
- *	Unlike the OS X version, and in the interest of simplicity, this daemon
- *	does not take a client's suspension behaviour into consideration. If a
- *	notification for which the client has registered arrives, it is forwarded
- *	to the client, which (in the form of CFLite's CFNotificationCenter) then
- *	decides whether to deliver the notification or to queue it for later.
+ *	Like the OS X version, this daemon takes a client's suspension behaviour
+ *	into consideration. While a client is suspended (between its SUSPEND and
+ *	RESUME messages) notifications for it are dropped, coalesced, held or
+ *	delivered immediately according to the behaviour it registered them with,
+ *	and anything held is sent on together when it resumes.
  */
 
 #include <CoreFoundation/CoreFoundation.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/time.h>
 #include "ddistnoted.h"
+#include "dndtransport.h"
+#include "dndepoch.h"
+#include "dndhistogram.h"
+#include "dndtrace.h"
+#include "dndmatch.h"
 
 // because we're getting sigsevs
 #include <execinfo.h>
@@ -43,108 +52,1787 @@ typedef struct dndQueue {
 	CFHashCode name;
 	CFHashCode object;
 	CFDataRef data;
+	UInt64 time;		// when it was matched, or for a held one resumed
 } dndQueue;
 
+// a client matched by a notification, and the strongest suspension behaviour
+//	among its records which matched, in the generation of its slot they were made for
+typedef struct dndMatch {
+	CFIndex index;
+	CFIndex generation;
+	CFNotificationSuspensionBehavior sb;
+} dndMatch;
+
 typedef struct dndPortRecord {
+	// what delivering a notification and picking the next client to send to look at,
+	//	kept together at the front
+	dndEndpointRef port;
+	CFIndex generation;	// bumped each time the slot is given to a new client
+	CFIndex count;		// notifications waiting in queue, a ring buffer which
+	CFIndex first;		//	starts at first and has room for capacity of them
+	CFIndex capacity;
+	dndQueue *queue;
+	CFIndex urgentCount;	// notifications posted to be delivered immediately, which
+	CFIndex urgentCapacity;	//	are sent before anything in the queue, oldest first
+	dndQueue *urgent;
+	CFIndex ready;		// the next client on the ready list
+	CFIndex urgentReady;	// the next client on the urgent ready list
+	UInt64 retry;		// when a parked client is next probed
+	Boolean live;		// FALSE while the slot is on the free list
+	Boolean dead;		// TRUE once the client has gone, until it's reaped
+	Boolean suspended;	// TRUE between the client's SUSPEND and RESUME
+	Boolean busy;		// TRUE while a dispatch thread is sending to the client
+	Boolean parked;		// TRUE while its circuit breaker is open
+	Boolean batching;	// TRUE if the client takes NOTIFICATION_BATCH messages
+	Boolean listed;		// TRUE while the client is on the ready list
+	Boolean urgentListed;	// TRUE while the client is on the urgent ready list
+
 	CFHashCode name;
-	CFMessagePortRef port;
 	long session;
-	CFIndex count;
-	dndQueue *queue;
+	CFIndex dropped;	// notifications discarded because the queue was full
+	CFIndex coalesced;	// notifications merged into one already queued
+	CFIndex heldCount;	// notifications held back while suspended, oldest first
+	CFIndex heldCapacity;
+	dndQueue *held;
+	UInt64 sendAverage;	// smoothed time sends to the client take, and its mean
+	UInt64 sendDeviation;	//	deviation, in nanoseconds. 0 until one has succeeded
+	CFTimeInterval sendTimeout;	// how long the next send to it may take
+	CFIndex timeouts;	// sends to it which have timed out in a row
+	UInt64 backoff;		// how long it was last parked for
 } dndPortRecord;
 
-// list of clients which have contacted the daemon
-#define PORT_LIST_SIZE	64
-static dndPortRecord *dndPortList = NULL;
-static CFIndex dndPortListCount = 0;
-static CFIndex dndPortListCapacity = 0;
+// list of clients which have contacted the daemon. slots freed by reaping dead
+//	clients are chained, through their ready fields, from dndPortFree for reuse.
+//	both this list and the notifications list double in size when they fill up
+#define PORT_LIST_SIZE	64
+static dndPortRecord *dndPortList = NULL;
+static CFIndex dndPortListCount = 0;
+static CFIndex dndPortListCapacity = 0;
+static CFIndex dndPortFree = kCFNotFound;
+
+// how we talk to clients, and they to us
+static const dndTransport *dndPortTransport = NULL;
+
+// signalled, from any thread, when a client is found to be dead so that the
+//	main thread can reap it
+static dndSourceRef dndReaper = NULL;
+
+/*
+ *	Map from a client's uid to its slot in the port list, so that requests naming a
+ *	uid don't have to search the list for it. Open addressing with linear probing;
+ *	empty entries have a slot of kCFNotFound. The number of entries is a power of
+ *	two and is kept at least twice the number of clients.
+ */
+typedef struct dndPortMapEntry {
+	CFHashCode uid;
+	CFIndex slot;
+} dndPortMapEntry;
+
+#define PORT_MAP_SIZE	128
+static dndPortMapEntry *dndPortMap = NULL;
+static CFIndex dndPortMapMask = 0;
+
+/*
+ *	Clients with notifications waiting in their queues are kept on the ready list,
+ *	in the order they became ready, for the dispatch threads to take and send to.
+ *	A client is never taken from the list while a thread is sending to it, so each
+ *	client's notifications are delivered in order and by one thread at a time.
+ *
+ *	Notifications posted with kCFNotificationDeliverImmediately go into a separate
+ *	urgent lane for each client instead. They're never coalesced, held or batched,
+ *	and are sent before anything in the client's queue. Clients with any waiting are
+ *	put on the urgent ready list, which the dispatch threads empty first, so they
+ *	also overtake other clients' bulk traffic. A client can be on both lists at once,
+ *	and is passed over on the second if it's already busy or has nothing left.
+ *
+ *	dndQueueLock must be held when touching the ready lists, any client's queue or
+ *	ready fields, or (because the dispatch threads index into it) when moving the
+ *	port list itself.
+ */
+#define QUEUE_SIZE			16
+#define DISPATCH_THREADS	1
+#define DISPATCH_THREADS_MAX	64
+static pthread_mutex_t dndQueueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dndQueueCond = PTHREAD_COND_INITIALIZER;
+static CFIndex dndReadyFirst = kCFNotFound;
+static CFIndex dndReadyLast = kCFNotFound;
+static CFIndex dndUrgentFirst = kCFNotFound;
+static CFIndex dndUrgentLast = kCFNotFound;
+static CFIndex dndDispatchThreads = DISPATCH_THREADS;
+
+/*
+ *	A client's queue holds at most dndQueueLimit notifications (0 meaning no limit).
+ *	What happens to a notification arriving for a client with a full queue is decided
+ *	by dndQueuePolicy: the oldest one waiting is discarded to make room, the new one
+ *	is discarded, or the client is disconnected and its whole queue discarded.
+ */
+enum {
+	OVERFLOW_DROP_OLDEST,
+	OVERFLOW_DROP_NEWEST,
+	OVERFLOW_DISCONNECT
+};
+
+#define QUEUE_LIMIT		1024
+static CFIndex dndQueueLimit = QUEUE_LIMIT;
+static int dndQueuePolicy = OVERFLOW_DROP_OLDEST;
+static CFIndex dndQueueDropped = 0;		// total across all clients
+
+/*
+ *	Each client's send timeout adapts to how long sends to it have been taking: their
+ *	smoothed time plus four times its mean deviation, as TCP times retransmissions,
+ *	kept between SEND_TIMEOUT_MIN and SEND_TIMEOUT_MAX. Each timeout in a row doubles
+ *	it, up to the same maximum. A new client starts at the maximum.
+ *
+ *	After dndBreakerTimeouts timeouts in a row (0 meaning never) the client's circuit
+ *	breaker trips. It's parked: what was being sent to it is dropped, and nothing more
+ *	is sent until BREAKER_BACKOFF later. Notifications still queue for it meanwhile,
+ *	up to the queue limit. Then a single one is sent as a probe, so that a client
+ *	which is still stuck costs a dispatch thread one more timeout. If it gets
+ *	through the client recovers and everything waiting is sent, otherwise it's
+ *	parked again for twice as long, up to BREAKER_BACKOFF_MAX.
+ */
+#define SEND_TIMEOUT_MIN	0.1
+#define SEND_TIMEOUT_MAX	1.0
+#define BREAKER_TIMEOUTS	3
+#define BREAKER_BACKOFF		250000000ULL	// nanoseconds
+#define BREAKER_BACKOFF_MAX	30000000000ULL
+static CFIndex dndBreakerTimeouts = BREAKER_TIMEOUTS;
+static CFIndex dndParkedCount = 0;
+
+/*
+ *	When coalescing is turned on, a notification with the same name and object as one
+ *	still waiting in the client's queue replaces that one's data rather than being
+ *	queued behind it, saving a send.
+ */
+static Boolean dndCoalesce = FALSE;
+static CFIndex dndQueueCoalesced = 0;	// total across all clients
+
+/*
+ *	Clients which registered with DND_PORT_BATCH_DELIVERY have what's waiting in their
+ *	queue sent as NOTIFICATION_BATCH messages, each holding at most dndBatchCount
+ *	notifications and, unless a single notification is larger, dndBatchSize bytes.
+ */
+#define BATCH_COUNT		64
+#define BATCH_SIZE		65536
+static CFIndex dndBatchCount = BATCH_COUNT;
+static CFIndex dndBatchSize = BATCH_SIZE;
+
+/*
+ *	Running totals, reported by STATS. Those counting posts are only touched by the
+ *	main thread, the rest only with dndQueueLock held.
+ *
+ *	The busiest names are found with the Space-Saving algorithm: there are TOP_NAMES
+ *	counters, and a name without one takes over that of the least posted name, adding
+ *	to its count. So a name's count is never low, and is high by at most the count it
+ *	took over, but any name making up more than 1/TOP_NAMES of the posts has a counter.
+ */
+#define TOP_NAMES	16
+static UInt64 dndStarted = 0;
+static CFIndex dndStatPosts = 0;
+static CFIndex dndStatPostMessages = 0;
+static CFIndex dndStatMatched = 0;
+static CFIndex dndStatMatches = 0;
+static CFIndex dndStatQueued = 0;
+static CFIndex dndStatUrgent = 0;
+static CFIndex dndStatHeld = 0;
+static CFIndex dndStatSends = 0;
+static CFIndex dndStatDelivered = 0;
+static CFIndex dndStatSendFailures = 0;
+static CFIndex dndStatSendTimeouts = 0;
+static CFIndex dndStatDisconnects = 0;
+static CFIndex dndStatTrips = 0;
+static CFIndex dndStatRecoveries = 0;
+static dndStatsName dndTopNames[TOP_NAMES];
+static CFIndex dndTopNameCount = 0;
+
+/*
+ *	Latency histograms, also reported by STATS. The main thread times each message it
+ *	handles, by type. Every thread which matches notifications times each match, and
+ *	every dispatch thread each send and how long the notifications in it had waited.
+ *	Each of those threads has its own dndTimes, which only it records into and only
+ *	with its lock held, so that the main thread can take the lock to read them.
+ */
+#define MESSAGE_TYPES	(TRACE + 1)
+typedef struct dndTimes {
+	pthread_mutex_t lock;
+	dndHistogram match;
+	dndHistogram wait;
+	dndHistogram urgentWait;
+	dndHistogram send;
+} dndTimes;
+
+static dndHistogram dndHandlerTimes[MESSAGE_TYPES];
+static dndTimes *dndThreadTimes = NULL;		// the main thread's, each worker's, then each dispatch thread's
+static CFIndex dndThreadTimesCount = 0;
+
+/*
+ *	The notifications list is stored as parallel arrays, one for each field of the
+ *	records, so that matching only pulls in the fields it compares. Indices of
+ *	records, in the list and its chains, are 32 bits, leaving room for 16 names or
+ *	objects to a cache line, or 16 chain links. The links which only the main thread
+ *	uses, to find and remove records, are kept apart in dndNotLinks.
+ */
+typedef struct dndNotLinks {
+	SInt32 prev;		// previous in the record's index chain, or kCFNotFound
+	SInt32 clientNext;	// neighbours among the same client's records
+	SInt32 clientPrev;
+} dndNotLinks;
+
+/*
+ *	The notifications list and the index over it, in a form which can be matched
+ *	against without any locking. The main thread keeps the working copy of each
+ *	table. When shard workers are matching against it, it also publishes read-only
+ *	copies for them.
+ *
+ *	Index over the notifications list, so that a post only has to look at records
+ *	which could possibly match it. Every record is filed under its client's session
+ *	as well as its name and object. Records naming both a notification and an object
+ *	are chained from notIndex by the hash of the pair, records observing any object
+ *	(object == 0) from nameIndex by their name, and records observing any name
+ *	(name == 0) from objectIndex by their object, each hash taken with the session.
+ *	Records observing everything share their session's wildcards chain. A post to its
+ *	own session visits at most four chains, and none at all if no client in that
+ *	session has any records. A post to all sessions visits four in each session.
+ *
+ *	All three bucket tables have notIndexMask + 1 entries, which is always a power
+ *	of two, and are doubled whenever the number of records outgrows them.
+ */
+
+// a session with records in a table
+typedef struct dndNotSession {
+	long session;
+	CFIndex records;
+	CFIndex anyName;	// its records observing every name, whatever their object
+	SInt32 wildcards;	// its records observing every name and object
+} dndNotSession;
+
+typedef struct dndNotTable {
+	// the first notListCount records are all live: removing one moves the last
+	//	record into its place
+	CFHashCode *notNames;
+	CFHashCode *notObjects;
+	long *notSessions;
+	SInt32 *notNext;	// next in the record's index chain, or kCFNotFound
+	SInt32 *notClients;	// the port slot of the client the record is for
+	UInt8 *notBehaviors;	// its CFNotificationSuspensionBehavior
+	CFIndex notListCount;
+	SInt32 *notIndex;
+	SInt32 *nameIndex;
+	SInt32 *objectIndex;
+	CFIndex notIndexMask;
+	dndNotSession *sessions;	// in no particular order
+	CFIndex sessionCount;
+	CFIndex *generations;	// by port slot, the generation the client's records were made for
+	CFIndex clientCount;
+} dndNotTable;
+
+// how a thread matching notifications marks the clients it's found, by port slot
+typedef struct dndMark {
+	CFIndex mark;		// serial of the last notification matched to this client
+	CFIndex match;		// the client's entry in the matches of that notification
+} dndMark;
+
+typedef struct dndMatcher {
+	dndEpochReaderRef reader;	// NULL for the main thread, which reads the working copy
+	CFIndex serial;		// incremented for each notification
+	dndMark *marks;
+	CFIndex markCapacity;
+	dndMatch *matches;	// where a notification's matches are gathered, with room for markCapacity
+	dndTimes *times;
+} dndMatcher;
+
+// a request handed from the main thread to a shard's worker thread
+typedef struct dndShardOp {
+	int op;
+	CFDataRef data;
+} dndShardOp;
+
+enum {
+	SHARD_NOTIFICATION,		// data is a NOTIFICATION message
+	SHARD_NOTIFICATION_BATCH	// data is a NOTIFICATION_BATCH message
+};
+
+/*
+ *	The notifications list, and the index over it, are split into shards by the hash
+ *	of the notification name. Each post only ever needs to look at the one shard its
+ *	name belongs to. Records observing any name (name == 0) could match a post to any
+ *	name, so they're copied into every shard.
+ *
+ *	By default there's a single shard, and the main thread does all the work on it as
+ *	it receives messages. Started with -w, there's a shard for each of that many
+ *	worker threads. The main thread then only decodes posts and queues each on the
+ *	worker for the shard its name belongs to, which does the matching. Each worker
+ *	handles its posts in the order they arrived, so notifications with one name are
+ *	still delivered in the order they were posted. Notifications with different
+ *	names may overtake each other.
+ *
+ *	Registrations are always applied by the main thread, to the working copy of each
+ *	shard's table. With workers, the main thread then publishes a fresh read-only copy
+ *	of each table it changed before handling its next message. So a post always sees
+ *	every registration received before it. The workers match against whichever copy
+ *	is current without locking, and old copies are freed once no worker can still be
+ *	reading them (see dndepoch.h). Since registrations are so much rarer than posts,
+ *	copying a whole shard for each is cheap next to locking for every post.
+ *
+ *	A worker may still match a notification against a client's records after the
+ *	client has been reaped. Each port slot carries a generation, bumped whenever it's
+ *	reused, so that a match made for the slot's previous client is never delivered to
+ *	its next one.
+ */
+typedef struct dndShard {
+	dndNotTable table;		// the working copy, only ever touched by the main thread
+	dndNotLinks *notLinks;	// ...and the rest of its records
+	CFIndex notListCapacity;
+	CFIndex sessionCapacity;
+	SInt32 *clientNots;		// by port slot, the client's first record in the list
+	Boolean changed;		// TRUE if the table has changed since it was last published
+	dndNotTable * volatile published;
+
+	// the worker, when there is one, and the posts waiting for it
+	dndMatcher matcher;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	dndShardOp *ops;
+	CFIndex opCount;
+	CFIndex opCapacity;
+} dndShard;
+
+// a request to add or remove a record, with the client's uid already resolved
+typedef struct dndShardReg {
+	CFIndex index;
+	CFIndex generation;
+	long session;
+	CFHashCode name;
+	CFHashCode object;
+	CFNotificationSuspensionBehavior sb;
+} dndShardReg;
+
+#define NOT_LIST_SIZE	256
+#define NOT_INDEX_SIZE	256
+#define SHARD_CLIENTS	64
+#define SHARD_SESSIONS	4
+static dndShard *dndShards = NULL;
+static CFIndex dndShardCount = 1;
+static CFIndex dndWorkerThreads = 0;	// 0 for the main thread to do everything
+#define WORKER_THREADS_MAX	64		// and so the most shards there can be
+static dndMatcher dndMainMatcher = { NULL, 0, NULL, 0, NULL, NULL };
+
+// with -m, when at least MATCH_SCAN_PERCENT of the records a post could match observe
+//	every name, the chains would visit so much of the table that it's quicker to scan
+//	the lot with a vector kernel. dnotmatch puts AVX2 ahead of the chains from about
+//	here, and SSE2 never. NULL, the default, never scans
+#define MATCH_SCAN_PERCENT	75
+static const dndMatchKernel *dndScanKernel = NULL;
+
+/*
+ *	Simple console-output-based diagnostic functions, really very definately 
+ *	not to be left active in the final released code
+ */
+void _dndPrintPorts( void );
+void _dndPrintNots( dndShard *shard );
+
+void _dndPrintPorts( void )
+{
+    printf("PORT LIST: (count = %ld, capacity = %ld, dropped = %ld, coalesced = %ld)\n", (long)dndPortListCount, (long)dndPortListCapacity, (long)dndQueueDropped, (long)dndQueueCoalesced);
+	
+	CFIndex count = dndPortListCount;
+	CFIndex index = 0;
+	dndPortRecord *ports = dndPortList;
+	while(count--)
+	{
+		if( !ports->live )
+		{
+            printf("  %3ld: --FREE--\n", (long)index++);
+			ports++;
+			continue;
+		}
+        printf("  %3ld: name hash = 0x%lX, session = %ld, queued = %ld, dropped = %ld, coalesced = %ld\n", (long)index++, ports->name, ports->session, (long)ports->count, (long)ports->dropped, (long)ports->coalesced);
+		ports++;
+	}
+}
+
+void _dndPrintNots( dndShard *shard )
+{
+    printf("NOTIFICATIONS LIST: (shard = %ld, count = %ld, capacity = %ld)\n", (long)(shard - dndShards), (long)shard->table.notListCount, (long)shard->notListCapacity);
+	
+	const dndNotTable *table = &shard->table;
+	for( CFIndex rec = 0; rec < table->notListCount; rec++ )
+	{
+        printf("  %3ld: index: %4ld name: 0x%8lX object: 0x%8lX session: %ld\n", (long)rec, (long)table->notClients[rec], table->notNames[rec], table->notObjects[rec], table->notSessions[rec]);
+	}
+}
+
+// amount of log noise we create
+static Boolean verbose = FALSE;
+
+/*
+ *	Tracing. Each thread keeps its last dndTraceEvents events (see dndtrace.h), which
+ *	can be fetched with a TRACE request or written to dndTracePath on SIGUSR2.
+ */
+#define TRACE_SIZE	4096
+#define TRACE_SIZE_MAX	(1 << 20)
+#define TRACE_PATH	"/var/run/ddistnoted.trace"
+static CFIndex dndTraceEvents = TRACE_SIZE;
+static const char *dndTracePath = TRACE_PATH;
+
+/*
+ *	Notification index maintenance
+ */
+static CFHashCode _dndNotHash( CFHashCode name, CFHashCode object )
+{
+	CFHashCode hash = (name * 2654435761UL) ^ object;
+	return hash ^ (hash >> 16);
+}
+
+// the hash a record with this name and object, in this session, is chained by
+static CFHashCode _dndNotKey( CFHashCode name, CFHashCode object, long session )
+{
+	return _dndNotHash(_dndNotHash(name, object), (CFHashCode)session);
+}
+
+// a session's entry in the table, or kCFNotFound if none of its clients have records
+static CFIndex _dndNotSessionFind( const dndNotTable *table, long session )
+{
+	for( CFIndex i = 0; i < table->sessionCount; i++ )
+		if( table->sessions[i].session == session ) return i;
+	return kCFNotFound;
+}
+
+// the chain a record with this name and object is kept on. its session must have an entry
+static SInt32 *_dndNotChain( dndNotTable *table, CFHashCode name, CFHashCode object, long session )
+{
+	if( (name == 0) && (object == 0) ) return &table->sessions[_dndNotSessionFind(table, session)].wildcards;
+
+	SInt32 *buckets;
+	if( object == 0 ) buckets = table->nameIndex;
+	else if( name == 0 ) buckets = table->objectIndex;
+	else buckets = table->notIndex;
+
+	return buckets + (_dndNotKey(name, object, session) & table->notIndexMask);
+}
+
+static void _dndNotIndexInsert( dndNotTable *table, dndNotLinks *links, SInt32 rec )
+{
+	SInt32 *head = _dndNotChain(table, table->notNames[rec], table->notObjects[rec], table->notSessions[rec]);
+
+	links[rec].prev = kCFNotFound;
+	table->notNext[rec] = *head;
+	if( *head != kCFNotFound ) links[*head].prev = rec;
+	*head = rec;
+}
+
+static void _dndNotIndexRemove( dndNotTable *table, dndNotLinks *links, SInt32 rec )
+{
+	SInt32 prev = links[rec].prev, next = table->notNext[rec];
+
+	if( prev == kCFNotFound )
+		*_dndNotChain(table, table->notNames[rec], table->notObjects[rec], table->notSessions[rec]) = next;
+	else
+		table->notNext[prev] = next;
+
+	if( next != kCFNotFound ) links[next].prev = prev;
+}
+
+/*
+ *	(Re)allocate the bucket tables with the given number of entries and chain every
+ *	live record back into them. Returns FALSE, leaving the old tables in place, if
+ *	the memory couldn't be found.
+ */
+static Boolean _dndNotIndexResize( dndNotTable *table, dndNotLinks *links, CFIndex size )
+{
+	SInt32 *exact = malloc(size * sizeof(SInt32));
+	SInt32 *names = malloc(size * sizeof(SInt32));
+	SInt32 *objects = malloc(size * sizeof(SInt32));
+	if( (exact == NULL) || (names == NULL) || (objects == NULL) )
+	{
+		fprintf(stderr, "Unable to allocate notification index (%ld buckets).\n", (long)size);
+		free(exact);
+		free(names);
+		free(objects);
+		return FALSE;
+	}
+
+	for( CFIndex i = 0; i < size; i++ ) exact[i] = names[i] = objects[i] = kCFNotFound;
+
+	free(table->notIndex);
+	free(table->nameIndex);
+	free(table->objectIndex);
+	table->notIndex = exact;
+	table->nameIndex = names;
+	table->objectIndex = objects;
+	table->notIndexMask = size - 1;
+	for( CFIndex i = 0; i < table->sessionCount; i++ ) table->sessions[i].wildcards = kCFNotFound;
+
+	for( SInt32 rec = 0; rec < table->notListCount; rec++ )
+		_dndNotIndexInsert(table, links, rec);
+
+	return TRUE;
+}
+
+// the test applied to every candidate record in a session a notification is checked against,
+//	since other sessions' records can share a chain
+static Boolean _dndNotMatches( const dndNotTable *table, SInt32 rec, const dndNotHeader *info, long session )
+{
+	CFHashCode name = table->notNames[rec], object = table->notObjects[rec];
+	return /* name */ ((name == 0) || (name == info->name))
+		/* object */ && ((object == 0) || (object == info->object))
+		/* session */ && (table->notSessions[rec] == session);
+}
+
+/*
+ *	Port map maintenance
+ */
+static CFIndex _dndPortLookup( CFHashCode uid )
+{
+	CFIndex i = _dndNotHash(uid, 0) & dndPortMapMask;
+	while( dndPortMap[i].slot != kCFNotFound )
+	{
+		if( dndPortMap[i].uid == uid ) return dndPortMap[i].slot;
+		i = (i + 1) & dndPortMapMask;
+	}
+	return kCFNotFound;
+}
+
+static void _dndPortMapSet( CFHashCode uid, CFIndex slot )
+{
+	CFIndex i = _dndNotHash(uid, 0) & dndPortMapMask;
+	while( (dndPortMap[i].slot != kCFNotFound) && (dndPortMap[i].uid != uid) )
+		i = (i + 1) & dndPortMapMask;
+	dndPortMap[i].uid = uid;
+	dndPortMap[i].slot = slot;
+}
+
+// rebuild the map, with the given number of entries, from the port list
+static Boolean _dndPortMapResize( CFIndex size )
+{
+	dndPortMapEntry *map = malloc(size * sizeof(dndPortMapEntry));
+	if( map == NULL )
+	{
+		fprintf(stderr, "Unable to allocate port map (%ld entries).\n", (long)size);
+		return FALSE;
+	}
+	for( CFIndex i = 0; i < size; i++ ) map[i].slot = kCFNotFound;
+
+	free(dndPortMap);
+	dndPortMap = map;
+	dndPortMapMask = size - 1;
+
+	for( CFIndex slot = 0; slot < dndPortListCount; slot++ )
+		if( dndPortList[slot].live ) _dndPortMapSet(dndPortList[slot].name, slot);
+
+	return TRUE;
+}
+
+// remove a uid, shifting back any entries which probed past it
+static void _dndPortMapRemove( CFHashCode uid )
+{
+	CFIndex i = _dndNotHash(uid, 0) & dndPortMapMask;
+	while( dndPortMap[i].uid != uid )
+	{
+		if( dndPortMap[i].slot == kCFNotFound ) return;
+		i = (i + 1) & dndPortMapMask;
+	}
+	if( dndPortMap[i].slot == kCFNotFound ) return;
+
+	CFIndex j = i;
+	while(TRUE)
+	{
+		j = (j + 1) & dndPortMapMask;
+		if( dndPortMap[j].slot == kCFNotFound ) break;
+
+		// an entry can fill the hole only if its home bucket isn't between the two
+		CFIndex home = _dndNotHash(dndPortMap[j].uid, 0) & dndPortMapMask;
+		if( (i < j) ? ((home > i) && (home <= j)) : ((home > i) || (home <= j)) ) continue;
+
+		dndPortMap[i] = dndPortMap[j];
+		i = j;
+	}
+	dndPortMap[i].slot = kCFNotFound;
+}
+
+static Boolean _dndPortMapInsert( CFHashCode uid, CFIndex slot )
+{
+	if( ((dndPortListCount + 1) * 2 > dndPortMapMask + 1) && !_dndPortMapResize((dndPortMapMask + 1) * 2) )
+		return FALSE;
+	_dndPortMapSet(uid, slot);
+	return TRUE;
+}
+
+/*
+ *	Check that a uid is valid, and return its index into the ports table, or
+ *	kCFNotFound if it isn't.
+ */
+static CFIndex _dndClientIndex( CFHashCode uid )
+{
+	CFIndex index = _dndPortLookup(uid);
+	if( index == kCFNotFound )
+	{
+		if(verbose) fprintf(stderr, "Recieved request from unregistered port (0x%lX).\n", uid);
+		return kCFNotFound;
+	}
+	if( (dndPortList[index].port == NULL) || dndPortList[index].dead ) return kCFNotFound; // un-registered port
+	return index;
+}
+
+/*
+ *	Delivery queues. All of these must be called with dndQueueLock held.
+ */
+
+// mark a client as dead, and wake the main thread to reap it
+static void _dndQueueDisconnect( dndPortRecord *ports )
+{
+	if( ports->dead ) return;
+	if(verbose) fprintf(stderr, "Disconnecting client 0x%lX with %ld notifications queued.\n", ports->name, (long)ports->count);
+	dndTrace(TRACE_DISCONNECTED, (UInt32)ports->count, ports->name);
+	dndStatDisconnects++;
+
+	ports->dead = TRUE;
+	dndSourceSignal(dndPortTransport, dndReaper);
+}
+
+// add a notification to the end of a client's queue, growing it as needed, whatever its limit
+static Boolean _dndQueueAppend( dndPortRecord *ports, const dndNotHeader *info, CFDataRef data, UInt64 time )
+{
+	if( ports->count == ports->capacity )
+	{
+		CFIndex capacity = (ports->capacity == 0) ? QUEUE_SIZE : (ports->capacity * 2);
+		dndQueue *queue = malloc(capacity * sizeof(dndQueue));
+		if( queue == NULL )
+		{
+			fprintf(stderr, "Unable to allocate queue of %ld notifications.\n", (long)capacity);
+			return FALSE;
+		}
+
+		// unwrap the ring into the new buffer
+		for( CFIndex i = 0; i < ports->count; i++ )
+			queue[i] = ports->queue[(ports->first + i) % ports->capacity];
+
+		free(ports->queue);
+		ports->queue = queue;
+		ports->first = 0;
+		ports->capacity = capacity;
+	}
+
+	dndQueue *entry = ports->queue + ((ports->first + ports->count) % ports->capacity);
+	entry->name = info->name;
+	entry->object = info->object;
+	entry->data = CFRetain(data);
+	entry->time = time;
+	ports->count++;
+	dndStatQueued++;
+	dndTrace(TRACE_QUEUED, (UInt32)ports->count, ports->name);
+	return TRUE;
+}
+
+/*
+ *	Add a notification to the end of a client's queue. If the queue is already at
+ *	its limit the overflow policy is applied, and FALSE returned if that meant the
+ *	notification wasn't queued. A notification coalesced into one already waiting
+ *	keeps that one's time.
+ */
+static Boolean _dndQueuePush( dndPortRecord *ports, const dndNotHeader *info, CFDataRef data, UInt64 time )
+{
+	if( dndCoalesce )
+	{
+		// newest first, since a repeated notification is most likely to be recent
+		for( CFIndex i = ports->count - 1; i >= 0; i-- )
+		{
+			dndQueue *entry = ports->queue + ((ports->first + i) % ports->capacity);
+			if( (entry->name == info->name) && (entry->object == info->object) )
+			{
+				CFRelease(entry->data);
+				entry->data = CFRetain(data);
+				ports->coalesced++;
+				dndQueueCoalesced++;
+				return TRUE;
+			}
+		}
+	}
+
+	if( (dndQueueLimit != 0) && (ports->count >= dndQueueLimit) )
+	{
+		switch(dndQueuePolicy)
+		{
+			case OVERFLOW_DROP_OLDEST:
+				dndTrace(TRACE_DROPPED, (UInt32)ports->count, ports->name);
+				CFRelease(ports->queue[ports->first].data);
+				ports->first = (ports->first + 1) % ports->capacity;
+				ports->count--;
+				ports->dropped++;
+				dndQueueDropped++;
+				break;
+
+			case OVERFLOW_DROP_NEWEST:
+				dndTrace(TRACE_DROPPED, (UInt32)ports->count, ports->name);
+				ports->dropped++;
+				dndQueueDropped++;
+				return FALSE;
+
+			case OVERFLOW_DISCONNECT:
+				dndTrace(TRACE_DROPPED, (UInt32)ports->count, ports->name);
+				ports->dropped++;
+				dndQueueDropped++;
+				_dndQueueDisconnect(ports);
+				return FALSE;
+		}
+	}
+
+	return _dndQueueAppend(ports, info, data, time);
+}
+
+// whether a client has notifications waiting which a dispatch thread could send now
+static Boolean _dndQueueSendable( const dndPortRecord *ports )
+{
+	if( ports->busy || ((ports->count + ports->urgentCount) == 0) ) return FALSE;
+	return !ports->parked || (ports->retry <= dndNanoseconds());
+}
+
+/*
+ *	Put a client with notifications waiting onto the end of the urgent ready list if
+ *	any of them are urgent, otherwise the ready list, unless it's already on one.
+ */
+static void _dndQueueReady( CFIndex index )
+{
+	dndPortRecord *ports = dndPortList + index;
+	if( !_dndQueueSendable(ports) ) return;
+
+	if( ports->urgentCount != 0 )
+	{
+		if( ports->urgentListed ) return;
+		ports->urgentListed = TRUE;
+		ports->urgentReady = kCFNotFound;
+		if( dndUrgentLast == kCFNotFound )
+			dndUrgentFirst = index;
+		else
+			dndPortList[dndUrgentLast].urgentReady = index;
+		dndUrgentLast = index;
+	}
+	else
+	{
+		if( ports->listed || ports->urgentListed ) return;
+		ports->listed = TRUE;
+		ports->ready = kCFNotFound;
+		if( dndReadyLast == kCFNotFound )
+			dndReadyFirst = index;
+		else
+			dndPortList[dndReadyLast].ready = index;
+		dndReadyLast = index;
+	}
+
+	pthread_cond_signal(&dndQueueCond);
+}
+
+/*
+ *	Add a notification to the end of a client's urgent lane. The lane has a limit of
+ *	its own, of dndQueueLimit, beyond which new notifications are dropped, or with the
+ *	disconnect policy the client is disconnected.
+ */
+static Boolean _dndUrgentPush( dndPortRecord *ports, const dndNotHeader *info, CFDataRef data, UInt64 time )
+{
+	if( (dndQueueLimit != 0) && (ports->urgentCount >= dndQueueLimit) )
+	{
+		dndTrace(TRACE_DROPPED, (UInt32)ports->urgentCount, ports->name);
+		ports->dropped++;
+		dndQueueDropped++;
+		if( dndQueuePolicy == OVERFLOW_DISCONNECT ) _dndQueueDisconnect(ports);
+		return FALSE;
+	}
+
+	if( ports->urgentCount == ports->urgentCapacity )
+	{
+		CFIndex capacity = (ports->urgentCapacity == 0) ? QUEUE_SIZE : (ports->urgentCapacity * 2);
+		void *ptr = realloc(ports->urgent, capacity * sizeof(dndQueue));
+		if( ptr == NULL )
+		{
+			fprintf(stderr, "Unable to allocate %ld urgent notifications.\n", (long)capacity);
+			return FALSE;
+		}
+		ports->urgent = ptr;
+		ports->urgentCapacity = capacity;
+	}
+
+	dndQueue *entry = ports->urgent + ports->urgentCount++;
+	entry->name = info->name;
+	entry->object = info->object;
+	entry->data = CFRetain(data);
+	entry->time = time;
+	dndStatQueued++;
+	dndStatUrgent++;
+	dndTrace(TRACE_QUEUED, (UInt32)ports->urgentCount, ports->name);
+	return TRUE;
+}
+
+/*
+ *	Hold a notification for a suspended client until it resumes. If coalesce is TRUE
+ *	it replaces any held notification with the same name and object. Held
+ *	notifications count against the queue limit; once that's reached any more are
+ *	dropped.
+ */
+static void _dndHeldPush( dndPortRecord *ports, const dndNotHeader *info, CFDataRef data, Boolean coalesce )
+{
+	if( coalesce )
+	{
+		for( CFIndex i = ports->heldCount - 1; i >= 0; i-- )
+		{
+			dndQueue *entry = ports->held + i;
+			if( (entry->name == info->name) && (entry->object == info->object) )
+			{
+				CFRelease(entry->data);
+				entry->data = CFRetain(data);
+				ports->coalesced++;
+				dndQueueCoalesced++;
+				return;
+			}
+		}
+	}
+
+	if( (dndQueueLimit != 0) && (ports->heldCount >= dndQueueLimit) )
+	{
+		dndTrace(TRACE_DROPPED, (UInt32)ports->heldCount, ports->name);
+		ports->dropped++;
+		dndQueueDropped++;
+		return;
+	}
+
+	if( ports->heldCount == ports->heldCapacity )
+	{
+		CFIndex capacity = (ports->heldCapacity == 0) ? QUEUE_SIZE : (ports->heldCapacity * 2);
+		void *ptr = realloc(ports->held, capacity * sizeof(dndQueue));
+		if( ptr == NULL )
+		{
+			fprintf(stderr, "Unable to allocate %ld held notifications.\n", (long)capacity);
+			return;
+		}
+		ports->held = ptr;
+		ports->heldCapacity = capacity;
+	}
+
+	dndQueue *entry = ports->held + ports->heldCount++;
+	entry->name = info->name;
+	entry->object = info->object;
+	entry->data = CFRetain(data);
+	dndStatHeld++;
+	dndTrace(TRACE_HELD, (UInt32)ports->heldCount, ports->name);
+}
+
+/*
+ *	Queue a notification for a matched client, taking its suspension into account
+ *	unless it's to be delivered immediately, in which case it goes in the urgent lane.
+ *	time is when it was matched, which its wait to be sent is measured from.
+ */
+static void _dndDeliver( const dndMatch *match, const dndNotHeader *info, CFDataRef data, UInt64 time )
+{
+	CFIndex index = match->index;
+	dndPortRecord *ports = dndPortList + index;
+	if( (ports->port == NULL) || ports->dead || (ports->generation != match->generation) ) return;
+
+	if( info->flags & kCFNotificationDeliverImmediately )
+	{
+		if( _dndUrgentPush(ports, info, data, time) ) _dndQueueReady(index);
+		return;
+	}
+
+	if( ports->suspended )
+	{
+		switch(match->sb)
+		{
+			case CFNotificationSuspensionBehaviorDrop:
+				return;
+
+			case CFNotificationSuspensionBehaviorCoalesce:
+				_dndHeldPush(ports, info, data, TRUE);
+				return;
+
+			case CFNotificationSuspensionBehaviorHold:
+				_dndHeldPush(ports, info, data, FALSE);
+				return;
+
+			default: // CFNotificationSuspensionBehaviorDeliverImmediately
+				break;
+		}
+	}
+
+	if( _dndQueuePush(ports, info, data, time) ) _dndQueueReady(index);
+}
+
+/*
+ *	The number of the count queued notifications starting at items which fit in the
+ *	next batch sent to a client, which is always at least one.
+ */
+static CFIndex _dndBatchLength( const dndQueue *items, CFIndex count )
+{
+	if( count > dndBatchCount ) count = dndBatchCount;
+	CFIndex size = sizeof(dndFrameHeader) + CFDataGetLength(items[0].data);
+	CFIndex n;
+	for( n = 1; n < count; n++ )
+	{
+		size += sizeof(dndFrameHeader) + CFDataGetLength(items[n].data);
+		if( size > dndBatchSize ) break;
+	}
+	return n;
+}
+
+/*
+ *	Fold the time a successful send took into a client's estimate, returning the
+ *	timeout for its next send.
+ */
+static CFTimeInterval _dndSendEstimate( UInt64 *average, UInt64 *deviation, UInt64 took )
+{
+	if( *average == 0 )
+	{
+		*average = took;
+		*deviation = took / 2;
+	}
+	else
+	{
+		UInt64 error = (took > *average) ? (took - *average) : (*average - took);
+		*deviation = (3 * *deviation + error) / 4;
+		*average = (7 * *average + took) / 8;
+	}
+
+	CFTimeInterval timeout = (*average + 4 * *deviation) / 1e9;
+	if( timeout < SEND_TIMEOUT_MIN ) return SEND_TIMEOUT_MIN;
+	if( timeout > SEND_TIMEOUT_MAX ) return SEND_TIMEOUT_MAX;
+	return timeout;
+}
+
+// park a client, or keep it parked for longer after a failed probe, dropping the unsent
+//	notifications which were taken from its queue
+static void _dndBreakerTrip( dndPortRecord *ports, CFIndex unsent )
+{
+	ports->dropped += unsent;
+	dndQueueDropped += unsent;
+
+	if( ports->parked )
+	{
+		ports->backoff *= 2;
+		if( ports->backoff > BREAKER_BACKOFF_MAX ) ports->backoff = BREAKER_BACKOFF_MAX;
+	}
+	else
+	{
+		ports->parked = TRUE;
+		ports->backoff = BREAKER_BACKOFF;
+		dndParkedCount++;
+		dndStatTrips++;
+	}
+	ports->retry = dndNanoseconds() + ports->backoff;
+	dndTrace(TRACE_PARKED, (UInt32)(ports->backoff / 1000000), ports->name);
+}
+
+static void _dndBreakerRecover( dndPortRecord *ports )
+{
+	if( !ports->parked ) return;
+	ports->parked = FALSE;
+	dndParkedCount--;
+	dndStatRecoveries++;
+	dndTrace(TRACE_RECOVERED, (UInt32)ports->count, ports->name);
+}
+
+/*
+ *	Wait for a client to be readied, or until the next parked one is due to be probed.
+ *	Any parked clients which are already due, and have something waiting, are readied.
+ */
+static void _dndParkedWait( void )
+{
+	UInt64 now = dndNanoseconds(), next = 0;
+	for( CFIndex i = 0; i < dndPortListCount; i++ )
+	{
+		dndPortRecord *ports = dndPortList + i;
+		if( !ports->parked || ports->dead ) continue;
+		if( ports->retry <= now )
+			_dndQueueReady(i);
+		else if( (next == 0) || (ports->retry < next) )
+			next = ports->retry;
+	}
+	if( (dndReadyFirst != kCFNotFound) || (dndUrgentFirst != kCFNotFound) ) return;
+
+	if( next == 0 )
+	{
+		pthread_cond_wait(&dndQueueCond, &dndQueueLock);
+		return;
+	}
+
+	// the condition waits against the wall clock
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	UInt64 nanoseconds = (UInt64)tv.tv_usec * 1000 + (next - now);
+	struct timespec deadline;
+	deadline.tv_sec = tv.tv_sec + (time_t)(nanoseconds / 1000000000);
+	deadline.tv_nsec = (long)(nanoseconds % 1000000000);
+	pthread_cond_timedwait(&dndQueueCond, &dndQueueLock, &deadline);
+}
+
+/*
+ *	Dispatch thread. Takes the client at the head of the urgent ready list, or else
+ *	the ready list, empties its queue and then, with the lock released, sends each
+ *	notification in turn. Only these threads ever block on a client, so a slow one
+ *	can't hold up the main thread's handling of incoming messages.
+ */
+static void *_dndDispatchThread( void *arg )
+{
+	dndTimes *times = arg;
+	dndQueue *batch = NULL;
+	CFIndex batchCapacity = 0;
+	CFMutableDataRef frames = CFDataCreateMutable( kCFAllocatorDefault, 0 );
+
+	pthread_mutex_lock(&dndQueueLock);
+	while(TRUE)
+	{
+		while( (dndReadyFirst == kCFNotFound) && (dndUrgentFirst == kCFNotFound) )
+		{
+			if( dndParkedCount == 0 )
+				pthread_cond_wait(&dndQueueCond, &dndQueueLock);
+			else
+				_dndParkedWait();
+		}
+
+		CFIndex index;
+		dndPortRecord *ports;
+		if( dndUrgentFirst != kCFNotFound )
+		{
+			index = dndUrgentFirst;
+			ports = dndPortList + index;
+			dndUrgentFirst = ports->urgentReady;
+			if( dndUrgentFirst == kCFNotFound ) dndUrgentLast = kCFNotFound;
+			ports->urgentListed = FALSE;
+		}
+		else
+		{
+			index = dndReadyFirst;
+			ports = dndPortList + index;
+			dndReadyFirst = ports->ready;
+			if( dndReadyFirst == kCFNotFound ) dndReadyLast = kCFNotFound;
+			ports->listed = FALSE;
+		}
+		// already taken from the other list
+		if( !_dndQueueSendable(ports) ) continue;
+		ports->busy = TRUE;
+
+		CFIndex waiting = ports->urgentCount + ports->count;
+		if( waiting > batchCapacity )
+		{
+			void *ptr = realloc(batch, waiting * sizeof(dndQueue));
+			if( ptr != NULL )
+			{
+				batch = ptr;
+				batchCapacity = waiting;
+			}
+		}
+
+		// if there was never room for a batch the one at the head still goes, on its
+		//	own, rather than the client going round the ready list with nothing taken
+		dndQueue single;
+		dndQueue *taken = (batchCapacity == 0) ? &single : batch;
+		CFIndex capacity = (batchCapacity == 0) ? 1 : batchCapacity;
+
+		// the urgent lane goes first. a parked client is only sent a single
+		//	notification, as a probe
+		Boolean probing = ports->parked;
+		CFIndex room = probing ? 1 : capacity;
+		CFIndex urgent = (ports->urgentCount < room) ? ports->urgentCount : room;
+		if( urgent != 0 )
+		{
+			memcpy(taken, ports->urgent, urgent * sizeof(dndQueue));
+			ports->urgentCount -= urgent;
+			memmove(ports->urgent, ports->urgent + urgent, ports->urgentCount * sizeof(dndQueue));
+		}
+
+		CFIndex count = (ports->count < room - urgent) ? ports->count : (room - urgent);
+		for( CFIndex i = 0; i < count; i++ )
+			taken[urgent + i] = ports->queue[(ports->first + i) % ports->capacity];
+		if( count != 0 ) ports->first = (ports->first + count) % ports->capacity;
+		ports->count -= count;
+		count += urgent;
+
+		dndEndpointRef port = ports->dead ? NULL : ports->port;
+		if( port != NULL ) dndEndpointRetain(port);
+		CFHashCode uid = ports->name;
+		Boolean batching = ports->batching && (frames != NULL);
+		UInt64 average = ports->sendAverage, deviation = ports->sendDeviation;
+		CFTimeInterval timeout = ports->sendTimeout;
+		CFIndex streak = ports->timeouts;
+
+		pthread_mutex_unlock(&dndQueueLock);
+
+		// a lone or urgent notification goes as it is, even to a client which takes batches
+		Boolean dead = FALSE, tripped = FALSE;
+		CFIndex n, sends = 0, delivered = 0, failures = 0, timeouts = 0, unsent = 0;
+		for( CFIndex i = 0; (i < count) && (port != NULL) && !dead && !tripped; i += n )
+		{
+			n = (batching && (i >= urgent)) ? _dndBatchLength(taken + i, count - i) : 1;
+			SInt32 msgid = NOTIFICATION;
+			CFDataRef data = taken[i].data;
+			if( n > 1 )
+			{
+				dndFrameHeader frame;
+				CFDataSetLength(frames, 0);
+				for( CFIndex j = i; j < i + n; j++ )
+				{
+					frame.length = CFDataGetLength(taken[j].data);
+					CFDataAppendBytes( frames, (const UInt8 *)&frame, sizeof(dndFrameHeader) );
+					CFDataAppendBytes( frames, CFDataGetBytePtr(taken[j].data), frame.length );
+				}
+				msgid = NOTIFICATION_BATCH;
+				data = frames;
+			}
+
+			SInt32 result = dndEndpointIsInvalid;
+			UInt64 start = dndNanoseconds();
+			if( dndEndpointIsValid(port) == TRUE )
+				result = dndEndpointSendRequest( port, msgid, data, timeout, timeout, NULL );
+			dead = (result == dndEndpointIsInvalid) || (result == dndEndpointBecameInvalidError);
+
+			UInt64 end = dndNanoseconds();
+			pthread_mutex_lock(&times->lock);
+			dndHistogramRecord(&times->send, end - start);
+			for( CFIndex j = i; j < i + n; j++ )
+				dndHistogramRecord((j < urgent) ? &times->urgentWait : &times->wait, start - taken[j].time);
+			pthread_mutex_unlock(&times->lock);
+
+			sends++;
+			if( result == dndEndpointSuccess )
+			{
+				delivered += n;
+				streak = 0;
+				timeout = _dndSendEstimate(&average, &deviation, end - start);
+				dndTrace(TRACE_SENT, (UInt32)n, uid);
+			}
+			else
+			{
+				dndTrace(TRACE_SEND_FAILED, (UInt32)result, uid);
+				failures++;
+				if( (result == dndEndpointSendTimeout) || (result == dndEndpointReceiveTimeout) )
+				{
+					timeouts++;
+					streak++;
+					timeout *= 2;
+					if( timeout > SEND_TIMEOUT_MAX ) timeout = SEND_TIMEOUT_MAX;
+					tripped = (dndBreakerTimeouts != 0) && (probing || (streak >= dndBreakerTimeouts));
+					if( tripped ) unsent = count - (i + n);
+				}
+			}
+		}
+		for( CFIndex i = 0; i < count; i++ )
+			CFRelease(taken[i].data);
+		if( port != NULL ) dndEndpointRelease(port);
+
+		pthread_mutex_lock(&dndQueueLock);
+		dndStatSends += sends;
+		dndStatDelivered += delivered;
+		dndStatSendFailures += failures;
+		dndStatSendTimeouts += timeouts;
+		ports = dndPortList + index;
+		ports->busy = FALSE;
+		ports->sendAverage = average;
+		ports->sendDeviation = deviation;
+		ports->sendTimeout = timeout;
+		ports->timeouts = streak;
+		if( tripped )
+			_dndBreakerTrip(ports, unsent);
+		else if( probing && (delivered != 0) )
+			_dndBreakerRecover(ports);
+		if( dead ) _dndQueueDisconnect(ports);
+
+		// a client which died while we were sending to it was left for us to hand on
+		if( ports->dead )
+		{
+			dndSourceSignal(dndPortTransport, dndReaper);
+		}
+		else
+			_dndQueueReady(index);
+	}
+
+	return NULL;
+}
+
+/*
+ *	Remove a record from the notifications list, its index chain and its client's
+ *	chain of records. The last record in the list is moved into its place, so the
+ *	list never has any holes.
+ */
+static void _dndNotRemove( dndShard *shard, SInt32 rec )
+{
+	dndNotTable *table = &shard->table;
+	dndNotLinks *links = shard->notLinks;
+	dndNotLinks *nots = links + rec;
+
+	_dndNotIndexRemove(table, links, rec);
+
+	// the last record from a session takes the session with it
+	CFIndex session = _dndNotSessionFind(table, table->notSessions[rec]);
+	if( table->notNames[rec] == 0 ) table->sessions[session].anyName--;
+	if( --table->sessions[session].records == 0 )
+		table->sessions[session] = table->sessions[--table->sessionCount];
+
+	if( nots->clientPrev == kCFNotFound )
+		shard->clientNots[table->notClients[rec]] = nots->clientNext;
+	else
+		links[nots->clientPrev].clientNext = nots->clientNext;
+	if( nots->clientNext != kCFNotFound ) links[nots->clientNext].clientPrev = nots->clientPrev;
+
+	shard->changed = TRUE;
+	SInt32 last = (SInt32)--table->notListCount;
+	if( rec == last ) return;
+
+	// point everything which referred to the last record at its new position
+	table->notNames[rec] = table->notNames[last];
+	table->notObjects[rec] = table->notObjects[last];
+	table->notSessions[rec] = table->notSessions[last];
+	table->notNext[rec] = table->notNext[last];
+	table->notClients[rec] = table->notClients[last];
+	table->notBehaviors[rec] = table->notBehaviors[last];
+	*nots = links[last];
+
+	if( nots->prev == kCFNotFound )
+		*_dndNotChain(table, table->notNames[rec], table->notObjects[rec], table->notSessions[rec]) = rec;
+	else
+		table->notNext[nots->prev] = rec;
+	if( table->notNext[rec] != kCFNotFound ) links[table->notNext[rec]].prev = rec;
+
+	if( nots->clientPrev == kCFNotFound )
+		shard->clientNots[table->notClients[rec]] = rec;
+	else
+		links[nots->clientPrev].clientNext = rec;
+	if( nots->clientNext != kCFNotFound ) links[nots->clientNext].clientPrev = rec;
+}
+
+// remove all of a client's records from a shard
+static void _dndNotDropClient( dndShard *shard, CFIndex index )
+{
+	if( index >= shard->table.clientCount ) return;
+	while( shard->clientNots[index] != kCFNotFound ) _dndNotRemove(shard, shard->clientNots[index]);
+}
+
+/*
+ *	Give the shard's worker a copy of the working table as it now stands, if it's
+ *	changed since it was last given one, and retire the copy it had. The copy is a
+ *	single block, which the worker only ever reads. If it can't be made the worker
+ *	carries on with the old one until the next post. Changes only mark the shard,
+ *	and it's published when a post is next sent to it, so that a run of them (or a
+ *	wildcard record, which goes in every shard) costs at most one copy per post.
+ */
+static void _dndShardPublish( dndShard *shard )
+{
+	if( (dndWorkerThreads == 0) || !shard->changed ) return;
+
+	dndNotTable *table = &shard->table;
+	CFIndex count = table->notListCount;
+	CFIndex buckets = table->notIndexMask + 1;
+	size_t size = sizeof(dndNotTable) + (count * (2 * sizeof(CFHashCode) + sizeof(long) + 2 * sizeof(SInt32) + sizeof(UInt8)))
+		+ (table->clientCount * sizeof(CFIndex)) + (table->sessionCount * sizeof(dndNotSession)) + (3 * buckets * sizeof(SInt32));
+	dndNotTable *copy = malloc(size);
+	if( copy == NULL )
+	{
+		fprintf(stderr, "Unable to publish notifications list (%ld bytes).\n", (long)size);
+		return;
+	}
+
+	// widest first, so that every array is aligned
+	*copy = *table;
+	copy->notNames = (CFHashCode *)(copy + 1);
+	copy->notObjects = copy->notNames + count;
+	copy->notSessions = (long *)(copy->notObjects + count);
+	copy->generations = (CFIndex *)(copy->notSessions + count);
+	copy->sessions = (dndNotSession *)(copy->generations + table->clientCount);
+	copy->notNext = (SInt32 *)(copy->sessions + table->sessionCount);
+	copy->notClients = copy->notNext + count;
+	copy->notIndex = copy->notClients + count;
+	copy->nameIndex = copy->notIndex + buckets;
+	copy->objectIndex = copy->nameIndex + buckets;
+	copy->notBehaviors = (UInt8 *)(copy->objectIndex + buckets);
+	memcpy(copy->notNames, table->notNames, count * sizeof(CFHashCode));
+	memcpy(copy->notObjects, table->notObjects, count * sizeof(CFHashCode));
+	memcpy(copy->notSessions, table->notSessions, count * sizeof(long));
+	memcpy(copy->generations, table->generations, table->clientCount * sizeof(CFIndex));
+	memcpy(copy->sessions, table->sessions, table->sessionCount * sizeof(dndNotSession));
+	memcpy(copy->notNext, table->notNext, count * sizeof(SInt32));
+	memcpy(copy->notClients, table->notClients, count * sizeof(SInt32));
+	memcpy(copy->notIndex, table->notIndex, buckets * sizeof(SInt32));
+	memcpy(copy->nameIndex, table->nameIndex, buckets * sizeof(SInt32));
+	memcpy(copy->objectIndex, table->objectIndex, buckets * sizeof(SInt32));
+	memcpy(copy->notBehaviors, table->notBehaviors, count * sizeof(UInt8));
+
+	// the copy must be complete before the worker can see it
+	dndNotTable *old = shard->published;
+	__sync_synchronize();
+	shard->published = copy;
+	shard->changed = FALSE;
+
+	if( old != NULL ) dndEpochRetire(old);
+}
+
+
+/*
+ *	Reap a dead client: throw away whatever is still queued or held for it, all of
+ *	its notification records and its uid, and put its slot on the free list. A
+ *	client a dispatch thread is still sending to is left for the thread to signal
+ *	again once it's finished. Main thread only.
+ */
+static void _dndReapClient( CFIndex index )
+{
+	pthread_mutex_lock(&dndQueueLock);
+	dndPortRecord *ports = dndPortList + index;
+	if( ports->busy )
+	{
+		pthread_mutex_unlock(&dndQueueLock);
+		return;
+	}
+
+	if(verbose) fprintf(stderr, "Reaping client %ld (0x%lX).\n", (long)index, ports->name);
+
+	for( CFIndex i = 0; i < ports->count; i++ )
+		CFRelease(ports->queue[(ports->first + i) % ports->capacity].data);
+	for( CFIndex i = 0; i < ports->heldCount; i++ )
+		CFRelease(ports->held[i].data);
+	for( CFIndex i = 0; i < ports->urgentCount; i++ )
+		CFRelease(ports->urgent[i].data);
+	ports->dropped += ports->count + ports->heldCount + ports->urgentCount;
+	dndQueueDropped += ports->count + ports->heldCount + ports->urgentCount;
+	free(ports->queue);
+	free(ports->held);
+	free(ports->urgent);
+	ports->queue = ports->held = ports->urgent = NULL;
+	ports->count = ports->first = ports->capacity = 0;
+	ports->heldCount = ports->heldCapacity = 0;
+	ports->urgentCount = ports->urgentCapacity = 0;
+	if( ports->parked )
+	{
+		ports->parked = FALSE;
+		dndParkedCount--;
+	}
+
+	// take it off the ready lists, where it will be if it died with work queued
+	if( ports->listed )
+	{
+		CFIndex prev = kCFNotFound;
+		for( CFIndex i = dndReadyFirst; i != index; i = dndPortList[i].ready ) prev = i;
+		if( prev == kCFNotFound ) dndReadyFirst = ports->ready;
+		else dndPortList[prev].ready = ports->ready;
+		if( dndReadyLast == index ) dndReadyLast = prev;
+		ports->listed = FALSE;
+	}
+	if( ports->urgentListed )
+	{
+		CFIndex prev = kCFNotFound;
+		for( CFIndex i = dndUrgentFirst; i != index; i = dndPortList[i].urgentReady ) prev = i;
+		if( prev == kCFNotFound ) dndUrgentFirst = ports->urgentReady;
+		else dndPortList[prev].urgentReady = ports->urgentReady;
+		if( dndUrgentLast == index ) dndUrgentLast = prev;
+		ports->urgentListed = FALSE;
+	}
+
+	dndEndpointRef port = ports->port;
+	ports->port = NULL;
+	ports->live = FALSE;
+	ports->dead = FALSE;
+	pthread_mutex_unlock(&dndQueueLock);
+
+	// releasing the port may invalidate it, which mustn't call back into us
+	if( port != NULL )
+	{
+		dndEndpointSetInvalidationCallBack(port, NULL);
+		dndEndpointRelease(port);
+	}
+
+	// its records go from every shard, which are published when next posted to
+	for( CFIndex i = 0; i < dndShardCount; i++ ) _dndNotDropClient(dndShards + i, index);
+
+	// the rest is only ever touched by the main thread
+	_dndPortMapRemove(ports->name);
+	ports->name = 0;
+	ports->ready = dndPortFree;
+	dndPortFree = index;
+}
+
+// run loop source callback, reaping every client marked as dead
+static void _dndReap( void *info )
+{
+	for( CFIndex index = 0; index < dndPortListCount; index++ )
+	{
+		pthread_mutex_lock(&dndQueueLock);
+		Boolean reap = dndPortList[index].live && dndPortList[index].dead;
+		pthread_mutex_unlock(&dndQueueLock);
+
+		if( reap ) _dndReapClient(index);
+	}
+}
+
+// called by the transport when the remote port back to a client is invalidated
+static void _dndPortInvalidated( dndEndpointRef port )
+{
+	pthread_mutex_lock(&dndQueueLock);
+	for( CFIndex index = 0; index < dndPortListCount; index++ )
+	{
+		if( dndPortList[index].live && (dndPortList[index].port == port) )
+			_dndQueueDisconnect(dndPortList + index);
+	}
+	pthread_mutex_unlock(&dndQueueLock);
+}
+
+// replace a suspension behaviour we don't recognise with always delivering
+static void _dndNotRegCheck( dndNotReg *info )
+{
+	if( (info->sb < CFNotificationSuspensionBehaviorDrop) || (info->sb > CFNotificationSuspensionBehaviorDeliverImmediately) )
+		info->sb = CFNotificationSuspensionBehaviorDeliverImmediately;
+}
+
+/*
+ *	Decode a register or unregister request. Older clients don't send a suspension
+ *	behaviour, and get the daemon's original behaviour of always delivering.
+ */
+static Boolean _dndNotRegRead( CFDataRef data, dndNotReg *info )
+{
+	CFIndex length = CFDataGetLength(data);
+	if( length < offsetof(dndNotReg, sb) ) return FALSE;
+	if( length > sizeof(dndNotReg) ) length = sizeof(dndNotReg);
+
+	info->sb = CFNotificationSuspensionBehaviorDeliverImmediately;
+	CFRange range = { 0, length };
+	CFDataGetBytes(data, range, (UInt8 *)info);
+
+	_dndNotRegCheck(info);
+	return TRUE;
+}
+
+// decode a request which carries only a client's uid
+static Boolean _dndUidRead( CFDataRef data, CFHashCode *uid )
+{
+	if( CFDataGetLength(data) < sizeof(CFHashCode) ) return FALSE;
+
+	CFRange range = { 0, sizeof(CFHashCode) };
+	CFDataGetBytes(data, range, (UInt8 *)uid);
+	return TRUE;
+}
+
+/*
+ *	Declarations of functions to handle each of these message types
+ */
+CFDataRef dndNotification( CFDataRef data ); 
+CFDataRef dndNotificationBatch( CFDataRef data );
+CFDataRef dndRegisterPort( CFDataRef data );
+CFDataRef dndUnregisterPort( CFDataRef data );
+CFDataRef dndRegisterNotification( CFDataRef data );
+CFDataRef dndUnregisterNotification( CFDataRef data );
+CFDataRef dndRegisterNotifications( CFDataRef data );
+CFDataRef dndUnregisterNotifications( CFDataRef data );
+CFDataRef dndSuspend( CFDataRef data );
+CFDataRef dndResume( CFDataRef data );
+CFDataRef dndStatistics( CFDataRef data );
+CFDataRef dndTraceRequest( CFDataRef data );
+
+/*
+ *	Message recieved callback.
+ *
+ *	ddistnoted uses one thread (the main one) to handle all recieved messages and
+ *	maintain its table of ports. This ensure that only a single thread reads from or
+ *	writes to that table. Each shard of the notifications list is likewise only ever
+ *	touched by one thread: the main one, or its worker if there are any. The dispatch
+ *	threads only touch the clients' delivery queues, and only while holding
+ *	dndQueueLock.
+ */
+CFDataRef dndMessageRecieved( dndEndpointRef local, SInt32 msgid, CFDataRef data, void *info );
+CFDataRef dndMessageRecieved( dndEndpointRef local, SInt32 msgid, CFDataRef data, void *info )
+{
+	dndTrace(TRACE_RECEIVED, (UInt32)msgid, (data != NULL) ? CFDataGetLength(data) : 0);
+	UInt64 start = dndNanoseconds();
+	CFDataRef reply = NULL;
+	switch(msgid) {
+		case NOTIFICATION: reply = dndNotification(data); break;
+		case REGISTER_PORT: reply = dndRegisterPort(data); break;
+		case UNREGISTER_PORT: reply = dndUnregisterPort(data); break;
+		case REGISTER_NOTIFICATION: reply = dndRegisterNotification(data); break;
+		case UNREGISTER_NOTIFICATION: reply = dndUnregisterNotification(data); break;
+		case SUSPEND: reply = dndSuspend(data); break;
+		case RESUME: reply = dndResume(data); break;
+		case REGISTER_NOTIFICATIONS: reply = dndRegisterNotifications(data); break;
+		case UNREGISTER_NOTIFICATIONS: reply = dndUnregisterNotifications(data); break;
+		case NOTIFICATION_BATCH: reply = dndNotificationBatch(data); break;
+		case STATS: reply = dndStatistics(data); break;
+		case TRACE: reply = dndTraceRequest(data); break;
+		default: return NULL;
+	}
+	dndHistogramRecord(dndHandlerTimes + msgid, dndNanoseconds() - start);
+	return reply;
+}
+
+// count a matching record's client among the matches, once however many of its records match
+static CFIndex _dndNotFound( const dndNotTable *table, dndMatcher *matcher, SInt32 rec, CFIndex serial, CFIndex found, dndMatch *matches )
+{
+	SInt32 index = table->notClients[rec];
+	CFNotificationSuspensionBehavior sb = table->notBehaviors[rec];
+	dndMark *mark = matcher->marks + index;
+	if( mark->mark != serial )
+	{
+		mark->mark = serial;
+		mark->match = found;
+		matches[found].index = index;
+		matches[found].generation = table->generations[index];
+		matches[found].sb = sb;
+		found++;
+	}
+	else if( sb > matches[mark->match].sb )
+		matches[mark->match].sb = sb; // the enum runs from Drop up to DeliverImmediately
+	return found;
+}
+
+/*
+ *	Add the clients in one session which a notification should go to, marked with
+ *	serial, to the found already in matches, returning the new total.
+ *
+ *	Only the chains which could hold a matching record are walked: the exact
+ *	name-object pair, the name with any object, the object with any name, and the
+ *	session's records observing everything. Each client is marked with the
+ *	notification's serial the first time it matches, so it only appears once.
+ */
+static CFIndex _dndNotMatchSession( const dndNotTable *table, dndMatcher *matcher, const dndNotHeader *info, const dndNotSession *session,
+								   CFIndex serial, CFIndex found, dndMatch *matches )
+{
+	SInt32 chains[4] = {
+		table->notIndex[_dndNotKey(info->name, info->object, session->session) & table->notIndexMask],
+		table->nameIndex[_dndNotKey(info->name, 0, session->session) & table->notIndexMask],
+		table->objectIndex[_dndNotKey(0, info->object, session->session) & table->notIndexMask],
+		session->wildcards
+	};
 
-typedef struct dndNotRecord {
-	CFIndex index;
-	CFHashCode name;
-	CFHashCode object;
-	long session;
-} dndNotRecord;
+	for( int i = 0; i < 4; i++ )
+	{
+		for( SInt32 rec = chains[i]; rec != kCFNotFound; rec = table->notNext[rec] )
+		{
+			if( _dndNotMatches(table, rec, info, session->session) )
+				found = _dndNotFound(table, matcher, rec, serial, found, matches);
+		}
+	}
 
-// list of registered notifications, across all sessions
-#define NOT_LIST_SIZE	256
-static dndNotRecord *dndNotList = NULL;
-static CFIndex dndNotListCount = 0;
-static CFIndex dndNotListCapacity = 0;
+	return found;
+}
 
 /*
- *	Simple console-output-based diagnostic functions, really very definately 
- *	not to be left active in the final released code
+ *	Whether a notification should be matched by scanning the whole table rather than
+ *	its chains. A post to one session only scans when that session has the table to
+ *	itself, since the chains never visit another session's records.
  */
-void _dndPrintPorts( void );
-void _dndPrintNots( void );
+static Boolean _dndNotScanning( const dndNotTable *table, const dndNotHeader *info )
+{
+	if( dndScanKernel == NULL ) return FALSE;
 
-void _dndPrintPorts( void )
+	CFIndex anyName = 0, records = 0;
+	if( info->flags & kCFNotificationPostToAllSessions )
+	{
+		for( CFIndex i = 0; i < table->sessionCount; i++ )
+		{
+			anyName += table->sessions[i].anyName;
+			records += table->sessions[i].records;
+		}
+	}
+	else
+	{
+		if( table->sessionCount != 1 ) return FALSE;
+		CFIndex session = _dndNotSessionFind(table, info->session);
+		if( session == kCFNotFound ) return FALSE;
+		anyName = table->sessions[session].anyName;
+		records = table->sessions[session].records;
+	}
+	return (anyName * 100) >= (records * MATCH_SCAN_PERCENT);
+}
+
+/*
+ *	Match a notification by testing every record in the table, a block at a time
+ *	with the scan kernel, rather than following its chains. This finds the same
+ *	records as _dndNotMatchSession() would for each session, in table order.
+ */
+static CFIndex _dndNotScan( const dndNotTable *table, dndMatcher *matcher, const dndNotHeader *info, CFIndex serial, dndMatch *matches )
 {
-    printf("PORT LIST: (count = %ld, capacity = %ld)\n", (long)dndPortListCount, (long)dndPortListCapacity);
-	
-	CFIndex count = dndPortListCount;
-	CFIndex index = 0;
-	dndPortRecord *ports = dndPortList;
-	while(count--)
+	Boolean anySession = (info->flags & kCFNotificationPostToAllSessions) ? TRUE : FALSE;
+	CFIndex found = 0;
+
+	for( CFIndex base = 0; base < table->notListCount; base += MATCH_BLOCK )
 	{
-        printf("  %3ld: name hash = 0x%lX, session = %ld\n", (long)index++, ports->name, ports->session);
-		ports++;
+		CFIndex count = ((table->notListCount - base) < MATCH_BLOCK) ? (table->notListCount - base) : MATCH_BLOCK;
+		UInt64 bits = dndScanKernel->block(table->notNames + base, table->notObjects + base, table->notSessions + base, count,
+										   info->name, info->object, info->session, anySession);
+		while( bits != 0 )
+		{
+			found = _dndNotFound(table, matcher, (SInt32)(base + __builtin_ctzll(bits)), serial, found, matches);
+			bits &= bits - 1;
+		}
+	}
+
+	return found;
+}
+
+/*
+ *	Find the clients a notification should go to among a table's records, filling in
+ *	matches (which must have room for the table's clientCount entries) and returning
+ *	how many there are. The matcher must have marks for as many clients. Only the
+ *	poster's session is looked at, unless the notification is posted to all of them.
+ */
+static CFIndex _dndNotMatch( const dndNotTable *table, dndMatcher *matcher, const dndNotHeader *info, dndMatch *matches )
+{
+	CFIndex serial = ++matcher->serial;
+	CFIndex found = 0;
+
+	if( _dndNotScanning(table, info) ) return _dndNotScan(table, matcher, info, serial, matches);
+
+	if( info->flags & kCFNotificationPostToAllSessions )
+	{
+		for( CFIndex i = 0; i < table->sessionCount; i++ )
+			found = _dndNotMatchSession(table, matcher, info, table->sessions + i, serial, found, matches);
 	}
+	else
+	{
+		CFIndex session = _dndNotSessionFind(table, info->session);
+		if( session != kCFNotFound )
+			found = _dndNotMatchSession(table, matcher, info, table->sessions + session, serial, found, matches);
+	}
+
+	return found;
 }
 
-void _dndPrintNots( void )
+/*
+ *	Start matching against a shard, returning the table to match against: the working
+ *	copy for the main thread, otherwise the one most recently published. The matcher
+ *	is given enough marks for the table's clients, and NULL returned if it can't be.
+ *	Every call must be paired with one to _dndShardLeave(), once finished with the table.
+ */
+static const dndNotTable *_dndShardEnter( dndShard *shard, dndMatcher *matcher )
 {
-    printf("NOTIFICATIONS LIST: (count = %ld, capacity = %ld)\n", (long)dndNotListCount, (long)dndNotListCapacity);
-	
-	CFIndex count = dndNotListCount;
-	CFIndex index = 0;
-	dndNotRecord *nots = dndNotList;
-	while(count--) 
+	const dndNotTable *table = &shard->table;
+	if( matcher->reader != NULL )
 	{
-		while(nots->session == 0) 
+		dndEpochEnter(matcher->reader);
+		table = shard->published;
+	}
+
+	if( table->clientCount > matcher->markCapacity )
+	{
+		// on the heap rather than the stack, whose size a worker can't count on
+		void *ptr = realloc(matcher->matches, table->clientCount * sizeof(dndMatch));
+		if( ptr != NULL ) matcher->matches = ptr;
+		if( ptr != NULL ) ptr = realloc(matcher->marks, table->clientCount * sizeof(dndMark));
+		if( ptr == NULL )
 		{
-            printf("  %3ld: --EMPTY--\n", (long)index++);
-			nots++;
+			fprintf(stderr, "Unable to allocate marks for %ld clients.\n", (long)table->clientCount);
+			return NULL;
 		}
-        printf("  %3ld: index: %4ld name: 0x%8lX object: 0x%8lX session: %ld\n", (long)index++, (long)nots->index, nots->name, nots->object, nots->session);
-		nots++;
+		matcher->marks = ptr;
+		for( CFIndex i = matcher->markCapacity; i < table->clientCount; i++ )
+			matcher->marks[i].mark = 0;
+		matcher->markCapacity = table->clientCount;
 	}
+	return table;
 }
 
-// amount of log noise we create
-static Boolean verbose = FALSE;
+static void _dndShardLeave( dndShard *shard, dndMatcher *matcher )
+{
+	if( matcher->reader != NULL ) dndEpochExit(matcher->reader);
+}
+
+// the shard whose records a notification with this name is matched against
+static CFIndex _dndShardIndex( CFHashCode name )
+{
+	return _dndNotHash(name, 0) % dndShardCount;
+}
 
 /*
- *	Declarations of functions to handle each of these message types
+ *	Match a notification against one shard and queue it for every client found. Unless
+ *	owned is TRUE the data is only borrowed, and is copied before being queued.
  */
-CFDataRef dndNotification( CFDataRef data ); 
-CFDataRef dndRegisterPort( CFDataRef data );
-CFDataRef dndUnregisterPort( CFDataRef data );
-CFDataRef dndRegisterNotification( CFDataRef data );
-CFDataRef dndUnregisterNotification( CFDataRef data );
+static void _dndShardNotification( dndShard *shard, dndMatcher *matcher, const dndNotHeader *info, CFDataRef data, Boolean owned )
+{
+	UInt64 start = dndNanoseconds();
+	const dndNotTable *table = _dndShardEnter(shard, matcher);
+	if( (table == NULL) || (table->notListCount == 0) )
+	{
+		_dndShardLeave(shard, matcher);
+		return;
+	}
+
+	dndMatch *matches = matcher->matches;
+	CFIndex found = _dndNotMatch(table, matcher, info, matches);
+	_dndShardLeave(shard, matcher);
+
+	UInt64 matched = dndNanoseconds();
+	pthread_mutex_lock(&matcher->times->lock);
+	dndHistogramRecord(&matcher->times->match, matched - start);
+	pthread_mutex_unlock(&matcher->times->lock);
+	dndTrace(TRACE_MATCHED, (UInt32)found, info->name);
+
+	if( found == 0 ) return;
+
+	/*	The data is only borrowed from the message port for the length of this call,
+		so take a copy to share among the recipients' queues. From here it's up to
+		the dispatch threads to get it to them. */
+	CFDataRef dataCopy = owned ? CFRetain(data) : CFDataCreateCopy( kCFAllocatorDefault, data );
+	if( dataCopy == NULL ) return;
+
+	pthread_mutex_lock(&dndQueueLock);
+	dndStatMatched++;
+	dndStatMatches += found;
+	while(found--) _dndDeliver(matches + found, info, dataCopy, matched);
+	pthread_mutex_unlock(&dndQueueLock);
+
+	CFRelease(dataCopy);
+}
 
 /*
- *	Message recieved callback.
- *
- *	ddistnoted uses one thread (the main one) to handle all recieved messages and
- *	maintain its tables of ports and notifications. This ensure that only a single
- *	thread reads from or writes to these tables.
+ *	Shard workers. The main thread queues posts for a shard with _dndShardSend() and
+ *	its worker takes everything waiting at once, matching each in order against the
+ *	shard's published table.
  */
-CFDataRef dndMessageRecieved( CFMessagePortRef local, SInt32 msgid, CFDataRef data, void *info );
-CFDataRef dndMessageRecieved( CFMessagePortRef local, SInt32 msgid, CFDataRef data, void *info )
+#define SHARD_OPS	64
+
+// queue a post for a shard's worker, which will release data when it's done
+static void _dndShardSend( dndShard *shard, int op, CFDataRef data )
 {
-    if (verbose) fprintf(stderr, "received a message\n");
-	switch(msgid) {
-		case NOTIFICATION: return dndNotification(data);
-		case REGISTER_PORT: return dndRegisterPort(data);
-		case UNREGISTER_PORT: return dndUnregisterPort(data);
-		case REGISTER_NOTIFICATION: return dndRegisterNotification(data);
-		case UNREGISTER_NOTIFICATION: return dndUnregisterNotification(data);
-		//case SUSPEND: return dndSuspend(data);
-		//case RESUME: return dndResume(data);
+	// the worker must see every record added or removed before the post
+	_dndShardPublish(shard);
+
+	pthread_mutex_lock(&shard->lock);
+	if( shard->opCount == shard->opCapacity )
+	{
+		CFIndex capacity = (shard->opCapacity == 0) ? SHARD_OPS : (shard->opCapacity * 2);
+		void *ptr = realloc(shard->ops, capacity * sizeof(dndShardOp));
+		if( ptr == NULL )
+		{
+			pthread_mutex_unlock(&shard->lock);
+			fprintf(stderr, "Unable to queue request for shard %ld.\n", (long)(shard - dndShards));
+			return;
+		}
+		shard->ops = ptr;
+		shard->opCapacity = capacity;
 	}
-	return NULL;
+
+	dndShardOp *entry = shard->ops + shard->opCount++;
+	entry->op = op;
+	entry->data = CFRetain(data);
+	pthread_cond_signal(&shard->cond);
+	pthread_mutex_unlock(&shard->lock);
+}
+
+// count a post, and its name among the busiest
+static void _dndStatsPost( CFHashCode name )
+{
+	dndStatPosts++;
+
+	CFIndex least = 0;
+	for( CFIndex i = 0; i < dndTopNameCount; i++ )
+	{
+		if( dndTopNames[i].name == name )
+		{
+			dndTopNames[i].posts++;
+			return;
+		}
+		if( dndTopNames[i].posts < dndTopNames[least].posts ) least = i;
+	}
+
+	if( dndTopNameCount < TOP_NAMES )
+	{
+		least = dndTopNameCount++;
+		dndTopNames[least].posts = 0;
+	}
+	dndTopNames[least].name = name;
+	dndTopNames[least].error = dndTopNames[least].posts;
+	dndTopNames[least].posts++;
 }
 
 /*
@@ -158,9 +1846,7 @@ CFDataRef dndMessageRecieved( CFMessagePortRef local, SInt32 msgid, CFDataRef da
  */
 CFDataRef dndNotification( CFDataRef data )
 {
-	if( (dndPortListCount == 0) || (dndNotListCount == 0) ) return NULL;
-	
-	if(verbose) fprintf(stderr, "ddist: got a notification.\n");
+	dndStatPostMessages++;
 	
 	CFIndex length = CFDataGetLength(data);
 	if( length < sizeof(dndNotHeader) ) return NULL; // an absolute minimum size
@@ -168,58 +1854,182 @@ CFDataRef dndNotification( CFDataRef data )
 	dndNotHeader info;
 	CFRange range = { 0, sizeof(dndNotHeader) };
 	CFDataGetBytes(data, range, (UInt8 *)&info);
+	_dndStatsPost(info.name);
 	
-    if(verbose) fprintf(stderr, "ddist: len = %ld, sid = %ld, name = %8lX, object = %8lX, flags = %ld\n", length, info.session, info.name, info.object, info.flags);
+	if( dndPortListCount == 0 ) return NULL;
 	
-	Boolean sendToAll = info.flags | kCFNotificationPostToAllSessions;
-	
-	CFIndex found = 0, index;
-	CFIndex indexes[dndPortListCount];
-	CFIndex count = dndNotListCount;
-	dndNotRecord *nots = dndNotList;
-	
-	while(count--)
+	if( dndWorkerThreads == 0 )
+		_dndShardNotification(dndShards, &dndMainMatcher, &info, data, FALSE);
+	else
 	{
-		//printf("loop: count = %u, found = %u, nots = 0x%8X\n", count, found, nots);
-		while( nots->session == 0 ) nots++;
-		
-		if( /* name */ ((nots->name == 0) || (nots->name == info.name))
-		   /* object */ && ((nots->object == 0) || (nots->object == info.object))
-		   /* session */ && (sendToAll || (nots->session == info.session)) )
+		// the worker will need its own copy, since ours is only borrowed
+		CFDataRef dataCopy = CFDataCreateCopy( kCFAllocatorDefault, data );
+		if( dataCopy == NULL ) return NULL;
+		_dndShardSend(dndShards + _dndShardIndex(info.name), SHARD_NOTIFICATION, dataCopy);
+		CFRelease(dataCopy);
+	}
+	return NULL;
+}
+
+// the number of complete frames at the start of a NOTIFICATION_BATCH message
+static CFIndex _dndFrameCount( const UInt8 *bytes, CFIndex length )
+{
+	CFIndex offset, count = 0;
+	dndFrameHeader frame;
+
+	// ignoring anything after the first bad one
+	for( offset = 0; offset + sizeof(dndFrameHeader) <= length; offset += sizeof(dndFrameHeader) + frame.length )
+	{
+		memcpy(&frame, bytes + offset, sizeof(dndFrameHeader));
+		if( (frame.length < sizeof(dndNotHeader)) || (frame.length > length - offset - sizeof(dndFrameHeader)) ) break;
+		count++;
+	}
+	return count;
+}
+
+/*
+ *	Match a batch of notifications against one shard. Every frame is matched first,
+ *	then all of the deliveries are queued under a single hold of the lock, so each
+ *	recipient is readied once and its dispatch thread picks up everything in the
+ *	batch meant for it together, in the order it was posted.
+ */
+static void _dndShardNotificationBatch( dndShard *shard, dndMatcher *matcher, CFDataRef data )
+{
+	const UInt8 *bytes = CFDataGetBytePtr(data);
+	CFIndex count = _dndFrameCount(bytes, CFDataGetLength(data));
+	if( count == 0 ) return;
+
+	const dndNotTable *table = _dndShardEnter(shard, matcher);
+	if( (table == NULL) || (table->notListCount == 0) )
+	{
+		_dndShardLeave(shard, matcher);
+		return;
+	}
+
+	// kept on the heap, since their size is up to the sender
+	dndNotHeader *infos = malloc(count * sizeof(dndNotHeader));
+	CFDataRef *frames = malloc(count * sizeof(CFDataRef));
+	UInt64 *took = malloc(count * sizeof(UInt64));
+	if( (infos == NULL) || (frames == NULL) || (took == NULL) )
+	{
+		fprintf(stderr, "Unable to allocate for a batch of %ld notifications.\n", (long)count);
+		_dndShardLeave(shard, matcher);
+		free(infos);
+		free(frames);
+		free(took);
+		return;
+	}
+	dndMatch *matches = matcher->matches;
+	struct { dndMatch match; CFIndex frame; } *pending = NULL;
+	CFIndex pendingCount = 0, pendingCapacity = 0, matched = 0, timed = 0;
+	dndFrameHeader frame;
+
+	CFIndex offset = 0;
+	for( CFIndex i = 0; i < count; i++ )
+	{
+		memcpy(&frame, bytes + offset, sizeof(dndFrameHeader));
+		offset += sizeof(dndFrameHeader);
+		memcpy(infos + i, bytes + offset, sizeof(dndNotHeader));
+		frames[i] = CFDataCreate( kCFAllocatorDefault, bytes + offset, frame.length );
+		offset += frame.length;
+		if( frames[i] == NULL ) continue;
+
+		UInt64 start = dndNanoseconds();
+		CFIndex found = _dndNotMatch(table, matcher, infos + i, matches);
+		took[timed++] = dndNanoseconds() - start;
+		dndTrace(TRACE_MATCHED, (UInt32)found, infos[i].name);
+		if( found != 0 ) matched++;
+		if( pendingCount + found > pendingCapacity )
 		{
-			index = found;
-			while(index--) 
-			{
-				if( indexes[index] == nots->index )
-					break;
-			}
-			if( index < 0 )
-				indexes[found++] = nots->index;
+			CFIndex capacity = (pendingCapacity == 0) ? table->clientCount : pendingCapacity;
+			while( capacity < pendingCount + found ) capacity *= 2;
+			void *ptr = realloc(pending, capacity * sizeof(*pending));
+			if( ptr == NULL ) continue;
+			pending = ptr;
+			pendingCapacity = capacity;
+		}
+		for( CFIndex j = 0; j < found; j++ )
+		{
+			pending[pendingCount].match = matches[j];
+			pending[pendingCount++].frame = i;
 		}
-		nots++;
 	}
+	_dndShardLeave(shard, matcher);
 
-    if(verbose) fprintf(stderr, "ddist: Matched notification with %ld observer(s)\n", found);
+	pthread_mutex_lock(&matcher->times->lock);
+	for( CFIndex i = 0; i < timed; i++ )
+		dndHistogramRecord(&matcher->times->match, took[i]);
+	pthread_mutex_unlock(&matcher->times->lock);
 
-	//if( found != 0 ) CFDataRef dataCopy = CFDataCreateCopy( kCFAllocatorDefault, data );
+	UInt64 now = dndNanoseconds();
+	pthread_mutex_lock(&dndQueueLock);
+	dndStatMatched += matched;
+	dndStatMatches += pendingCount;
+	for( CFIndex i = 0; i < pendingCount; i++ )
+		_dndDeliver(&pending[i].match, infos + pending[i].frame, frames[pending[i].frame], now);
+	pthread_mutex_unlock(&dndQueueLock);
 
-	/*	Right, you don't have to tell me how bad this design is. For a start, the
-		notification forwarding should be handled in a different thread, and for a
-		second there's absolutely no error checking going on. We could at least check
-		if the message port we're trying to send to is still valid. */
-	
-	// are there any clients to notify?
-	CFMessagePortRef port;
-	while(found--)
+	free(pending);
+	for( CFIndex i = 0; i < count; i++ )
+		if( frames[i] != NULL ) CFRelease(frames[i]);
+	free(infos);
+	free(frames);
+	free(took);
+}
+
+/*
+ *	Process a batch of notifications, as a series of frames each holding what
+ *	would otherwise have been a NOTIFICATION message. With workers, the frames are
+ *	split into a batch for each shard they belong to, keeping their order.
+ */
+CFDataRef dndNotificationBatch( CFDataRef data )
+{
+	const UInt8 *bytes = CFDataGetBytePtr(data);
+	CFIndex count = _dndFrameCount(bytes, CFDataGetLength(data));
+	dndStatPostMessages++;
+	if( count == 0 ) return NULL;
+	if( count > NOTIFICATION_BATCH_MAX )
 	{
-		//printf("  found %u\n", indexes[found]);
-		//index = indexes[found];
-		port = (dndPortList + indexes[found])->port;
-		if( (port != NULL) && (CFMessagePortIsValid(port) == TRUE) )
-			CFMessagePortSendRequest( port, NOTIFICATION, data, 1.0, 1.0, NULL, NULL );
+        if(verbose) fprintf(stderr, "dropping a batch of %ld notifications, more than %d\n", (long)count, NOTIFICATION_BATCH_MAX);
+		return NULL;
+	}
+
+	// every frame is counted, and with workers split off at the same time
+	Boolean split = (dndWorkerThreads != 0) && (dndPortListCount != 0);
+	CFMutableDataRef parts[WORKER_THREADS_MAX];
+	for( CFIndex i = 0; i < dndShardCount; i++ ) parts[i] = NULL;
+
+	dndFrameHeader frame;
+	dndNotHeader info;
+	CFIndex offset = 0;
+	for( CFIndex i = 0; i < count; i++ )
+	{
+		memcpy(&frame, bytes + offset, sizeof(dndFrameHeader));
+		memcpy(&info, bytes + offset + sizeof(dndFrameHeader), sizeof(dndNotHeader));
+		_dndStatsPost(info.name);
+
+		if( split )
+		{
+			CFIndex shard = _dndShardIndex(info.name);
+			if( parts[shard] == NULL ) parts[shard] = CFDataCreateMutable( kCFAllocatorDefault, 0 );
+			if( parts[shard] != NULL ) CFDataAppendBytes( parts[shard], bytes + offset, sizeof(dndFrameHeader) + frame.length );
+		}
+		offset += sizeof(dndFrameHeader) + frame.length;
+	}
+
+	if( dndPortListCount == 0 ) return NULL;
+	if( dndWorkerThreads == 0 )
+	{
+		_dndShardNotificationBatch(dndShards, &dndMainMatcher, data);
+		return NULL;
+	}
+
+	for( CFIndex i = 0; i < dndShardCount; i++ )
+	{
+		if( parts[i] == NULL ) continue;
+		_dndShardSend(dndShards + i, SHARD_NOTIFICATION_BATCH, parts[i]);
+		CFRelease(parts[i]);
 	}
-	
-	if(verbose) fprintf(stderr, "ddist: leaving notification function\n");
 	return NULL;
 }
 
@@ -251,10 +2061,17 @@ CFDataRef dndRegisterPort( CFDataRef data )
 	range.location = sizeof(long);
 	range.length = length;
 	CFDataGetBytes(data, range, (UInt8 *)chars);
+
+	// the name may be followed by the client's capability flags
+	CFIndex flags = 0;
+	char *end = memchr(chars, '\0', length);
+	if( end == NULL ) return NULL;
+	if( (chars + length) - (end + 1) >= sizeof(CFIndex) )
+		memcpy(&flags, end + 1, sizeof(CFIndex));
 	
 	//printf("\tsending port name is '%s'\n", chars);
 	
-    if(verbose) fprintf(stderr, "register '%s', session %ld\n", chars, sid);
+    if(verbose) fprintf(stderr, "register '%s', session %ld, flags %lx\n", chars, sid, (long)flags);
 	
 	CFStringRef name = CFStringCreateWithCString( kCFAllocatorDefault, (const char *)chars, kCFStringEncodingASCII );
 	if( name == NULL )
@@ -263,82 +2080,380 @@ CFDataRef dndRegisterPort( CFDataRef data )
 		
 		return NULL;
 	}
-	
-	//CFShow(name);
+	
+	//CFShow(name);
+
+	dndEndpointRef port = dndEndpointCreateRemote( dndPortTransport, name );
+	if( port == NULL )
+	{
+		fprintf(stderr, "Couldn't open remote port back to '%s'.\n", chars);
+		return NULL;
+	}
+	
+	// see if the sender already exists
+	CFHashCode hash = CFHash(name);
+	CFRelease(name);
+	CFIndex index = _dndPortLookup(hash);
+	dndPortRecord *ports;
+	
+	/*	We're going to assign the remote port the uid hash and write its info
+		into the port table, either over its existing record or at the end of the
+		table ... unless we're at the end of the table and need to extend it */
+	
+	dndEndpointRef oldPort = NULL;
+	pthread_mutex_lock(&dndQueueLock);
+	if( index != kCFNotFound )
+	{
+		// anything already queued for the client is still delivered, now by the new port,
+		//	and a client coming back before it could be reaped is revived
+		ports = dndPortList + index;
+		oldPort = ports->port;
+		ports->dead = FALSE;
+	}
+	else if( dndPortFree != kCFNotFound )
+	{
+		// reuse the slot of a client which has been reaped
+		index = dndPortFree;
+		ports = dndPortList + index;
+		if( !_dndPortMapInsert(hash, index) )
+		{
+			pthread_mutex_unlock(&dndQueueLock);
+			dndEndpointRelease(port);
+			return NULL;
+		}
+		dndPortFree = ports->ready;
+	}
+	else
+	{
+		if( dndPortListCount == dndPortListCapacity )
+		{
+			dndPortListCapacity *= 2;
+			if(verbose) fprintf(stderr, "Having to extend port list to %ld entries.\n", (long)dndPortListCapacity);
+			void *ptr = realloc(dndPortList, (dndPortListCapacity * sizeof(dndPortRecord)));
+			
+			if( ptr == NULL )
+			{
+				fprintf(stderr, "Unable to realloc larger port list (%ld entries).\n", (long)dndPortListCapacity);
+				dndPortListCapacity /= 2;
+				pthread_mutex_unlock(&dndQueueLock);
+				dndEndpointRelease(port);
+				return NULL;
+			}
+			
+			dndPortList = ptr;
+		}
+		
+		index = dndPortListCount;
+		if( !_dndPortMapInsert(hash, index) )
+		{
+			pthread_mutex_unlock(&dndQueueLock);
+			dndEndpointRelease(port);
+			return NULL;
+		}
+		ports = dndPortList + index;
+		ports->live = FALSE;
+		dndPortListCount++;
+	}
+
+	if( !ports->live )
+	{
+		ports->count = 0;
+		ports->first = 0;
+		ports->capacity = 0;
+		ports->queue = NULL;
+		ports->listed = FALSE;
+		ports->urgentCount = 0;
+		ports->urgentCapacity = 0;
+		ports->urgent = NULL;
+		ports->urgentListed = FALSE;
+		ports->busy = FALSE;
+		ports->dropped = 0;
+		ports->coalesced = 0;
+		ports->suspended = FALSE;
+		ports->heldCount = 0;
+		ports->heldCapacity = 0;
+		ports->held = NULL;
+		ports->parked = FALSE;
+		ports->generation++;
+		ports->live = TRUE;
+		ports->dead = FALSE;
+	}
+	 
+	// write info into the port record. if the port already exists this is a 
+	//	little wasteful of our precious time
+	ports->name = hash;
+	ports->port = port;
+	ports->session = sid;
+	ports->batching = ((flags & DND_PORT_BATCH_DELIVERY) != 0);
+
+	// a new connection gets a clean slate with the circuit breaker
+	ports->sendAverage = 0;
+	ports->sendDeviation = 0;
+	ports->sendTimeout = SEND_TIMEOUT_MAX;
+	ports->timeouts = 0;
+	if( ports->parked )
+	{
+		ports->parked = FALSE;
+		dndParkedCount--;
+	}
+	_dndQueueReady(index);
+	pthread_mutex_unlock(&dndQueueLock);
+
+	if( oldPort != NULL )
+	{
+		dndEndpointSetInvalidationCallBack(oldPort, NULL);
+		dndEndpointRelease(oldPort);
+	}
+
+	// find out when the client goes away, so it can be reaped
+	dndEndpointSetInvalidationCallBack(port, _dndPortInvalidated);
+	
+	//_dndPrintPorts();
+
+//    fprintf(stderr, "returning %8lX from register port\n", hash);
+	
+	// return as a unique id the index of this record into the table
+	return CFDataCreate( kCFAllocatorDefault, (const UInt8*)&hash, sizeof(CFHashCode) );
+}
+
+/*
+ *	Unregister the port associated with a particular uid. The CFLite client doesn't
+ *	usually get a chance to call this, so most clients are instead reaped when their
+ *	port is invalidated or a dispatch thread finds it can no longer send to it. Either
+ *	way the client's records all go and its slot is reused.
+ *
+ *	Note that since there's no checking of where the messages come from, malicious
+ *	code could still randomly unregister every listening port.
+ */
+CFDataRef dndUnregisterPort( CFDataRef data )
+{
+	CFHashCode uid;
+	if( !_dndUidRead(data, &uid) ) return NULL;
+
+	CFIndex index = _dndClientIndex(uid);
+	if( index == kCFNotFound ) return NULL;
+
+	pthread_mutex_lock(&dndQueueLock);
+	_dndQueueDisconnect(dndPortList + index);
+	pthread_mutex_unlock(&dndQueueLock);
+	return NULL;
+}
+
+// give every array of a shard's notifications list room for capacity records
+static Boolean _dndNotListResize( dndShard *shard, CFIndex capacity )
+{
+	dndNotTable *table = &shard->table;
+	void *ptr;
+
+	#define RESIZE(array) \
+		if( (ptr = realloc(array, capacity * sizeof(*array))) == NULL ) return FALSE; \
+		array = ptr;
+
+	RESIZE(table->notNames)
+	RESIZE(table->notObjects)
+	RESIZE(table->notSessions)
+	RESIZE(table->notNext)
+	RESIZE(table->notClients)
+	RESIZE(table->notBehaviors)
+	RESIZE(shard->notLinks)
+
+	#undef RESIZE
+
+	shard->notListCapacity = capacity;
+	return TRUE;
+}
+
+/*
+ *	Make room in a shard's notifications list for count more records, and enough
+ *	buckets in its index to keep its chains short once they've been added.
+ */
+static Boolean _dndNotReserve( dndShard *shard, CFIndex count )
+{
+	dndNotTable *table = &shard->table;
+	CFIndex needed = table->notListCount + count;
+	if( needed > INT32_MAX ) return FALSE; // records are found by 32 bit indices
+
+	if( needed > shard->notListCapacity )
+	{
+		CFIndex capacity = shard->notListCapacity;
+		while( capacity < needed ) capacity *= 2;
+		if( capacity > INT32_MAX ) capacity = INT32_MAX;
+        if(verbose) fprintf(stderr, "Having to extend notifications list to %ld entries.\n", (long)capacity);
+
+		// arrays already grown keep their larger size, and the smaller capacity, until next time
+		if( !_dndNotListResize(shard, capacity) )
+		{
+            fprintf(stderr, "Unable to realloc larger notifications list (%ld entried).\n", (long)capacity);
+			return FALSE;
+		}
+	}
 
-	// if we already have a post open to the sender, this returns it
-	CFMessagePortRef port = CFMessagePortCreateRemote( kCFAllocatorDefault, name );
-	if( port == NULL )
+	CFIndex size = table->notIndexMask + 1;
+	while( needed > size ) size *= 2;
+	if( (size != table->notIndexMask + 1) && !_dndNotIndexResize(table, shard->notLinks, size) ) return FALSE;
+
+	return TRUE;
+}
+
+// make sure a shard has an entry for the client in the given port list slot
+static Boolean _dndShardClientReserve( dndShard *shard, CFIndex index )
+{
+	dndNotTable *table = &shard->table;
+	if( index < table->clientCount ) return TRUE;
+
+	CFIndex capacity = (table->clientCount == 0) ? SHARD_CLIENTS : table->clientCount;
+	while( capacity <= index ) capacity *= 2;
+	SInt32 *nots = realloc(shard->clientNots, capacity * sizeof(SInt32));
+	if( nots != NULL ) shard->clientNots = nots;
+	CFIndex *generations = realloc(table->generations, capacity * sizeof(CFIndex));
+	if( generations != NULL ) table->generations = generations;
+	if( (nots == NULL) || (generations == NULL) )
 	{
-		fprintf(stderr, "Couldn't open remote port back to '%s'.\n", chars);
-		return NULL;
+		fprintf(stderr, "Unable to allocate shard clients (%ld entries).\n", (long)capacity);
+		return FALSE;
 	}
-	
-	// see if the sender already exists
-	CFHashCode hash = CFHash(name);
-	dndPortRecord *ports = dndPortList;
-	CFIndex count = dndPortListCount;
-	while( count-- ) 
+
+	for( CFIndex i = table->clientCount; i < capacity; i++ )
 	{
-		if( (ports++)->name == hash ) // a connection exists
-			break;
+		shard->clientNots[i] = kCFNotFound;
+		table->generations[i] = 0;
 	}
-	
-	/*	We're going to assign the remote port the uid hash and write its info
-		into the port table at the current location of ports ... unless we're
-		at the end of the table and need to extend it */
-	
-	
-	if( (count == -1) && (dndPortListCount == dndPortListCapacity) )
+	table->clientCount = capacity;
+	return TRUE;
+}
+
+// make sure a shard has an entry for a session, returning it or kCFNotFound if it couldn't
+static CFIndex _dndShardSessionReserve( dndShard *shard, long session )
+{
+	dndNotTable *table = &shard->table;
+	CFIndex index = _dndNotSessionFind(table, session);
+	if( index != kCFNotFound ) return index;
+
+	if( table->sessionCount == shard->sessionCapacity )
 	{
-		dndPortListCapacity += PORT_LIST_SIZE;
-        if(verbose) fprintf(stderr, "Having to extend port list to %ld entries.\n", (long)dndPortListCapacity);
-		void *ptr = realloc(dndPortList, (dndPortListCapacity * sizeof(dndPortRecord)));
-		
+		CFIndex capacity = (shard->sessionCapacity == 0) ? SHARD_SESSIONS : (shard->sessionCapacity * 2);
+		void *ptr = realloc(table->sessions, capacity * sizeof(dndNotSession));
 		if( ptr == NULL )
 		{
-            fprintf(stderr, "Unable to realloc larger port list (%ld entries).\n", (long)dndPortListCapacity);
-				dndPortListCapacity -= PORT_LIST_SIZE;
-			return NULL;
+			fprintf(stderr, "Unable to allocate shard sessions (%ld entries).\n", (long)capacity);
+			return kCFNotFound;
 		}
-		
-		dndPortList = ptr;
-		ports = dndPortList + dndPortListCount;
+		table->sessions = ptr;
+		shard->sessionCapacity = capacity;
 	}
-	 
-	// write info into the port record. if the port already exists this is a 
-	//	little wasteful of our precious time
-	ports->name = hash;
-	ports->port = port;
-	ports->session = sid;
-	ports->count = 0;
-	ports->queue = NULL;
 
-	dndPortListCount++;
-	
-	//_dndPrintPorts();
+	index = table->sessionCount++;
+	table->sessions[index].session = session;
+	table->sessions[index].records = 0;
+	table->sessions[index].anyName = 0;
+	table->sessions[index].wildcards = kCFNotFound;
+	return index;
+}
 
-//    fprintf(stderr, "returning %8lX from register port\n", hash);
+/*
+ *	Add a record for a client, unless it already has one for the same name and
+ *	object. There must be room reserved for it.
+ */
+static void _dndNotAdd( dndShard *shard, const dndShardReg *reg )
+{
+	CFIndex index = reg->index;
+	if( !_dndShardClientReserve(shard, index) ) return;
+	CFIndex session = _dndShardSessionReserve(shard, reg->session);
+	if( session == kCFNotFound ) return;
+	dndNotTable *table = &shard->table;
+
+	// look for unique index-name-object tupple in the notifications index
+	for( SInt32 rec = *_dndNotChain(table, reg->name, reg->object, reg->session); rec != kCFNotFound; rec = table->notNext[rec] )
+	{
+		if( (table->notClients[rec] == index) && (table->notNames[rec] == reg->name) && (table->notObjects[rec] == reg->object) )
+		{
+			table->notBehaviors[rec] = reg->sb; // re-registering can change the suspension behaviour
+			shard->changed = TRUE;
+			return;
+		}
+	}
+
+	// notification isn't there, so save it onto the end of the list
+	SInt32 rec = (SInt32)table->notListCount;
+	dndNotLinks *nots = shard->notLinks + rec;
+	table->notClients[rec] = (SInt32)index;
+	table->notNames[rec] = reg->name;
+	table->notObjects[rec] = reg->object;
+	table->notSessions[rec] = reg->session;
+	table->notBehaviors[rec] = reg->sb;
+	_dndNotIndexInsert(table, shard->notLinks, rec);
+	table->sessions[session].records++;
+	if( reg->name == 0 ) table->sessions[session].anyName++;
+
+	// and onto the front of the client's own chain of records
+	nots->clientPrev = kCFNotFound;
+	nots->clientNext = shard->clientNots[index];
+	if( nots->clientNext != kCFNotFound ) shard->notLinks[nots->clientNext].clientPrev = rec;
+	shard->clientNots[index] = rec;
+	table->generations[index] = reg->generation;
+
+	table->notListCount++;
+	shard->changed = TRUE;
 	
-	// return as a unique id the index of this record into the table
-	return CFDataCreate( kCFAllocatorDefault, (const UInt8*)&hash, sizeof(CFHashCode) );
+    if(verbose) fprintf(stderr, "registered %ld: %8lX, %8lX, %8lX\n", (long)index, reg->name, reg->object, reg->session);
+}
+
+// remove a client's record for a name and object, returning whether it had one
+static Boolean _dndNotDelete( dndShard *shard, const dndShardReg *reg )
+{
+	if( _dndNotSessionFind(&shard->table, reg->session) == kCFNotFound ) return FALSE;
+
+	const dndNotTable *table = &shard->table;
+	for( SInt32 rec = *_dndNotChain(&shard->table, reg->name, reg->object, reg->session); rec != kCFNotFound; rec = table->notNext[rec] )
+	{
+		if( (table->notClients[rec] == reg->index) && (table->notNames[rec] == reg->name) && (table->notObjects[rec] == reg->object) )
+		{
+			_dndNotRemove(shard, rec);
+			return TRUE;
+		}
+	}
+	return FALSE;
 }
 
 /*
- *	Unregister the port associated with a particular uid. At the moment this is
- *	a no-op because (i) the CFLite client doesn't ever get a chance to call it, and
- *	(ii) since there's no checking of where the messages come from, malicious code
- *	could randomly unregister every listening port.
- *
- *	Note that if this were ever to be implemented, records and their uids/indexes would
- *	never be reused durind the life of the daemon, and an unregistered port would be
- *	indicated by its port field being set to NULL. This is what the send thread will do
- *	if it finds a port is invalid when it goes to use it.
+ *	Add or remove records, each in the shard its name hashes to, or in every shard
+ *	for a record observing any name. Room for all of a shard's new records is made
+ *	up front. The shards are left marked as changed, to be published before the next
+ *	post they're sent. Returns the number of records added or removed.
  */
-CFDataRef dndUnregisterPort( CFDataRef data )
+static CFIndex _dndShardRoute( const dndShardReg *regs, CFIndex count, Boolean add )
 {
-	fprintf(stderr, "UnregisterPort: should never be called\n");
-	return NULL;
+	CFIndex changes = 0;
+	for( CFIndex i = 0; i < dndShardCount; i++ )
+	{
+		dndShard *shard = dndShards + i;
+
+		CFIndex mine = 0;
+		for( CFIndex r = 0; r < count; r++ )
+			if( (regs[r].name == 0) || (_dndShardIndex(regs[r].name) == i) ) mine++;
+		if( (mine == 0) || (add && !_dndNotReserve(shard, mine)) ) continue;
+
+		CFIndex before = shard->table.notListCount;
+		for( CFIndex r = 0; r < count; r++ )
+		{
+			if( (regs[r].name != 0) && (_dndShardIndex(regs[r].name) != i) ) continue;
+			if( add ) _dndNotAdd(shard, regs + r);
+			else _dndNotDelete(shard, regs + r);
+		}
+		changes += add ? (shard->table.notListCount - before) : (before - shard->table.notListCount);
+	}
+	return changes;
+}
+
+// a request for the client at index to add or remove a record
+static void _dndShardRegMake( dndShardReg *reg, CFIndex index, const dndNotReg *info )
+{
+	reg->index = index;
+	reg->generation = dndPortList[index].generation;
+	reg->session = dndPortList[index].session;
+	reg->name = info->name;
+	reg->object = info->object;
+	reg->sb = info->sb;
 }
 
 /*
@@ -352,81 +2467,20 @@ CFDataRef dndRegisterNotification( CFDataRef data )
 	
 	if( dndPortListCount == 0 ) return NULL; // no clients registered
 	
-	CFIndex length = CFDataGetLength(data);
-	if( length < sizeof(dndNotReg) ) return NULL;
-	
 	dndNotReg info;
-	CFRange range = { 0, sizeof(dndNotReg) };
-	CFDataGetBytes(data, range, (UInt8 *)&info);
+	if( !_dndNotRegRead(data, &info) ) return NULL;
 	
     if(verbose) fprintf(stderr, "uid = %8lX, name = %8lX, object = %8lX\n", info.uid, info.name, info.object);
 	
 	// check that this uid is valid, and get its index into the ports table
-	dndPortRecord *ports = dndPortList;
-	CFIndex index = 0;
-	while(TRUE) 
-	{
-		if(ports->name == info.uid)
-		{
-			if(ports->port == NULL) return NULL; // un-registered port
-			break;
-		}
-		if( index++ == dndPortListCount )
-		{
-			if(verbose) 
-                fprintf(stderr, "Recieved notification from unregistered port (0x%lX).\n", info.uid);
-			return NULL;
-		}
-		ports++;
-	}
+	CFIndex index = _dndClientIndex(info.uid);
+	if( index == kCFNotFound ) return NULL;
 	
     if(verbose) fprintf(stderr, "this client has index %ld\n", (long)index);
 	
-	// look for unique index-name-object tupple in the notifications table
-	dndNotRecord *nots = dndNotList;
-	CFIndex count = dndNotListCount;
-	while ( count--) 
-	{
-		while(nots->session == 0) nots++; // the empty record marker
-		if( (nots->index == index) && (nots->name == info.name) && (nots->object == info.object) )
-			return NULL;
-		nots++;
-	}
-	
-	// notification isn't there, so we'll add it
-	if( dndNotListCount == dndNotListCapacity )
-	{
-		dndNotListCapacity += NOT_LIST_SIZE;
-        if(verbose) fprintf(stderr, "Having to extend notifications list to %ld entries.\n", (long)dndNotListCapacity);
-		void *ptr = realloc(dndNotList, (dndNotListCapacity * sizeof(dndNotRecord)));
-
-		if( ptr == NULL )
-		{
-            fprintf(stderr, "Unable to realloc larger notifications list (%ld entried).\n", (long)dndNotListCapacity);
-			dndNotListCapacity -= NOT_LIST_SIZE;
-			return NULL;
-		}
-		
-		dndNotList = ptr;
-		nots = dndNotList + dndNotListCount;
-		for( int i = 0; i < NOT_LIST_SIZE; i++ ) (nots++)->session = 0;
-		nots = dndNotList + dndNotListCount;		
-	}
-	else
-	{
-		nots = dndNotList;
-		while(nots->session != 0) nots++;
-	}
-	
-	// save the notificaton into nots
-	nots->index = index;
-	nots->name = info.name;
-	nots->object = info.object;
-	nots->session = ports->session;
-	
-	dndNotListCount++;
-	
-    if(verbose) fprintf(stderr, "registered %ld: %8lX, %8lX, %8lX\n", (long)nots->index, nots->name, nots->object, nots->session);
+	dndShardReg reg;
+	_dndShardRegMake(&reg, index, &info);
+	_dndShardRoute(&reg, 1, TRUE);
 	
 	//_dndPrintNots();
 	
@@ -442,60 +2496,379 @@ CFDataRef dndUnregisterNotification( CFDataRef data )
 {
 	if (verbose) fprintf(stderr, "Unregister for a notification.\n");
 	
-	if (!dndPortListCount || !dndNotListCount) return NULL;
+	if (!dndPortListCount) return NULL;
 	
-	// copy & pasted (mostly) from above. could break out into separate functions
-	CFIndex length = CFDataGetLength(data);
-	if( length < sizeof(dndNotReg) ) return NULL;
-
 	dndNotReg info;
-	CFRange range = { 0, sizeof(dndNotReg) };
-	CFDataGetBytes(data, range, (UInt8 *)&info);
+	if( !_dndNotRegRead(data, &info) ) return NULL;
 	
     if(verbose) fprintf(stderr, "uid = %8lX, name = %8lX, object = %8lX\n", info.uid, info.name, info.object);
 	
 	// check that this uid is valid, and get its index into the ports table
-	dndPortRecord *ports = dndPortList;
-	CFIndex index = 0;
-	while(TRUE) 
+	CFIndex index = _dndClientIndex(info.uid);
+	if( index == kCFNotFound ) return NULL;
+	
+    if(verbose) fprintf(stderr, "client exists, has index %ld\n", (long)index);
+	
+	dndShardReg reg;
+	_dndShardRegMake(&reg, index, &info);
+	if( _dndShardRoute(&reg, 1, FALSE) != 0 )
+	{
+		for( CFIndex i = 0; i < dndShardCount; i++ ) _dndPrintNots(dndShards + i);
+	}
+
+	if(verbose) fprintf(stderr, "leaving unregister notification\n");
+	return NULL;
+}
+
+/*
+ *	The batch forms of the above: the data is an array of dndNotReg structs, each
+ *	complete with its suspension behaviour, which are all handled in one pass. Room
+ *	for every new record is made up front, and each entry's uid is only looked up
+ *	if it differs from the one before it.
+ */
+static void _dndNotRegBatch( CFDataRef data, Boolean add )
+{
+	CFIndex count = CFDataGetLength(data) / sizeof(dndNotReg);
+	if(verbose) fprintf(stderr, "%s for %ld notifications\n", add ? "register" : "unregister", (long)count);
+	if( count == 0 ) return;
+
+	dndShardReg *regs = malloc(count * sizeof(dndShardReg));
+	if( regs == NULL ) return;
+
+	const UInt8 *bytes = CFDataGetBytePtr(data);
+	CFHashCode uid = 0;
+	CFIndex index = kCFNotFound;
+	CFIndex found = 0;
+	dndNotReg info;
+
+	for( CFIndex i = 0; i < count; i++ )
 	{
-		if(ports->name == info.uid)
+		memcpy(&info, bytes + (i * sizeof(dndNotReg)), sizeof(dndNotReg));
+		_dndNotRegCheck(&info);
+
+		if( (i == 0) || (info.uid != uid) )
 		{
-			if(ports->port == NULL) return NULL; // un-registered port
-			break;
+			uid = info.uid;
+			index = _dndClientIndex(uid);
 		}
-		if( ++index == dndPortListCount ) return NULL;
-		ports++;
+		if( index != kCFNotFound ) _dndShardRegMake(regs + found++, index, &info);
 	}
-	
-    if(verbose) fprintf(stderr, "client exists, has index %ld\n", (long)index);
-	
-	// look for unique index-name-object tupple in the notifications table
-	dndNotRecord *nots = dndNotList;
-	CFIndex count = dndNotListCount;
-	while(count--) 
+
+	_dndShardRoute(regs, found, add);
+	free(regs);
+}
+
+CFDataRef dndRegisterNotifications( CFDataRef data )
+{
+	if( dndPortListCount == 0 ) return NULL;
+	_dndNotRegBatch(data, TRUE);
+	return NULL;
+}
+
+CFDataRef dndUnregisterNotifications( CFDataRef data )
+{
+	if( dndPortListCount == 0 ) return NULL;
+	_dndNotRegBatch(data, FALSE);
+	return NULL;
+}
+
+/*
+ *	Suspend delivery to a client. From now on notifications for it are dropped,
+ *	coalesced or held according to the suspension behaviour of the records they
+ *	match, unless they were registered or posted to be delivered immediately.
+ */
+CFDataRef dndSuspend( CFDataRef data )
+{
+	CFHashCode uid;
+	if( !_dndUidRead(data, &uid) ) return NULL;
+
+	CFIndex index = _dndClientIndex(uid);
+	if( index == kCFNotFound ) return NULL;
+
+	if(verbose) fprintf(stderr, "suspend client %ld\n", (long)index);
+
+	pthread_mutex_lock(&dndQueueLock);
+	dndPortList[index].suspended = TRUE;
+	pthread_mutex_unlock(&dndQueueLock);
+	return NULL;
+}
+
+/*
+ *	Resume delivery to a client, moving everything held for it while it was
+ *	suspended onto its queue in one go, so the dispatch thread sends it together.
+ *	The queue grows past its limit to take them all, rather than the overflow
+ *	policy dropping what was held or disconnecting the client.
+ */
+CFDataRef dndResume( CFDataRef data )
+{
+	CFHashCode uid;
+	if( !_dndUidRead(data, &uid) ) return NULL;
+
+	CFIndex index = _dndClientIndex(uid);
+	if( index == kCFNotFound ) return NULL;
+
+	pthread_mutex_lock(&dndQueueLock);
+	dndPortRecord *ports = dndPortList + index;
+
+	if(verbose) fprintf(stderr, "resume client %ld with %ld held notifications\n", (long)index, (long)ports->heldCount);
+
+	ports->suspended = FALSE;
+	UInt64 now = dndNanoseconds();
+	Boolean live = (ports->port != NULL) && !ports->dead;
+	for( CFIndex i = 0; i < ports->heldCount; i++ )
+	{
+		dndQueue *entry = ports->held + i;
+		dndNotHeader info = { 0, entry->name, entry->object, 0 };
+		if( live ) live = _dndQueueAppend(ports, &info, entry->data, now);
+		CFRelease(entry->data);
+	}
+	ports->heldCount = 0;
+	_dndQueueReady(index);
+	pthread_mutex_unlock(&dndQueueLock);
+	return NULL;
+}
+
+// busiest first
+static int _dndStatsNameCompare( const void *a, const void *b )
+{
+	CFIndex x = ((const dndStatsName *)a)->posts, y = ((const dndStatsName *)b)->posts;
+	return (x > y) ? -1 : ((x < y) ? 1 : 0);
+}
+
+// summarise a histogram into timing, returning 0 if it's recorded nothing and so there's no summary
+static CFIndex _dndStatsTiming( dndStatsTiming *timing, CFIndex kind, CFIndex msgid, const dndHistogram *histogram )
+{
+	if( histogram->count == 0 ) return 0;
+	timing->timing = kind;
+	timing->msgid = msgid;
+	timing->count = histogram->count;
+	timing->mean = dndHistogramMean(histogram);
+	timing->p50 = dndHistogramPercentile(histogram, 50.0);
+	timing->p90 = dndHistogramPercentile(histogram, 90.0);
+	timing->p99 = dndHistogramPercentile(histogram, 99.0);
+	timing->p999 = dndHistogramPercentile(histogram, 99.9);
+	timing->max = histogram->max;
+	return 1;
+}
+
+/*
+ *	Summarise the latency histograms into timings, which must have room for
+ *	MESSAGE_TYPES + 4 of them, returning how many there are. The other threads'
+ *	histograms are merged, taking each one's lock in turn.
+ */
+static CFIndex _dndStatsTimings( dndStatsTiming *timings )
+{
+	static dndHistogram match, wait, urgentWait, send;
+	dndHistogramReset(&match);
+	dndHistogramReset(&wait);
+	dndHistogramReset(&urgentWait);
+	dndHistogramReset(&send);
+	for( CFIndex i = 0; i < dndThreadTimesCount; i++ )
+	{
+		dndTimes *times = dndThreadTimes + i;
+		pthread_mutex_lock(&times->lock);
+		dndHistogramMerge(&match, &times->match);
+		dndHistogramMerge(&wait, &times->wait);
+		dndHistogramMerge(&urgentWait, &times->urgentWait);
+		dndHistogramMerge(&send, &times->send);
+		pthread_mutex_unlock(&times->lock);
+	}
+
+	CFIndex count = 0;
+	for( CFIndex i = 0; i < MESSAGE_TYPES; i++ )
+		count += _dndStatsTiming(timings + count, TIMING_HANDLER, i, dndHandlerTimes + i);
+	count += _dndStatsTiming(timings + count, TIMING_MATCH, 0, &match);
+	count += _dndStatsTiming(timings + count, TIMING_WAIT, 0, &wait);
+	count += _dndStatsTiming(timings + count, TIMING_URGENT_WAIT, 0, &urgentWait);
+	count += _dndStatsTiming(timings + count, TIMING_SEND, 0, &send);
+	return count;
+}
+
+/*
+ *	Answer a STATS request with a snapshot of the counters, the clients' queues,
+ *	the size of each shard's table and the latency histograms.
+ */
+CFDataRef dndStatistics( CFDataRef data )
+{
+	dndStats stats;
+	memset(&stats, 0, sizeof(dndStats));
+	stats.size = sizeof(dndStats);
+	stats.uptime = dndNanoseconds() - dndStarted;
+	stats.posts = dndStatPosts;
+	stats.postMessages = dndStatPostMessages;
+	stats.clientCapacity = dndPortListCapacity;
+	stats.portMapSize = dndPortMapMask + 1;
+	stats.dispatchThreads = dndDispatchThreads;
+	stats.workerThreads = dndWorkerThreads;
+	stats.shardCount = dndShardCount;
+	stats.nameCount = dndTopNameCount;
+
+	dndStatsTiming timings[MESSAGE_TYPES + 4];
+	stats.timingCount = _dndStatsTimings(timings);
+
+	pthread_mutex_lock(&dndQueueLock);
+	stats.matched = dndStatMatched;
+	stats.matches = dndStatMatches;
+	stats.queued = dndStatQueued;
+	stats.urgent = dndStatUrgent;
+	stats.held = dndStatHeld;
+	stats.dropped = dndQueueDropped;
+	stats.coalesced = dndQueueCoalesced;
+	stats.sends = dndStatSends;
+	stats.delivered = dndStatDelivered;
+	stats.sendFailures = dndStatSendFailures;
+	stats.sendTimeouts = dndStatSendTimeouts;
+	stats.disconnects = dndStatDisconnects;
+	stats.breakerTrips = dndStatTrips;
+	stats.breakerRecoveries = dndStatRecoveries;
+	stats.parked = dndParkedCount;
+	for( CFIndex i = 0; i < dndPortListCount; i++ )
+	{
+		dndPortRecord *ports = dndPortList + i;
+		if( !ports->live || ports->dead ) continue;
+		stats.clients++;
+		if( ports->suspended ) stats.suspended++;
+		if( ports->listed || ports->urgentListed ) stats.readyClients++;
+		stats.queueDepth += ports->count + ports->urgentCount;
+		if( ports->count + ports->urgentCount > stats.queueDepthMax ) stats.queueDepthMax = ports->count + ports->urgentCount;
+		stats.heldDepth += ports->heldCount;
+	}
+	pthread_mutex_unlock(&dndQueueLock);
+
+	CFMutableDataRef reply = CFDataCreateMutable( kCFAllocatorDefault, 0 );
+	if( reply == NULL ) return NULL;
+	CFDataAppendBytes( reply, (const UInt8 *)&stats, sizeof(dndStats) );
+
+	for( CFIndex i = 0; i < dndShardCount; i++ )
 	{
-		while(nots->session == 0) nots++; // the empty record marker
-		if( (nots->index == index) && (nots->name == info.name) && (nots->object == info.object) )
+		dndShard *shard = dndShards + i;
+		dndStatsShard entry = { shard->table.notListCount, shard->notListCapacity, shard->table.notIndexMask + 1, shard->table.clientCount, 0, shard->table.sessionCount };
+		if( dndWorkerThreads != 0 )
 		{
-			nots->index = 0; // or course, these 3 are valid values...
-			nots->name = 0;
-			nots->object = 0;
-			nots->session = 0;
-			
-			dndNotListCount--;
+			pthread_mutex_lock(&shard->lock);
+			entry.backlog = shard->opCount;
+			pthread_mutex_unlock(&shard->lock);
+		}
+		CFDataAppendBytes( reply, (const UInt8 *)&entry, sizeof(dndStatsShard) );
+	}
 
-			_dndPrintNots();
-			
-			return NULL;
+	dndStatsName names[TOP_NAMES];
+	memcpy(names, dndTopNames, dndTopNameCount * sizeof(dndStatsName));
+	qsort(names, dndTopNameCount, sizeof(dndStatsName), _dndStatsNameCompare);
+	CFDataAppendBytes( reply, (const UInt8 *)names, dndTopNameCount * sizeof(dndStatsName) );
+	CFDataAppendBytes( reply, (const UInt8 *)timings, stats.timingCount * sizeof(dndStatsTiming) );
+
+	return reply;
+}
+
+/*
+ *	Answer a TRACE request with a copy of the most recent trace events.
+ */
+CFDataRef dndTraceRequest( CFDataRef data )
+{
+	CFIndex limit = TRACE_EVENTS;
+	if( (data != NULL) && (CFDataGetLength(data) >= sizeof(CFIndex)) )
+		CFDataGetBytes(data, CFRangeMake(0, sizeof(CFIndex)), (UInt8 *)&limit);
+	if( limit <= 0 ) limit = TRACE_EVENTS;
+	return dndTraceCopy(limit);
+}
+
+static void *_dndShardThread( void *arg )
+{
+	dndShard *shard = arg;
+	dndShardOp *ops = NULL;
+	CFIndex capacity = 0;
+
+	while(TRUE)
+	{
+		pthread_mutex_lock(&shard->lock);
+		while( shard->opCount == 0 )
+			pthread_cond_wait(&shard->cond, &shard->lock);
+
+		// swap queues, leaving the main thread our empty one to fill
+		dndShardOp *taken = shard->ops;
+		CFIndex takenCapacity = shard->opCapacity;
+		CFIndex count = shard->opCount;
+		shard->ops = ops;
+		shard->opCapacity = capacity;
+		shard->opCount = 0;
+		ops = taken;
+		capacity = takenCapacity;
+		pthread_mutex_unlock(&shard->lock);
+
+		for( CFIndex i = 0; i < count; i++ )
+		{
+			dndShardOp *op = ops + i;
+			if( op->op == SHARD_NOTIFICATION )
+			{
+				dndNotHeader info;
+				memcpy(&info, CFDataGetBytePtr(op->data), sizeof(dndNotHeader));
+				_dndShardNotification(shard, &shard->matcher, &info, op->data, TRUE);
+			}
+			else
+				_dndShardNotificationBatch(shard, &shard->matcher, op->data);
+			CFRelease(op->data);
 		}
-		nots++;
 	}
 
-	if(verbose) fprintf(stderr, "leaving unregister notification\n");
 	return NULL;
 }
 
+// create the list for storing a shard's notifications, and the index over it
+static Boolean _dndShardInit( dndShard *shard )
+{
+	if( !_dndNotListResize(shard, NOT_LIST_SIZE) )
+	{
+		fprintf(stderr, "Couldn't create storage for notification records\n");
+		return FALSE;
+	}
+
+	if( !_dndNotIndexResize(&shard->table, shard->notLinks, NOT_INDEX_SIZE) ) return FALSE;
+	if( dndWorkerThreads == 0 ) return TRUE;
+
+	// the worker's reader, and a first table for it to read
+	shard->matcher.reader = dndEpochReaderCreate();
+	if( shard->matcher.reader == NULL ) return FALSE;
+	shard->changed = TRUE;
+	_dndShardPublish(shard);
+	if( shard->published == NULL ) return FALSE;
+
+	pthread_mutex_init(&shard->lock, NULL);
+	pthread_cond_init(&shard->cond, NULL);
+	return TRUE;
+}
+
+void usage( void );
+
+// parse a whole number option, which must be nothing else and between min and max
+static Boolean _dndOptionNumber( const char *arg, CFIndex min, CFIndex max, CFIndex *value )
+{
+	char *end;
+	errno = 0;
+	long n = strtol(arg, &end, 10);
+	if( (end == arg) || (*end != '\0') || (errno != 0) || (n < min) || (n > max) ) return FALSE;
+	*value = n;
+	return TRUE;
+}
+
+void usage( void )
+{
+	fprintf(stderr, "\nddistnoted: Pass distributed notifications between tasks.\n");
+	fprintf(stderr, "    [-v]  ~ report what's going on to stderr\n");
+	fprintf(stderr, "    [-t cf|socket]  ~ transport to use\n");
+	fprintf(stderr, "    [-d threads]  ~ dispatch threads sending to clients, up to %d (%d)\n", DISPATCH_THREADS_MAX, DISPATCH_THREADS);
+	fprintf(stderr, "    [-w workers]  ~ threads matching notifications, each over its own shard, 0 for the main thread, up to %d (0)\n", WORKER_THREADS_MAX);
+	fprintf(stderr, "    [-q limit]  ~ notifications each client's queue holds, 0 for no limit (%d)\n", QUEUE_LIMIT);
+	fprintf(stderr, "    [-o oldest|newest|disconnect]  ~ what goes when a client's queue is full (oldest)\n");
+	fprintf(stderr, "    [-c]  ~ coalesce notifications already waiting in a client's queue\n");
+	fprintf(stderr, "    [-b count]  ~ notifications in each batch sent to batching clients, up to %d (%d)\n", NOTIFICATION_BATCH_MAX, BATCH_COUNT);
+	fprintf(stderr, "    [-s bytes]  ~ size of each batch, unless one notification is larger (%d)\n", BATCH_SIZE);
+	fprintf(stderr, "    [-k timeouts]  ~ send timeouts in a row which park a client, 0 for never (%d)\n", BREAKER_TIMEOUTS);
+	fprintf(stderr, "    [-T events]  ~ trace events kept by each thread, 0 for no tracing, up to %d (%d)\n", TRACE_SIZE_MAX, TRACE_SIZE);
+	fprintf(stderr, "    [-f file]  ~ where SIGUSR2 writes the trace (%s)\n", TRACE_PATH);
+	fprintf(stderr, "    [-m scalar|sse2|avx2|off]  ~ kernel scanning wildcard-heavy tables (off)\n");
+}
+
 int main (int argc, const char * argv[]) {
     
     // SIGSEV signal handler
@@ -505,19 +2878,106 @@ int main (int argc, const char * argv[]) {
     action.sa_flags = SA_SIGINFO | SA_ONSTACK;
     sigaction(SIGSEGV, &action, NULL);
 
+    dndStarted = dndNanoseconds();
+
     int c = -1;
-    while ((c = getopt (argc, (char * const *)argv, "v")) != -1) {
+    while ((c = getopt (argc, (char * const *)argv, "vcd:q:o:b:s:t:w:T:f:k:m:")) != -1) {
+        Boolean number = TRUE;
         switch (c) {
             case 'v':
                 verbose = true;
                 break;
-            default:
-                fprintf(stderr, "unknown argument '-%c'\n", c);
+            case 'c':
+                dndCoalesce = true;
+                break;
+            case 'd':
+                number = _dndOptionNumber(optarg, 1, DISPATCH_THREADS_MAX, &dndDispatchThreads);
                 break;
+            case 'q':
+                number = _dndOptionNumber(optarg, 0, INT32_MAX, &dndQueueLimit);
+                break;
+            case 'o':
+                if (strcmp(optarg, "oldest") == 0) dndQueuePolicy = OVERFLOW_DROP_OLDEST;
+                else if (strcmp(optarg, "newest") == 0) dndQueuePolicy = OVERFLOW_DROP_NEWEST;
+                else if (strcmp(optarg, "disconnect") == 0) dndQueuePolicy = OVERFLOW_DISCONNECT;
+                else {
+                    fprintf(stderr, "unknown overflow policy '%s'\n", optarg);
+                    usage();
+                    return -1;
+                }
+                break;
+            case 'b':
+                number = _dndOptionNumber(optarg, 1, NOTIFICATION_BATCH_MAX, &dndBatchCount);
+                break;
+            case 's':
+                number = _dndOptionNumber(optarg, 1, INT32_MAX, &dndBatchSize);
+                break;
+            case 't':
+                dndPortTransport = dndTransportNamed(optarg);
+                if (!dndPortTransport) {
+                    fprintf(stderr, "unknown transport '%s'\n", optarg);
+                    usage();
+                    return -1;
+                }
+                break;
+            case 'w':
+                number = _dndOptionNumber(optarg, 0, WORKER_THREADS_MAX, &dndWorkerThreads);
+                break;
+            case 'T':
+                number = _dndOptionNumber(optarg, 0, TRACE_SIZE_MAX, &dndTraceEvents);
+                break;
+            case 'f':
+                dndTracePath = optarg;
+                break;
+            case 'k':
+                number = _dndOptionNumber(optarg, 0, INT32_MAX, &dndBreakerTimeouts);
+                break;
+            case 'm':
+                if (strcmp(optarg, "off") == 0) dndScanKernel = NULL;
+                else if (dndMatchKernelNamed(optarg)) dndScanKernel = dndMatchKernelNamed(optarg);
+                else {
+                    fprintf(stderr, "unknown or unsupported match kernel '%s'\n", optarg);
+                    usage();
+                    return -1;
+                }
+                break;
+            default:
+                usage();
+                return -1;
+        }
+        if (!number) {
+            fprintf(stderr, "bad value '%s' for -%c\n", optarg, c);
+            usage();
+            return -1;
         }
     }
 
-	if (verbose) fprintf(stderr, "ddistnoted has started\n");
+	if (verbose) fprintf(stderr, "ddistnoted has started, scanning with %s\n", dndScanKernel ? dndScanKernel->name : "nothing");
+	
+	// trace, unless asked not to, and dump the trace on SIGUSR2. this has to come before
+	//	any other thread is started, so they all leave the signal to it
+	dndTraceInit(dndTraceEvents);
+	if (dndTraceEvents && !dndTraceWriteOnSignal(SIGUSR2, dndTracePath)) {
+		fprintf(stderr, "Couldn't start the trace signal thread\n");
+		return 1;
+	}
+	
+	// the latency histograms, for the main thread and every other thread started below
+	for (CFIndex i = 0; i < MESSAGE_TYPES; i++) dndHistogramReset(dndHandlerTimes + i);
+	dndThreadTimesCount = 1 + dndWorkerThreads + dndDispatchThreads;
+	dndThreadTimes = calloc(dndThreadTimesCount, sizeof(dndTimes));
+	if (!dndThreadTimes) {
+		fprintf(stderr, "Couldn't create storage for latency histograms\n");
+		return 1;
+	}
+	for (CFIndex i = 0; i < dndThreadTimesCount; i++) {
+		pthread_mutex_init(&dndThreadTimes[i].lock, NULL);
+		dndHistogramReset(&dndThreadTimes[i].match);
+		dndHistogramReset(&dndThreadTimes[i].wait);
+		dndHistogramReset(&dndThreadTimes[i].urgentWait);
+		dndHistogramReset(&dndThreadTimes[i].send);
+	}
+	dndMainMatcher.times = dndThreadTimes;
 	
 	// create the list for storing clients' info
 	dndPortList = calloc(PORT_LIST_SIZE, sizeof(dndPortRecord));
@@ -527,35 +2987,60 @@ int main (int argc, const char * argv[]) {
 	}
 	dndPortListCapacity = PORT_LIST_SIZE;
 	
-	// create the list for storing notifications
-	dndNotList = calloc(NOT_LIST_SIZE, sizeof(dndNotRecord));
-	if (!dndNotList) {
-		fprintf(stderr, "Couldn't create storage for notification records\n");
+	// and the map from their uids into it
+	if (!_dndPortMapResize(PORT_MAP_SIZE)) return 1;
+	
+	// create the shards of the notifications list, one for each worker if there are any
+	dndShardCount = (dndWorkerThreads > 0) ? dndWorkerThreads : 1;
+	dndShards = calloc(dndShardCount, sizeof(dndShard));
+	if (!dndShards) {
+		fprintf(stderr, "Couldn't create storage for notification shards\n");
 		return 1;
 	}
-	dndNotListCapacity = NOT_LIST_SIZE;
-	
-	// Create the message port. This will bootstrap_check_in() and claim the port launchd created for us
-	CFMessagePortContext context = { 0, NULL, NULL, NULL, NULL };
-	CFMessagePortRef port = CFMessagePortCreateLocal(kCFAllocatorDefault, CFSTR("org.puredarwin.ddistnoted"), dndMessageRecieved, &context, NULL);
+	for (CFIndex i = 0; i < dndShardCount; i++) {
+		if (!_dndShardInit(dndShards + i)) return 1;
+	}
+
+	// Create the message port, which is added to the main runloop. With CFMessagePort this
+	//	will bootstrap_check_in() and claim the port launchd created for us
+	if (!dndPortTransport) dndPortTransport = dndTransportDefault();
+	dndEndpointRef port = dndEndpointCreateLocal(dndPortTransport, CFSTR("org.puredarwin.ddistnoted"), dndMessageRecieved, NULL);
 	
 	if (!port) {
-		fprintf(stderr, "CFMessagePortCreateLocal() counldn't create local message port to org.puredarwin.ddistnoted\n");
+		fprintf(stderr, "Couldn't create local %s port to org.puredarwin.ddistnoted\n", dndPortTransport->name);
 		return 1;
 	}
 	
-	// get the runloop source from the message port...
-	CFRunLoopSourceRef rls = CFMessagePortCreateRunLoopSource( kCFAllocatorDefault, port, 0 );
-    if (!rls) {
-        fprintf(stderr, "CFMessagePortCreateRunLoopSource() failed\n");
-        return 1;
-    }
+	// create the source the dispatch threads signal when they find a dead client
+	dndReaper = dndSourceCreate( dndPortTransport, _dndReap, NULL );
+	if (!dndReaper) {
+		fprintf(stderr, "Couldn't create the reaper source\n");
+		return 1;
+	}
+	
+	// start the threads which deliver notifications to clients
+	for (CFIndex i = 0; i < dndDispatchThreads; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, _dndDispatchThread, dndThreadTimes + 1 + dndWorkerThreads + i) != 0) {
+			fprintf(stderr, "Couldn't start dispatch thread\n");
+			return 1;
+		}
+		pthread_detach(thread);
+	}
 	
-	// ...and add it to the main runloop
-	CFRunLoopAddSource( CFRunLoopGetMain(), rls, kCFRunLoopCommonModes );
+	// and those which match notifications, when the main thread isn't doing it itself
+	for (CFIndex i = 0; i < dndWorkerThreads; i++) {
+		pthread_t thread;
+		dndShards[i].matcher.times = dndThreadTimes + 1 + i;
+		if (pthread_create(&thread, NULL, _dndShardThread, dndShards + i) != 0) {
+			fprintf(stderr, "Couldn't start shard worker thread\n");
+			return 1;
+		}
+		pthread_detach(thread);
+	}
 	
-	// then run the runloop
-	CFRunLoopRun();
+	// then run the runloop, which for sockets is our own epoll loop rather than CFRunLoop
+	dndTransportRun(dndPortTransport);
 	
 	fprintf(stderr, "ddistnoted has escaped its runloop!\n");
     
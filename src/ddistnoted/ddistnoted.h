@@ -11,15 +11,33 @@
 #define UNREGISTER_PORT			2
 #define REGISTER_NOTIFICATION	3
 #define UNREGISTER_NOTIFICATION	4
+#define SUSPEND					5
+#define RESUME					6
+#define REGISTER_NOTIFICATIONS	7
+#define UNREGISTER_NOTIFICATIONS	8
+#define NOTIFICATION_BATCH		9
+#define STATS					10
+#define TRACE					11
 
-// structure used to pass register and un-register requests
+// a REGISTER_PORT request is the client's session, as a long, then the name of its
+//	port as a NUL-terminated ASCII string, optionally followed by a CFIndex of the
+//	DND_PORT_ flags below saying what the client can handle
+#define DND_PORT_BATCH_DELIVERY	(1 << 0)	// accepts NOTIFICATION_BATCH messages
+
+// structure used to pass register and un-register requests. requests which stop
+//	short of sb are accepted, and treated as CFNotificationSuspensionBehaviorDeliverImmediately
 typedef struct dndNotReg {
 	CFHashCode uid;
 	CFHashCode name;
 	CFHashCode object;
-	//CFNotificationSuspensionBehavior sb;
+	CFNotificationSuspensionBehavior sb;
 } dndNotReg;
 
+// REGISTER_NOTIFICATIONS and UNREGISTER_NOTIFICATIONS requests carry an array of
+//	complete dndNotReg structs, which may name more than one uid
+
+// UNREGISTER_PORT, SUSPEND and RESUME requests carry just the client's uid, as a CFHashCode
+
 // the notification header structure
 typedef struct dndNotHeader {
 	long session;
@@ -28,3 +46,104 @@ typedef struct dndNotHeader {
 	CFIndex flags;
 } dndNotHeader;
 
+// a NOTIFICATION_BATCH message is a series of frames, each of which is a dndFrameHeader
+//	followed by length bytes of what would otherwise have been sent as a NOTIFICATION
+//	message: a dndNotHeader and the serialised notification. clients registered with
+//	DND_PORT_BATCH_DELIVERY are sent their notifications in the same format
+typedef struct dndFrameHeader {
+	CFIndex length;
+} dndFrameHeader;
+
+// the most frames a NOTIFICATION_BATCH sent to the daemon may hold. larger ones are dropped whole
+#define NOTIFICATION_BATCH_MAX	1024
+
+/*
+ *	A STATS request carries nothing, and is answered with a snapshot of the daemon's
+ *	counters: a dndStats, then shardCount dndStatsShards, nameCount dndStatsNames and
+ *	timingCount dndStatsTimings.
+ *	Totals count from when the daemon started, uptime nanoseconds ago, so rates come
+ *	from the difference between two snapshots.
+ */
+typedef struct dndStats {
+	CFIndex size;			// sizeof(dndStats), so a mismatched client can tell
+	UInt64 uptime;
+
+	CFIndex posts;			// notifications received, whether alone or in a batch
+	CFIndex postMessages;	// NOTIFICATION and NOTIFICATION_BATCH messages received
+	CFIndex matched;		// notifications which found at least one client
+	CFIndex matches;		// clients found, over all notifications
+	CFIndex queued;			// notifications put on a client's queue
+	CFIndex urgent;			// ...of which went in its urgent lane, to be delivered immediately
+	CFIndex held;			// notifications held for a suspended client
+	CFIndex dropped;		// notifications discarded by a full queue
+	CFIndex coalesced;		// notifications merged into one already waiting
+
+	CFIndex sends;			// messages sent to clients
+	CFIndex delivered;		// notifications in those messages which succeeded
+	CFIndex sendFailures;	// messages which couldn't be sent, including timeouts
+	CFIndex sendTimeouts;
+	CFIndex disconnects;	// clients disconnected, by a failed send, overflow or request
+	CFIndex breakerTrips;	// clients parked after too many send timeouts in a row
+	CFIndex breakerRecoveries;	// ...and let go again after a probe got through
+
+	CFIndex clients;		// live clients, and the port list they're kept in
+	CFIndex clientCapacity;
+	CFIndex portMapSize;
+	CFIndex suspended;
+	CFIndex parked;			// clients whose circuit breaker is open
+	CFIndex readyClients;	// clients with notifications waiting for a dispatch thread
+	CFIndex queueDepth;		// notifications waiting on all clients' queues
+	CFIndex queueDepthMax;	// ...and on the longest
+	CFIndex heldDepth;		// notifications held for suspended clients
+
+	CFIndex dispatchThreads;
+	CFIndex workerThreads;
+	CFIndex shardCount;
+	CFIndex nameCount;
+	CFIndex timingCount;
+} dndStats;
+
+// the notifications table of each shard
+typedef struct dndStatsShard {
+	CFIndex records;
+	CFIndex capacity;
+	CFIndex buckets;		// in each of its indexes
+	CFIndex clients;		// port slots the table has room for
+	CFIndex backlog;		// posts waiting for the shard's worker
+	CFIndex sessions;		// sessions with records in the table
+} dndStatsShard;
+
+// the busiest notification names, most posted first. posts may be overcounted by up
+//	to error, the count the name inherited when it took over a less busy name's place
+typedef struct dndStatsName {
+	CFHashCode name;
+	CFIndex posts;
+	CFIndex error;
+} dndStatsName;
+
+// what a dndStatsTiming measured
+enum {
+	TIMING_HANDLER,		// the main thread handling a message of type msgid, start to finish
+	TIMING_MATCH,		// matching one notification against its shard
+	TIMING_WAIT,		// a notification waiting on a client's queue, from being matched to being sent
+	TIMING_URGENT_WAIT,	// ...or in its urgent lane
+	TIMING_SEND			// sending one message to a client
+};
+
+// a summary of one of the daemon's latency histograms, in nanoseconds. only those
+//	which have recorded something are sent
+typedef struct dndStatsTiming {
+	CFIndex timing;
+	CFIndex msgid;
+	CFIndex count;
+	UInt64 mean;
+	UInt64 p50;
+	UInt64 p90;
+	UInt64 p99;
+	UInt64 p999;
+	UInt64 max;
+} dndStatsTiming;
+
+// a TRACE request may carry a CFIndex of the most events wanted, and is answered with
+//	the most recent events from the daemon's trace rings, as described in dndtrace.h
+#define TRACE_EVENTS	4096	// ...when it doesn't
@@ -0,0 +1,115 @@
+/*
+ *  dndepoch.c
+ *  ddistnoted
+ *
+ *	Epoch-based reclamation.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <pthread.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "dndepoch.h"
+
+/*
+ *	The global epoch moves on each time something is retired, and the block is
+ *	tagged with the epoch it was retired in. A reader records the epoch it entered
+ *	in, then loads whatever it's going to read. So a reader that entered after the
+ *	block was retired can only have seen its replacement, and the block can be freed
+ *	once every reader is either outside or entered in a later epoch.
+ *
+ *	Both sides put a full barrier between their store and the load that follows it,
+ *	the reader between its epoch and the data and the writer between publishing and
+ *	checking the readers, so at least one of them sees the other's store.
+ */
+#define EPOCH_IDLE	LONG_MAX
+
+struct dndEpochReader {
+	volatile CFIndex epoch;		// the epoch it entered in, or EPOCH_IDLE
+	struct dndEpochReader *next;
+};
+
+typedef struct dndRetired {
+	void *ptr;
+	CFIndex epoch;
+} dndRetired;
+
+#define RETIRED_SIZE	16
+static volatile CFIndex dndEpoch = 0;
+static pthread_mutex_t dndEpochReadersLock = PTHREAD_MUTEX_INITIALIZER;
+static struct dndEpochReader * volatile dndEpochReaders = NULL;
+static dndRetired *dndRetiredList = NULL;
+static CFIndex dndRetiredCount = 0;
+static CFIndex dndRetiredCapacity = 0;
+
+dndEpochReaderRef dndEpochReaderCreate( void )
+{
+	struct dndEpochReader *reader = malloc(sizeof(struct dndEpochReader));
+	if( reader == NULL ) return NULL;
+	reader->epoch = EPOCH_IDLE;
+
+	// readers are only ever pushed onto the front, so the writer can walk the list unlocked
+	pthread_mutex_lock(&dndEpochReadersLock);
+	reader->next = dndEpochReaders;
+	__sync_synchronize();
+	dndEpochReaders = reader;
+	pthread_mutex_unlock(&dndEpochReadersLock);
+	return reader;
+}
+
+void dndEpochEnter( dndEpochReaderRef reader )
+{
+	reader->epoch = dndEpoch;
+	__sync_synchronize();
+}
+
+void dndEpochExit( dndEpochReaderRef reader )
+{
+	__sync_synchronize();
+	reader->epoch = EPOCH_IDLE;
+}
+
+void dndEpochRetire( void *ptr )
+{
+	if( dndRetiredCount == dndRetiredCapacity )
+	{
+		CFIndex capacity = (dndRetiredCapacity == 0) ? RETIRED_SIZE : (dndRetiredCapacity * 2);
+		void *list = realloc(dndRetiredList, capacity * sizeof(dndRetired));
+		if( list == NULL )
+		{
+			// better to leak it than free it while someone might be reading it
+			fprintf(stderr, "Unable to allocate retired list (%ld entries).\n", (long)capacity);
+			return;
+		}
+		dndRetiredList = list;
+		dndRetiredCapacity = capacity;
+	}
+
+	dndRetiredList[dndRetiredCount].ptr = ptr;
+	dndRetiredList[dndRetiredCount++].epoch = __sync_fetch_and_add(&dndEpoch, 1);
+
+	dndEpochReclaim();
+}
+
+void dndEpochReclaim( void )
+{
+	__sync_synchronize();
+
+	CFIndex oldest = EPOCH_IDLE;
+	for( struct dndEpochReader *reader = dndEpochReaders; reader != NULL; reader = reader->next )
+	{
+		CFIndex epoch = reader->epoch;
+		if( epoch < oldest ) oldest = epoch;
+	}
+
+	CFIndex kept = 0;
+	for( CFIndex i = 0; i < dndRetiredCount; i++ )
+	{
+		if( dndRetiredList[i].epoch < oldest )
+			free(dndRetiredList[i].ptr);
+		else
+			dndRetiredList[kept++] = dndRetiredList[i];
+	}
+	dndRetiredCount = kept;
+}
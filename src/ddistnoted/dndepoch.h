@@ -0,0 +1,26 @@
+/*
+ *  dndepoch.h
+ *  ddistnoted
+ *
+ *	Epoch-based reclamation, for data which one writer replaces wholesale while
+ *	any number of readers go on using it without taking a lock. A reader brackets
+ *	each use with dndEpochEnter() and dndEpochExit(). The writer publishes a
+ *	replacement, then retires the old copy, which is freed once every reader that
+ *	could have picked it up has left.
+ *
+ *	Readers are created once per thread and are never destroyed. Retiring and
+ *	reclaiming are for the writer's thread only.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+
+typedef struct dndEpochReader *dndEpochReaderRef;
+
+dndEpochReaderRef dndEpochReaderCreate( void );
+void dndEpochEnter( dndEpochReaderRef reader );
+void dndEpochExit( dndEpochReaderRef reader );
+
+// hand over a malloc()ed block which has been replaced, to be freed when it's safe
+void dndEpochRetire( void *ptr );
+// free whatever retired blocks no reader can still be using
+void dndEpochReclaim( void );
@@ -0,0 +1,394 @@
+/*
+ *  dndeventloop.c
+ *  ddistnoted
+ *
+ *	epoll (or poll) based event loop for the socket transport.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#else
+#include <poll.h>
+#endif
+#include "dndeventloop.h"
+
+/*
+ *	What's being watched is kept in a table indexed by fd, so that an event can
+ *	be checked against the current registration before it's reported: an fd which
+ *	has been removed since epoll_wait() returned has no callout. Each registration
+ *	also gets a generation, which goes with its events, since an fd closed while a
+ *	batch of them is being handled can be reused by a new connection before its
+ *	own events come up. Those are for the old connection, so they're dropped.
+ */
+typedef struct dndWatch {
+	dndEventCallBack callout;
+	void *info;
+	UInt32 events;
+	UInt32 generation;
+} dndWatch;
+
+#define WATCH_TABLE_SIZE	256
+static dndWatch *dndWatches = NULL;
+static int dndWatchCapacity = 0;
+static int dndWatchHigh = 0;		// one more than the highest fd being watched
+static UInt32 dndWatchGeneration = 0;
+
+#if defined(__linux__)
+#define EVENT_BATCH		256			// the most events taken from each epoll_wait()
+static int dndEpoll = -1;
+#else
+static struct pollfd *dndPollFds = NULL;	// what's passed to poll(), grown to dndWatchHigh
+static UInt32 *dndPollGenerations = NULL;	// and the generation of each one's watch
+static int dndPollCapacity = 0;
+#endif
+
+/*
+ *	Timers are kept in a binary min-heap ordered by fire date.
+ */
+typedef struct dndTimer {
+	CFAbsoluteTime fireDate;
+	dndTimerCallBack callout;
+	void *info;
+	CFIndex index;			// position in the heap
+} dndTimer;
+
+#define TIMER_HEAP_SIZE		64
+static dndTimerRef *dndTimers = NULL;
+static CFIndex dndTimerCount = 0;
+static CFIndex dndTimerCapacity = 0;
+
+typedef struct dndEventSource {
+	int fds[2];				// read and write ends, which are the same eventfd on Linux
+	dndTimerCallBack perform;
+	void *info;
+} dndEventSource;
+
+static Boolean _dndEventLoopInit( void )
+{
+#if defined(__linux__)
+	if( dndEpoll == -1 )
+	{
+		dndEpoll = epoll_create1(EPOLL_CLOEXEC);
+		if( dndEpoll == -1 ) return FALSE;
+	}
+#endif
+	return TRUE;
+}
+
+#if defined(__linux__)
+static UInt32 _dndEventsToEpoll( UInt32 events )
+{
+	UInt32 flags = EPOLLET | EPOLLRDHUP;
+	if( events & dndEventRead ) flags |= EPOLLIN;
+	if( events & dndEventWrite ) flags |= EPOLLOUT;
+	return flags;
+}
+
+// what epoll hands back with each event: the fd, and its watch's generation above it
+static void _dndEventSet( struct epoll_event *event, int fd, UInt32 events )
+{
+	memset(event, 0, sizeof(struct epoll_event));
+	event->events = _dndEventsToEpoll(events);
+	event->data.u64 = ((UInt64)dndWatches[fd].generation << 32) | (UInt32)fd;
+}
+#endif
+
+Boolean dndEventLoopAdd( int fd, UInt32 events, dndEventCallBack callout, void *info )
+{
+	if( (fd < 0) || !_dndEventLoopInit() ) return FALSE;
+
+	if( fd >= dndWatchCapacity )
+	{
+		int capacity = (dndWatchCapacity == 0) ? WATCH_TABLE_SIZE : dndWatchCapacity;
+		while( capacity <= fd ) capacity *= 2;
+		void *ptr = realloc(dndWatches, capacity * sizeof(dndWatch));
+		if( ptr == NULL ) return FALSE;
+		dndWatches = ptr;
+		memset(dndWatches + dndWatchCapacity, 0, (capacity - dndWatchCapacity) * sizeof(dndWatch));
+		dndWatchCapacity = capacity;
+	}
+
+	dndWatches[fd].generation = ++dndWatchGeneration;
+
+#if defined(__linux__)
+	struct epoll_event event;
+	_dndEventSet(&event, fd, events);
+	if( epoll_ctl(dndEpoll, EPOLL_CTL_ADD, fd, &event) != 0 ) return FALSE;
+#endif
+
+	dndWatches[fd].callout = callout;
+	dndWatches[fd].info = info;
+	dndWatches[fd].events = events;
+	if( fd >= dndWatchHigh ) dndWatchHigh = fd + 1;
+	return TRUE;
+}
+
+Boolean dndEventLoopSetEvents( int fd, UInt32 events )
+{
+	if( (fd < 0) || (fd >= dndWatchHigh) || (dndWatches[fd].callout == NULL) ) return FALSE;
+	if( dndWatches[fd].events == events ) return TRUE;
+
+#if defined(__linux__)
+	// adding an event which is already ready makes it reported straight away
+	struct epoll_event event;
+	_dndEventSet(&event, fd, events);
+	if( epoll_ctl(dndEpoll, EPOLL_CTL_MOD, fd, &event) != 0 ) return FALSE;
+#endif
+
+	dndWatches[fd].events = events;
+	return TRUE;
+}
+
+void dndEventLoopRemove( int fd )
+{
+	if( (fd < 0) || (fd >= dndWatchHigh) || (dndWatches[fd].callout == NULL) ) return;
+
+#if defined(__linux__)
+	epoll_ctl(dndEpoll, EPOLL_CTL_DEL, fd, NULL);
+#endif
+
+	dndWatches[fd].callout = NULL;
+	dndWatches[fd].info = NULL;
+	dndWatches[fd].events = 0;
+	while( (dndWatchHigh > 0) && (dndWatches[dndWatchHigh - 1].callout == NULL) ) dndWatchHigh--;
+}
+
+static void _dndEventDeliver( int fd, UInt32 generation, UInt32 events )
+{
+	if( fd >= dndWatchHigh ) return;
+	dndWatch *watch = dndWatches + fd;
+	if( (watch->callout == NULL) || (watch->generation != generation) ) return;
+
+	// only report what was asked for, plus the end of the connection
+	events &= (watch->events | dndEventHangUp | dndEventError);
+	if( events != 0 ) watch->callout(fd, events, watch->info);
+}
+
+/*
+ *	Timer heap maintenance
+ */
+static void _dndTimerPlace( dndTimerRef timer, CFIndex index )
+{
+	dndTimers[index] = timer;
+	timer->index = index;
+}
+
+static void _dndTimerUp( CFIndex index )
+{
+	dndTimerRef timer = dndTimers[index];
+	while( index > 0 )
+	{
+		CFIndex parent = (index - 1) / 2;
+		if( dndTimers[parent]->fireDate <= timer->fireDate ) break;
+		_dndTimerPlace(dndTimers[parent], index);
+		index = parent;
+	}
+	_dndTimerPlace(timer, index);
+}
+
+static void _dndTimerDown( CFIndex index )
+{
+	dndTimerRef timer = dndTimers[index];
+	while(TRUE)
+	{
+		CFIndex child = (2 * index) + 1;
+		if( child >= dndTimerCount ) break;
+		if( (child + 1 < dndTimerCount) && (dndTimers[child + 1]->fireDate < dndTimers[child]->fireDate) ) child++;
+		if( timer->fireDate <= dndTimers[child]->fireDate ) break;
+		_dndTimerPlace(dndTimers[child], index);
+		index = child;
+	}
+	_dndTimerPlace(timer, index);
+}
+
+dndTimerRef dndEventLoopAddTimer( CFAbsoluteTime fireDate, dndTimerCallBack callout, void *info )
+{
+	if( dndTimerCount == dndTimerCapacity )
+	{
+		CFIndex capacity = (dndTimerCapacity == 0) ? TIMER_HEAP_SIZE : (dndTimerCapacity * 2);
+		void *ptr = realloc(dndTimers, capacity * sizeof(dndTimerRef));
+		if( ptr == NULL ) return NULL;
+		dndTimers = ptr;
+		dndTimerCapacity = capacity;
+	}
+
+	dndTimerRef timer = malloc(sizeof(dndTimer));
+	if( timer == NULL ) return NULL;
+	timer->fireDate = fireDate;
+	timer->callout = callout;
+	timer->info = info;
+
+	_dndTimerPlace(timer, dndTimerCount++);
+	_dndTimerUp(timer->index);
+	return timer;
+}
+
+static void _dndTimerRemove( dndTimerRef timer )
+{
+	CFIndex index = timer->index;
+	dndTimerRef last = dndTimers[--dndTimerCount];
+	if( last != timer )
+	{
+		_dndTimerPlace(last, index);
+		_dndTimerUp(index);
+		_dndTimerDown(last->index);
+	}
+}
+
+void dndEventLoopRemoveTimer( dndTimerRef timer )
+{
+	if( timer == NULL ) return;
+	_dndTimerRemove(timer);
+	free(timer);
+}
+
+// milliseconds until the next timer fires, or -1 to wait for ever
+static int _dndTimerTimeout( void )
+{
+	if( dndTimerCount == 0 ) return -1;
+	CFTimeInterval wait = dndTimers[0]->fireDate - CFAbsoluteTimeGetCurrent();
+	if( wait <= 0.0 ) return 0;
+	if( wait > 3600.0 ) wait = 3600.0;
+	return (int)(wait * 1000.0) + 1;
+}
+
+static void _dndTimersFire( void )
+{
+	CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+	while( (dndTimerCount > 0) && (dndTimers[0]->fireDate <= now) )
+	{
+		// a timer is finished with before it fires, so it may add another
+		dndTimerRef timer = dndTimers[0];
+		dndTimerCallBack callout = timer->callout;
+		void *info = timer->info;
+		_dndTimerRemove(timer);
+		free(timer);
+		callout(info);
+	}
+}
+
+/*
+ *	Sources
+ */
+static void _dndEventSourceReadable( int fd, UInt32 events, void *info )
+{
+	dndEventSource *source = info;
+	UInt8 buffer[64];
+	while( read(fd, buffer, sizeof(buffer)) > 0 ) ;
+	source->perform(source->info);
+}
+
+dndEventSourceRef dndEventSourceCreate( dndTimerCallBack perform, void *info )
+{
+	dndEventSource *source = calloc(1, sizeof(dndEventSource));
+	if( source == NULL ) return NULL;
+	source->perform = perform;
+	source->info = info;
+
+#if defined(__linux__)
+	source->fds[0] = source->fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if( source->fds[0] == -1 )
+	{
+		free(source);
+		return NULL;
+	}
+#else
+	if( pipe(source->fds) != 0 )
+	{
+		free(source);
+		return NULL;
+	}
+	fcntl(source->fds[0], F_SETFL, fcntl(source->fds[0], F_GETFL) | O_NONBLOCK);
+	fcntl(source->fds[1], F_SETFL, fcntl(source->fds[1], F_GETFL) | O_NONBLOCK);
+#endif
+
+	if( !dndEventLoopAdd(source->fds[0], dndEventRead, _dndEventSourceReadable, source) )
+	{
+		close(source->fds[0]);
+		if( source->fds[1] != source->fds[0] ) close(source->fds[1]);
+		free(source);
+		return NULL;
+	}
+	return source;
+}
+
+void dndEventSourceSignal( dndEventSourceRef source )
+{
+	// if this would block the source is already signalled, which is all we need
+	UInt64 one = 1;
+	ssize_t result = write(source->fds[1], &one, (source->fds[1] == source->fds[0]) ? sizeof(UInt64) : 1);
+	(void)result;
+}
+
+void dndEventLoopRun( void )
+{
+	if( !_dndEventLoopInit() ) return;
+
+	while(TRUE)
+	{
+		int timeout = _dndTimerTimeout();
+
+#if defined(__linux__)
+		struct epoll_event events[EVENT_BATCH];
+		int count = epoll_wait(dndEpoll, events, EVENT_BATCH, timeout);
+		if( (count < 0) && (errno != EINTR) ) return;
+
+		for( int i = 0; i < count; i++ )
+		{
+			UInt32 flags = 0;
+			if( events[i].events & EPOLLIN ) flags |= dndEventRead;
+			if( events[i].events & EPOLLOUT ) flags |= dndEventWrite;
+			if( events[i].events & (EPOLLHUP | EPOLLRDHUP) ) flags |= dndEventHangUp;
+			if( events[i].events & EPOLLERR ) flags |= dndEventError;
+			_dndEventDeliver((int)(UInt32)events[i].data.u64, (UInt32)(events[i].data.u64 >> 32), flags);
+		}
+#else
+		// only poll for writing where it's asked for, since it's level-triggered
+		int high = dndWatchHigh;
+		if( high > dndPollCapacity )
+		{
+			void *ptr = realloc(dndPollFds, high * sizeof(struct pollfd));
+			if( ptr == NULL ) return;
+			dndPollFds = ptr;
+			ptr = realloc(dndPollGenerations, high * sizeof(UInt32));
+			if( ptr == NULL ) return;
+			dndPollGenerations = ptr;
+			dndPollCapacity = high;
+		}
+		struct pollfd *pfds = dndPollFds;
+		nfds_t nfds = 0;
+		for( int fd = 0; fd < high; fd++ )
+		{
+			if( dndWatches[fd].callout == NULL ) continue;
+			dndPollGenerations[nfds] = dndWatches[fd].generation;
+			pfds[nfds].fd = fd;
+			pfds[nfds].events = ((dndWatches[fd].events & dndEventRead) ? POLLIN : 0) | ((dndWatches[fd].events & dndEventWrite) ? POLLOUT : 0);
+			pfds[nfds++].revents = 0;
+		}
+
+		int count = poll(pfds, nfds, timeout);
+		if( (count < 0) && (errno != EINTR) ) return;
+
+		for( nfds_t i = 0; (count > 0) && (i < nfds); i++ )
+		{
+			if( pfds[i].revents == 0 ) continue;
+			count--;
+			UInt32 flags = 0;
+			if( pfds[i].revents & POLLIN ) flags |= dndEventRead;
+			if( pfds[i].revents & POLLOUT ) flags |= dndEventWrite;
+			if( pfds[i].revents & POLLHUP ) flags |= dndEventHangUp;
+			if( pfds[i].revents & (POLLERR | POLLNVAL) ) flags |= dndEventError;
+			_dndEventDeliver(pfds[i].fd, dndPollGenerations[i], flags);
+		}
+#endif
+
+		_dndTimersFire();
+	}
+}
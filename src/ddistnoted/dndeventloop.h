@@ -0,0 +1,44 @@
+/*
+ *  dndeventloop.h
+ *  ddistnoted
+ *
+ *	The event loop the socket transport runs on in place of CFRunLoop. It watches
+ *	file descriptors, fires timers and performs sources signalled from other threads,
+ *	all on the one thread which calls dndEventLoopRun(). On Linux it uses epoll with
+ *	edge-triggered readiness, so callouts must read (or write) until they would block;
+ *	elsewhere it falls back to poll(), where doing so is harmless.
+ *
+ *	Apart from dndEventSourceSignal(), these are only to be called on the loop's thread.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+
+enum {
+	dndEventRead = (1 << 0),
+	dndEventWrite = (1 << 1),
+	dndEventHangUp = (1 << 2),	// always reported, whether asked for or not
+	dndEventError = (1 << 3)	// likewise
+};
+
+typedef void (*dndEventCallBack)( int fd, UInt32 events, void *info );
+typedef void (*dndTimerCallBack)( void *info );
+
+typedef struct dndTimer *dndTimerRef;
+typedef struct dndEventSource *dndEventSourceRef;
+
+// start watching fd for events, or change which events are being watched for
+Boolean dndEventLoopAdd( int fd, UInt32 events, dndEventCallBack callout, void *info );
+Boolean dndEventLoopSetEvents( int fd, UInt32 events );
+// stop watching fd. anything still to be reported for it is dropped
+void dndEventLoopRemove( int fd );
+
+// one-shot timers, which are finished with once they've fired or been removed
+dndTimerRef dndEventLoopAddTimer( CFAbsoluteTime fireDate, dndTimerCallBack callout, void *info );
+void dndEventLoopRemoveTimer( dndTimerRef timer );
+
+// a source's perform callout is run on the loop's thread after it's been signalled,
+//	once however many times that happened
+dndEventSourceRef dndEventSourceCreate( dndTimerCallBack perform, void *info );
+void dndEventSourceSignal( dndEventSourceRef source );
+
+void dndEventLoopRun( void );
@@ -0,0 +1,103 @@
+/*
+ *  dndhistogram.c
+ *  ddistnoted
+ *
+ *	Log-linear latency histograms.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <string.h>
+#include <time.h>
+#if defined(__APPLE__)
+#include <mach/mach_time.h>
+#endif
+#include "dndhistogram.h"
+
+/*
+ *	Values below HISTOGRAM_SUB_BUCKETS have a bucket each. Above that, a value whose
+ *	top bit is bit n goes in group n - HISTOGRAM_SUB_BITS + 1, whose buckets are each
+ *	2^(group - 1) wide, and is placed among them by the HISTOGRAM_SUB_BITS bits below
+ *	its top one.
+ */
+static CFIndex _dndHistogramIndex( UInt64 value )
+{
+	if( value < HISTOGRAM_SUB_BUCKETS ) return (CFIndex)value;
+
+	int top = 63 - __builtin_clzll(value);
+	int group = top - HISTOGRAM_SUB_BITS + 1;
+	return ((group - 1) * HISTOGRAM_SUB_BUCKETS) + (CFIndex)(value >> (group - 1));
+}
+
+// the largest value which would be counted in a bucket
+static UInt64 _dndHistogramHighest( CFIndex index )
+{
+	if( index < HISTOGRAM_SUB_BUCKETS ) return (UInt64)index;
+
+	int group = (int)(index / HISTOGRAM_SUB_BUCKETS);
+	UInt64 step = (UInt64)(index % HISTOGRAM_SUB_BUCKETS) + HISTOGRAM_SUB_BUCKETS;
+	return ((step + 1) << (group - 1)) - 1;
+}
+
+void dndHistogramReset( dndHistogram *histogram )
+{
+	memset(histogram, 0, sizeof(dndHistogram));
+	histogram->min = ~0ULL;
+}
+
+void dndHistogramRecord( dndHistogram *histogram, UInt64 value )
+{
+	histogram->buckets[_dndHistogramIndex(value)]++;
+	histogram->count++;
+	histogram->sum += value;
+	if( value < histogram->min ) histogram->min = value;
+	if( value > histogram->max ) histogram->max = value;
+}
+
+void dndHistogramMerge( dndHistogram *into, const dndHistogram *from )
+{
+	for( CFIndex i = 0; i < HISTOGRAM_BUCKETS; i++ )
+		into->buckets[i] += from->buckets[i];
+	into->count += from->count;
+	into->sum += from->sum;
+	if( from->min < into->min ) into->min = from->min;
+	if( from->max > into->max ) into->max = from->max;
+}
+
+UInt64 dndHistogramPercentile( const dndHistogram *histogram, double percentile )
+{
+	if( histogram->count == 0 ) return 0;
+	if( percentile >= 100.0 ) return histogram->max;
+
+	UInt64 rank = (UInt64)((percentile / 100.0) * histogram->count);
+	if( rank >= histogram->count ) rank = histogram->count - 1;
+
+	UInt64 seen = 0;
+	for( CFIndex i = 0; i < HISTOGRAM_BUCKETS; i++ )
+	{
+		seen += histogram->buckets[i];
+		if( seen > rank )
+		{
+			UInt64 value = _dndHistogramHighest(i);
+			return (value > histogram->max) ? histogram->max : value;
+		}
+	}
+	return histogram->max;
+}
+
+double dndHistogramMean( const dndHistogram *histogram )
+{
+	return (histogram->count == 0) ? 0.0 : ((double)histogram->sum / (double)histogram->count);
+}
+
+UInt64 dndNanoseconds( void )
+{
+#if defined(__APPLE__)
+	static mach_timebase_info_data_t timebase = { 0, 0 };
+	if( timebase.denom == 0 ) mach_timebase_info(&timebase);
+	return (mach_absolute_time() * timebase.numer) / timebase.denom;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((UInt64)now.tv_sec * 1000000000ULL) + (UInt64)now.tv_nsec;
+#endif
+}
@@ -0,0 +1,38 @@
+/*
+ *  dndhistogram.h
+ *  ddistnoted
+ *
+ *	Latency histograms. Values, usually nanoseconds, are counted in buckets which
+ *	split each power of two into HISTOGRAM_SUB_BUCKETS equal steps, so anything is
+ *	recorded to within about 3% in a fixed-size table covering every UInt64.
+ *	Recording never allocates and costs a few instructions, so it can be done for
+ *	every message. A histogram isn't thread-safe: give each thread its own and merge
+ *	them when reporting.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#define HISTOGRAM_SUB_BITS		5
+#define HISTOGRAM_SUB_BUCKETS	(1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS		((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct dndHistogram {
+	UInt64 count;
+	UInt64 min;
+	UInt64 max;
+	UInt64 sum;
+	UInt64 buckets[HISTOGRAM_BUCKETS];
+} dndHistogram;
+
+void dndHistogramReset( dndHistogram *histogram );
+void dndHistogramRecord( dndHistogram *histogram, UInt64 value );
+void dndHistogramMerge( dndHistogram *into, const dndHistogram *from );
+
+// the value below which the given percentage (0 to 100) of those recorded fall,
+//	to the resolution of the buckets, or 0 if nothing has been recorded
+UInt64 dndHistogramPercentile( const dndHistogram *histogram, double percentile );
+double dndHistogramMean( const dndHistogram *histogram );
+
+// the monotonic clock latencies are measured with, in nanoseconds. it's the same
+//	clock for every process on the machine, so stamps can be compared between them
+UInt64 dndNanoseconds( void );
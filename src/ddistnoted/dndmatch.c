@@ -0,0 +1,130 @@
+/*
+ *  dndmatch.c
+ *  ddistnoted
+ *
+ *	Record matching kernels: scalar, SSE2 and AVX2.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "dndmatch.h"
+
+// the records after the first whole vectors, and any processor without them
+static UInt64 _dndMatchScalar( const CFHashCode *names, const CFHashCode *objects, const long *sessions, CFIndex count,
+							   CFHashCode name, CFHashCode object, long session, Boolean anySession )
+{
+	UInt64 bits = 0;
+	for( CFIndex i = 0; i < count; i++ )
+	{
+		// no branches, so the compiler is free to do this a few at a time itself
+		UInt64 hit = ((names[i] == 0) | (names[i] == name)) & ((objects[i] == 0) | (objects[i] == object))
+			& (anySession | (sessions[i] == session));
+		bits |= hit << i;
+	}
+	return bits;
+}
+
+static Boolean _dndMatchAlways( void )
+{
+	return TRUE;
+}
+
+#if defined(__x86_64__)
+
+// SSE2 has no 64 bit compare, so both halves of each 32 bit one have to agree
+static inline __m128i _dndMatchEqual64( __m128i a, __m128i b )
+{
+	__m128i equal = _mm_cmpeq_epi32(a, b);
+	return _mm_and_si128(equal, _mm_shuffle_epi32(equal, _MM_SHUFFLE(2, 3, 0, 1)));
+}
+
+// two records at a time. SSE2 is part of x86_64, so this can always be run
+static UInt64 _dndMatchSSE2( const CFHashCode *names, const CFHashCode *objects, const long *sessions, CFIndex count,
+							 CFHashCode name, CFHashCode object, long session, Boolean anySession )
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i n = _mm_set1_epi64x((long long)name);
+	const __m128i o = _mm_set1_epi64x((long long)object);
+	const __m128i s = _mm_set1_epi64x((long long)session);
+	const __m128i any = anySession ? _mm_set1_epi32(-1) : zero;
+	UInt64 bits = 0;
+	CFIndex i = 0;
+
+	for( ; i + 2 <= count; i += 2 )
+	{
+		__m128i x = _mm_loadu_si128((const __m128i *)(names + i));
+		__m128i y = _mm_loadu_si128((const __m128i *)(objects + i));
+		__m128i z = _mm_loadu_si128((const __m128i *)(sessions + i));
+		__m128i hit = _mm_and_si128(_mm_or_si128(_dndMatchEqual64(x, zero), _dndMatchEqual64(x, n)),
+									_mm_or_si128(_dndMatchEqual64(y, zero), _dndMatchEqual64(y, o)));
+		hit = _mm_and_si128(hit, _mm_or_si128(any, _dndMatchEqual64(z, s)));
+		bits |= (UInt64)_mm_movemask_pd(_mm_castsi128_pd(hit)) << i;
+	}
+
+	if( i < count )
+		bits |= _dndMatchScalar(names + i, objects + i, sessions + i, count - i, name, object, session, anySession) << i;
+	return bits;
+}
+
+// four records at a time, on processors (and systems) which support AVX2
+__attribute__((target("avx2")))
+static UInt64 _dndMatchAVX2( const CFHashCode *names, const CFHashCode *objects, const long *sessions, CFIndex count,
+							 CFHashCode name, CFHashCode object, long session, Boolean anySession )
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i n = _mm256_set1_epi64x((long long)name);
+	const __m256i o = _mm256_set1_epi64x((long long)object);
+	const __m256i s = _mm256_set1_epi64x((long long)session);
+	const __m256i any = anySession ? _mm256_set1_epi32(-1) : zero;
+	UInt64 bits = 0;
+	CFIndex i = 0;
+
+	for( ; i + 4 <= count; i += 4 )
+	{
+		__m256i x = _mm256_loadu_si256((const __m256i *)(names + i));
+		__m256i y = _mm256_loadu_si256((const __m256i *)(objects + i));
+		__m256i z = _mm256_loadu_si256((const __m256i *)(sessions + i));
+		__m256i hit = _mm256_and_si256(_mm256_or_si256(_mm256_cmpeq_epi64(x, zero), _mm256_cmpeq_epi64(x, n)),
+									   _mm256_or_si256(_mm256_cmpeq_epi64(y, zero), _mm256_cmpeq_epi64(y, o)));
+		hit = _mm256_and_si256(hit, _mm256_or_si256(any, _mm256_cmpeq_epi64(z, s)));
+		bits |= (UInt64)_mm256_movemask_pd(_mm256_castsi256_pd(hit)) << i;
+	}
+
+	if( i < count )
+		bits |= _dndMatchScalar(names + i, objects + i, sessions + i, count - i, name, object, session, anySession) << i;
+	return bits;
+}
+
+static Boolean _dndMatchHasAVX2( void )
+{
+	// also checks the system saves the wider registers
+	return __builtin_cpu_supports("avx2") ? TRUE : FALSE;
+}
+
+const dndMatchKernel dndMatchKernelSSE2 = { "sse2", _dndMatchAlways, _dndMatchSSE2 };
+const dndMatchKernel dndMatchKernelAVX2 = { "avx2", _dndMatchHasAVX2, _dndMatchAVX2 };
+
+#else
+
+static Boolean _dndMatchNever( void )
+{
+	return FALSE;
+}
+
+const dndMatchKernel dndMatchKernelSSE2 = { "sse2", _dndMatchNever, _dndMatchScalar };
+const dndMatchKernel dndMatchKernelAVX2 = { "avx2", _dndMatchNever, _dndMatchScalar };
+
+#endif
+
+const dndMatchKernel dndMatchKernelScalar = { "scalar", _dndMatchAlways, _dndMatchScalar };
+
+const dndMatchKernel *dndMatchKernelNamed( const char *name )
+{
+	const dndMatchKernel *kernels[] = { &dndMatchKernelScalar, &dndMatchKernelSSE2, &dndMatchKernelAVX2 };
+	for( size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++ )
+		if( (strcmp(name, kernels[i]->name) == 0) && kernels[i]->available() ) return kernels[i];
+	return NULL;
+}
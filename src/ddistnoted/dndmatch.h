@@ -0,0 +1,38 @@
+/*
+ *  dndmatch.h
+ *  ddistnoted
+ *
+ *	Kernels which test a block of notification records against a posted
+ *	notification. The records are the parallel arrays of name hashes, object hashes
+ *	and sessions the daemon keeps. A record matches when its name is 0 or the
+ *	notification's, its object is 0 or the notification's, and its session is the
+ *	notification's, unless any session will do. The kernels compare several records
+ *	per instruction where the processor allows, and return a bit for each record in
+ *	the block which matched. They're for scanning a table outright when walking its
+ *	chains would visit much of it anyway, as happens when most records are wildcards.
+ *
+ *	A scalar kernel runs everywhere. On x86_64 there are SSE2 and AVX2 ones as well,
+ *	which dndMatchKernelNamed() only returns if the processor can run them.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+
+// the most records a kernel looks at in one call, one for each bit of its result
+#define MATCH_BLOCK		64
+
+typedef struct dndMatchKernel {
+	const char *name;
+	Boolean (*available)( void );
+	// bit i of the result is set if record i, of the count (up to MATCH_BLOCK) from
+	//	the start of the arrays, matches
+	UInt64 (*block)( const CFHashCode *names, const CFHashCode *objects, const long *sessions, CFIndex count,
+					 CFHashCode name, CFHashCode object, long session, Boolean anySession );
+} dndMatchKernel;
+
+extern const dndMatchKernel dndMatchKernelScalar;
+extern const dndMatchKernel dndMatchKernelSSE2;
+extern const dndMatchKernel dndMatchKernelAVX2;
+
+// look up a kernel by name ("scalar", "sse2" or "avx2"), returning NULL for anything
+//	else or one this processor can't run
+const dndMatchKernel *dndMatchKernelNamed( const char *name );
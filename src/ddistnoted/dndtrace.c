@@ -0,0 +1,211 @@
+/*
+ *  dndtrace.c
+ *  ddistnoted
+ *
+ *	Per-thread rings of trace events.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "dndtrace.h"
+#include "dndhistogram.h"
+
+/*
+ *	Only the owning thread writes to a ring. It fills in the slot for an event and
+ *	then moves head on, so a reader copying the ring knows every event before head
+ *	was complete when it looked. While it copies, the writer may be overwriting the
+ *	oldest events, so it checks head again afterwards and ignores any slot the
+ *	writer could have reached in the meantime. Rings are never freed, the daemon's
+ *	threads all living as long as it does.
+ */
+typedef struct dndTraceRing {
+	struct dndTraceRing *next;
+	dndTraceEvent *events;
+	volatile UInt64 head;	// events ever recorded
+	UInt16 thread;
+} dndTraceRing;
+
+CFIndex dndTraceSize = 0;
+static UInt64 dndTraceMask = 0;
+static dndTraceRing * volatile dndTraceRings = NULL;
+static volatile SInt32 dndTraceThreads = 0;
+static __thread dndTraceRing *dndTraceMine = NULL;
+
+void dndTraceInit( CFIndex events )
+{
+	CFIndex size = 0;
+	if( events > 0 )
+		for( size = 1; size < events; size *= 2 ) ;
+	dndTraceSize = size;
+	dndTraceMask = (size > 0) ? (UInt64)(size - 1) : 0;
+}
+
+// the calling thread's ring, made the first time it records anything
+static dndTraceRing *_dndTraceRing( void )
+{
+	dndTraceRing *ring = malloc(sizeof(dndTraceRing));
+	if( ring == NULL ) return NULL;
+	ring->events = calloc(dndTraceSize, sizeof(dndTraceEvent));
+	if( ring->events == NULL )
+	{
+		free(ring);
+		return NULL;
+	}
+	ring->head = 0;
+	ring->thread = (UInt16)__sync_add_and_fetch(&dndTraceThreads, 1);
+
+	do ring->next = dndTraceRings;
+	while( !__sync_bool_compare_and_swap(&dndTraceRings, ring->next, ring) );
+	return ring;
+}
+
+void dndTraceRecord( UInt16 event, UInt32 value, UInt64 hash )
+{
+	dndTraceRing *ring = dndTraceMine;
+	if( ring == NULL )
+	{
+		ring = dndTraceMine = _dndTraceRing();
+		if( ring == NULL ) return;
+	}
+
+	UInt64 head = ring->head;
+	dndTraceEvent *slot = ring->events + (head & dndTraceMask);
+	slot->time = dndNanoseconds();
+	slot->hash = hash;
+	slot->value = value;
+	slot->event = event;
+	slot->thread = ring->thread;
+	__sync_synchronize();
+	ring->head = head + 1;
+}
+
+static int _dndTraceCompare( const void *a, const void *b )
+{
+	UInt64 x = ((const dndTraceEvent *)a)->time, y = ((const dndTraceEvent *)b)->time;
+	return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+CFDataRef dndTraceCopy( CFIndex limit )
+{
+	dndTraceHeader header = { TRACE_MAGIC, sizeof(dndTraceEvent), dndNanoseconds(), 0 };
+
+	// rings are only ever pushed onto the front of the list, so the rest of it won't change
+	dndTraceRing *first = dndTraceRings;
+	CFIndex rings = 0;
+	for( dndTraceRing *ring = first; ring != NULL; ring = ring->next ) rings++;
+
+	dndTraceEvent *events = NULL;
+	if( rings != 0 )
+	{
+		events = malloc(rings * dndTraceSize * sizeof(dndTraceEvent));
+		if( events == NULL ) return NULL;
+	}
+
+	CFIndex count = 0;
+	for( dndTraceRing *ring = first; ring != NULL; ring = ring->next )
+	{
+		UInt64 before = ring->head;
+		__sync_synchronize();
+		UInt64 start = (before > (UInt64)dndTraceSize) ? (before - dndTraceSize) : 0;
+		for( UInt64 i = start; i < before; i++ )
+			events[count + (i - start)] = ring->events[i & dndTraceMask];
+		__sync_synchronize();
+
+		// the writer may since have overwritten up to the slot of its current head
+		UInt64 after = ring->head;
+		UInt64 oldest = (after + 1 > (UInt64)dndTraceSize) ? (after + 1 - dndTraceSize) : 0;
+		if( oldest < start ) oldest = start;
+		if( oldest >= before ) continue;
+		if( oldest > start )
+			memmove(events + count, events + count + (oldest - start), (before - oldest) * sizeof(dndTraceEvent));
+		count += before - oldest;
+	}
+
+	qsort(events, count, sizeof(dndTraceEvent), _dndTraceCompare);
+	CFIndex skip = ((limit > 0) && (count > limit)) ? (count - limit) : 0;
+	header.count = count - skip;
+
+	CFMutableDataRef data = CFDataCreateMutable( kCFAllocatorDefault, 0 );
+	if( data != NULL )
+	{
+		CFDataAppendBytes( data, (const UInt8 *)&header, sizeof(dndTraceHeader) );
+		if( header.count != 0 ) CFDataAppendBytes( data, (const UInt8 *)(events + skip), header.count * sizeof(dndTraceEvent) );
+	}
+	free(events);
+	return data;
+}
+
+/*
+ *	The daemon runs as root, and path may well be somewhere anyone can write, so the
+ *	trace goes into a new file of its own, named for the process and the dump, which
+ *	open() won't create if anything is there already (a symlink included). Only
+ *	once it's complete is it renamed over path, which replaces whatever is at path
+ *	rather than following it.
+ */
+Boolean dndTraceWrite( const char *path )
+{
+	static volatile SInt32 dumps = 0;
+	char temp[PATH_MAX];
+	if( snprintf(temp, sizeof(temp), "%s.%ld.%ld", path, (long)getpid(), (long)__sync_add_and_fetch(&dumps, 1)) >= sizeof(temp) )
+		return FALSE;
+
+	CFDataRef data = dndTraceCopy(0);
+	if( data == NULL ) return FALSE;
+
+	int fd = open(temp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+	FILE *file = (fd < 0) ? NULL : fdopen(fd, "w");
+	if( (file == NULL) && (fd >= 0) ) close(fd);
+	Boolean ok = (file != NULL) && (fwrite(CFDataGetBytePtr(data), CFDataGetLength(data), 1, file) == 1);
+	if( file != NULL ) ok = (fclose(file) == 0) && ok;
+	CFRelease(data);
+
+	if( ok ) ok = (rename(temp, path) == 0);
+	if( !ok && (fd >= 0) ) unlink(temp);
+	return ok;
+}
+
+/*
+ *	The signal is blocked, and taken by a thread of its own with sigwait(), so that
+ *	the copy is made outside of any signal handler.
+ */
+typedef struct dndTraceSignal {
+	sigset_t set;
+	const char *path;
+} dndTraceSignal;
+
+static void *_dndTraceSignalThread( void *arg )
+{
+	dndTraceSignal *info = arg;
+	int sig;
+
+	while( sigwait(&info->set, &sig) == 0 )
+		if( !dndTraceWrite(info->path) ) fprintf(stderr, "Couldn't write trace to %s\n", info->path);
+	return NULL;
+}
+
+Boolean dndTraceWriteOnSignal( int sig, const char *path )
+{
+	dndTraceSignal *info = malloc(sizeof(dndTraceSignal));
+	if( info == NULL ) return FALSE;
+	sigemptyset(&info->set);
+	sigaddset(&info->set, sig);
+	info->path = path;
+
+	pthread_t thread;
+	pthread_sigmask(SIG_BLOCK, &info->set, NULL);
+	if( pthread_create(&thread, NULL, _dndTraceSignalThread, info) != 0 )
+	{
+		pthread_sigmask(SIG_UNBLOCK, &info->set, NULL);
+		free(info);
+		return FALSE;
+	}
+	pthread_detach(thread);
+	return TRUE;
+}
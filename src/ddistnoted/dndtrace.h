@@ -0,0 +1,61 @@
+/*
+ *  dndtrace.h
+ *  ddistnoted
+ *
+ *	A flight recorder for the daemon. Each thread records fixed-size binary events
+ *	into a ring of its own, so recording takes no locks and no atomic operations and
+ *	costs about as much as reading the clock. The rings only ever hold the most
+ *	recent events. They can be copied out at any time, from any thread, merged into
+ *	one list in time order, and turned back into text by dnottrace.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+
+enum {
+	TRACE_RECEIVED = 1,	// a message arrived: value is its msgid, hash its length
+	TRACE_MATCHED,		// a notification was matched: value is the clients found, hash its name
+	TRACE_QUEUED,		// a notification was queued for a client: value is the queue's length, hash the client's uid
+	TRACE_HELD,			// ...or held for it while suspended: value is the number held
+	TRACE_DROPPED,		// ...or discarded because its queue was full: value is the queue's length
+	TRACE_SENT,			// a message was sent to a client: value is the notifications in it
+	TRACE_SEND_FAILED,	// ...or couldn't be: value is the dndEndpoint error
+	TRACE_DISCONNECTED,	// a client was disconnected
+	TRACE_PARKED,		// a client's circuit breaker tripped, or a probe failed: value is the backoff in milliseconds
+	TRACE_RECOVERED		// ...or a probe got through: value is the notifications which had been waiting
+};
+
+typedef struct dndTraceEvent {
+	UInt64 time;		// dndNanoseconds()
+	UInt64 hash;
+	UInt32 value;
+	UInt16 event;
+	UInt16 thread;		// numbered from 1 in the order threads first recorded something
+} dndTraceEvent;
+
+// a copy of the rings starts with this, followed by count dndTraceEvents, oldest first
+#define TRACE_MAGIC	0x646E6474	// 'dndt'
+typedef struct dndTraceHeader {
+	UInt32 magic;
+	UInt32 eventSize;	// sizeof(dndTraceEvent)
+	UInt64 time;		// dndNanoseconds() when the copy was made
+	CFIndex count;
+} dndTraceHeader;
+
+// the number of events each thread's ring holds, 0 when tracing is off
+extern CFIndex dndTraceSize;
+
+// set the size of the rings, rounded up to a power of two, before anything is recorded
+void dndTraceInit( CFIndex events );
+void dndTraceRecord( UInt16 event, UInt32 value, UInt64 hash );
+
+static inline void dndTrace( UInt16 event, UInt32 value, UInt64 hash )
+{
+	if( dndTraceSize != 0 ) dndTraceRecord(event, value, hash);
+}
+
+// the most recent limit events from every thread (all of them if limit is 0), as above
+CFDataRef dndTraceCopy( CFIndex limit );
+// write everything to a new file, then rename it over path, replacing whatever is there
+Boolean dndTraceWrite( const char *path );
+// write everything to path whenever the process gets sig. call before starting any threads
+Boolean dndTraceWriteOnSignal( int sig, const char *path );
@@ -0,0 +1,91 @@
+/*
+ *  dndtransport.c
+ *  ddistnoted
+ *
+ *	Transport-independent handling of endpoints.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <string.h>
+#include "dndtransport.h"
+
+const dndTransport *dndTransportDefault( void )
+{
+#if defined(__APPLE__)
+	return &dndTransportMessagePort;
+#else
+	return &dndTransportSocket;
+#endif
+}
+
+const dndTransport *dndTransportNamed( const char *name )
+{
+	if( strcmp(name, dndTransportMessagePort.name) == 0 ) return &dndTransportMessagePort;
+	if( strcmp(name, dndTransportSocket.name) == 0 ) return &dndTransportSocket;
+	return NULL;
+}
+
+dndEndpointRef dndEndpointCreateLocal( const dndTransport *transport, CFStringRef name, dndEndpointCallBack callout, void *info )
+{
+	dndEndpointRef endpoint = transport->createLocal(name, callout, info);
+	if( endpoint == NULL ) return NULL;
+	endpoint->transport = transport;
+	endpoint->retainCount = 1;
+	return endpoint;
+}
+
+dndEndpointRef dndEndpointCreateRemote( const dndTransport *transport, CFStringRef name )
+{
+	dndEndpointRef endpoint = transport->createRemote(name);
+	if( endpoint == NULL ) return NULL;
+	endpoint->transport = transport;
+	endpoint->retainCount = 1;
+	return endpoint;
+}
+
+SInt32 dndEndpointSendRequest( dndEndpointRef remote, SInt32 msgid, CFDataRef data, CFTimeInterval sendTimeout, CFTimeInterval rcvTimeout, CFDataRef *reply )
+{
+	if( reply != NULL ) *reply = NULL;
+	return remote->transport->sendRequest(remote, msgid, data, sendTimeout, rcvTimeout, reply);
+}
+
+Boolean dndEndpointIsValid( dndEndpointRef endpoint )
+{
+	return endpoint->transport->isValid(endpoint);
+}
+
+void dndEndpointSetInvalidationCallBack( dndEndpointRef remote, dndEndpointInvalidationCallBack callout )
+{
+	remote->transport->setInvalidationCallBack(remote, callout);
+}
+
+dndSourceRef dndSourceCreate( const dndTransport *transport, dndSourceCallBack perform, void *info )
+{
+	return transport->createSource(perform, info);
+}
+
+void dndSourceSignal( const dndTransport *transport, dndSourceRef source )
+{
+	transport->signalSource(source);
+}
+
+void dndTransportRun( const dndTransport *transport )
+{
+	transport->run();
+}
+
+/*
+ *	Endpoints are retained and released from both the main thread and the daemon's
+ *	dispatch threads, so the count is kept with atomic operations.
+ */
+dndEndpointRef dndEndpointRetain( dndEndpointRef endpoint )
+{
+	__sync_fetch_and_add(&endpoint->retainCount, 1);
+	return endpoint;
+}
+
+void dndEndpointRelease( dndEndpointRef endpoint )
+{
+	if( __sync_sub_and_fetch(&endpoint->retainCount, 1) == 0 )
+		endpoint->transport->destroy(endpoint);
+}
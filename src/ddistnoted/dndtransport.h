@@ -0,0 +1,81 @@
+/*
+ *  dndtransport.h
+ *  ddistnoted
+ *
+ *	The messaging used between ddistnoted and its clients. An endpoint is either
+ *	a local one, created under a name and receiving messages on the main thread,
+ *	or a remote one, connected to somebody else's local endpoint by name and used
+ *	to send to it. Two transports are provided: CFMessagePort, using Mach bootstrap
+ *	names, and Unix domain SOCK_SEQPACKET sockets, named by paths under
+ *	$DDISTNOTED_SOCKET_DIR (or /tmp), which work where Mach ports don't.
+ *
+ *	Each transport brings its own event loop, which the process runs on its main
+ *	thread with dndTransportRun(): CFRunLoop for CFMessagePort and the dndEventLoop
+ *	for sockets. Sources let other threads wake the main one on either.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+
+// results of dndEndpointSendRequest(), which have the same values as CFMessagePort's
+enum {
+	dndEndpointSuccess = 0,
+	dndEndpointSendTimeout = -1,
+	dndEndpointReceiveTimeout = -2,
+	dndEndpointIsInvalid = -3,
+	dndEndpointTransportError = -4,
+	dndEndpointBecameInvalidError = -5
+};
+
+typedef struct __dndEndpoint *dndEndpointRef;
+typedef struct __dndSource *dndSourceRef;
+
+typedef CFDataRef (*dndEndpointCallBack)( dndEndpointRef local, SInt32 msgid, CFDataRef data, void *info );
+typedef void (*dndEndpointInvalidationCallBack)( dndEndpointRef remote );
+typedef void (*dndSourceCallBack)( void *info );
+
+// what each transport provides. endpoints are created with a retain count of one
+//	and destroy() is called when it drops to zero, from whichever thread that happens on
+typedef struct dndTransport {
+	const char *name;
+	dndEndpointRef (*createLocal)( CFStringRef name, dndEndpointCallBack callout, void *info );
+	dndEndpointRef (*createRemote)( CFStringRef name );
+	SInt32 (*sendRequest)( dndEndpointRef remote, SInt32 msgid, CFDataRef data, CFTimeInterval sendTimeout, CFTimeInterval rcvTimeout, CFDataRef *reply );
+	Boolean (*isValid)( dndEndpointRef endpoint );
+	void (*setInvalidationCallBack)( dndEndpointRef remote, dndEndpointInvalidationCallBack callout );
+	void (*destroy)( dndEndpointRef endpoint );
+	dndSourceRef (*createSource)( dndSourceCallBack perform, void *info );
+	void (*signalSource)( dndSourceRef source );
+	void (*run)( void );
+} dndTransport;
+
+// every transport's endpoints start with this
+struct __dndEndpoint {
+	const dndTransport *transport;
+	volatile CFIndex retainCount;
+};
+
+extern const dndTransport dndTransportMessagePort;
+extern const dndTransport dndTransportSocket;
+
+// the transport used unless asked otherwise, which is CFMessagePort on Darwin
+const dndTransport *dndTransportDefault( void );
+// look up a transport by name ("cf" or "socket"), returning NULL for anything else
+const dndTransport *dndTransportNamed( const char *name );
+
+dndEndpointRef dndEndpointCreateLocal( const dndTransport *transport, CFStringRef name, dndEndpointCallBack callout, void *info );
+dndEndpointRef dndEndpointCreateRemote( const dndTransport *transport, CFStringRef name );
+SInt32 dndEndpointSendRequest( dndEndpointRef remote, SInt32 msgid, CFDataRef data, CFTimeInterval sendTimeout, CFTimeInterval rcvTimeout, CFDataRef *reply );
+Boolean dndEndpointIsValid( dndEndpointRef endpoint );
+// called, on the main thread, when the other end of a remote endpoint goes away. the
+//	callout must be cleared, on the main thread, before the endpoint's last release
+void dndEndpointSetInvalidationCallBack( dndEndpointRef remote, dndEndpointInvalidationCallBack callout );
+dndEndpointRef dndEndpointRetain( dndEndpointRef endpoint );
+void dndEndpointRelease( dndEndpointRef endpoint );
+
+// a source's perform callout is run on the main thread some time after it's been
+//	signalled, which can be done from any thread
+dndSourceRef dndSourceCreate( const dndTransport *transport, dndSourceCallBack perform, void *info );
+void dndSourceSignal( const dndTransport *transport, dndSourceRef source );
+
+// run the transport's event loop on the main thread, for ever
+void dndTransportRun( const dndTransport *transport );
@@ -0,0 +1,176 @@
+/*
+ *  dndtransport_cf.c
+ *  ddistnoted
+ *
+ *	The CFMessagePort transport, in which endpoints are named Mach ports
+ *	registered with the bootstrap server.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include "dndtransport.h"
+
+typedef struct dndMessagePortEndpoint {
+	struct __dndEndpoint base;
+	CFMessagePortRef port;
+	dndEndpointCallBack callout;
+	void *info;
+	dndEndpointInvalidationCallBack invalidation;
+} dndMessagePortEndpoint;
+
+/*
+ *	CFMessagePort hands its invalidation callback the port, so we keep a map from
+ *	ports being watched to the endpoint watching them. CFMessagePortCreateRemote()
+ *	returns the same port each time it's asked for one name, so the most recent
+ *	endpoint to ask to be told about a port is the one which is.
+ */
+static pthread_mutex_t dndWatchedLock = PTHREAD_MUTEX_INITIALIZER;
+static CFMutableDictionaryRef dndWatched = NULL;
+
+static CFDataRef _dndMessagePortReceived( CFMessagePortRef local, SInt32 msgid, CFDataRef data, void *info )
+{
+	dndMessagePortEndpoint *endpoint = info;
+	return endpoint->callout((dndEndpointRef)endpoint, msgid, data, endpoint->info);
+}
+
+static void _dndMessagePortInvalidated( CFMessagePortRef port, void *info )
+{
+	pthread_mutex_lock(&dndWatchedLock);
+	dndMessagePortEndpoint *endpoint = (dndMessagePortEndpoint *)CFDictionaryGetValue(dndWatched, port);
+	dndEndpointInvalidationCallBack callout = (endpoint != NULL) ? endpoint->invalidation : NULL;
+	pthread_mutex_unlock(&dndWatchedLock);
+
+	if( callout != NULL ) callout((dndEndpointRef)endpoint);
+}
+
+static dndEndpointRef _dndMessagePortCreateLocal( CFStringRef name, dndEndpointCallBack callout, void *info )
+{
+	dndMessagePortEndpoint *endpoint = calloc(1, sizeof(dndMessagePortEndpoint));
+	if( endpoint == NULL ) return NULL;
+	endpoint->callout = callout;
+	endpoint->info = info;
+
+	CFMessagePortContext context = { 0, endpoint, NULL, NULL, NULL };
+	endpoint->port = CFMessagePortCreateLocal( kCFAllocatorDefault, name, _dndMessagePortReceived, &context, NULL );
+	if( endpoint->port == NULL )
+	{
+		free(endpoint);
+		return NULL;
+	}
+
+	CFRunLoopSourceRef rls = CFMessagePortCreateRunLoopSource( kCFAllocatorDefault, endpoint->port, 0 );
+	if( rls == NULL )
+	{
+		CFMessagePortInvalidate(endpoint->port);
+		CFRelease(endpoint->port);
+		free(endpoint);
+		return NULL;
+	}
+	CFRunLoopAddSource( CFRunLoopGetMain(), rls, kCFRunLoopCommonModes );
+	CFRelease(rls);
+
+	return (dndEndpointRef)endpoint;
+}
+
+static dndEndpointRef _dndMessagePortCreateRemote( CFStringRef name )
+{
+	CFMessagePortRef port = CFMessagePortCreateRemote( kCFAllocatorDefault, name );
+	if( port == NULL ) return NULL;
+
+	dndMessagePortEndpoint *endpoint = calloc(1, sizeof(dndMessagePortEndpoint));
+	if( endpoint == NULL )
+	{
+		CFRelease(port);
+		return NULL;
+	}
+	endpoint->port = port;
+	return (dndEndpointRef)endpoint;
+}
+
+static SInt32 _dndMessagePortSendRequest( dndEndpointRef remote, SInt32 msgid, CFDataRef data, CFTimeInterval sendTimeout, CFTimeInterval rcvTimeout, CFDataRef *reply )
+{
+	dndMessagePortEndpoint *endpoint = (dndMessagePortEndpoint *)remote;
+	return CFMessagePortSendRequest( endpoint->port, msgid, data, sendTimeout, rcvTimeout, (reply != NULL) ? kCFRunLoopDefaultMode : NULL, reply );
+}
+
+static Boolean _dndMessagePortIsValid( dndEndpointRef endpoint )
+{
+	return CFMessagePortIsValid(((dndMessagePortEndpoint *)endpoint)->port);
+}
+
+static void _dndMessagePortSetInvalidationCallBack( dndEndpointRef remote, dndEndpointInvalidationCallBack callout )
+{
+	dndMessagePortEndpoint *endpoint = (dndMessagePortEndpoint *)remote;
+
+	pthread_mutex_lock(&dndWatchedLock);
+	if( dndWatched == NULL )
+		dndWatched = CFDictionaryCreateMutable( kCFAllocatorDefault, 0, NULL, NULL );
+	endpoint->invalidation = callout;
+	if( callout != NULL )
+		CFDictionarySetValue(dndWatched, endpoint->port, endpoint);
+	else if( CFDictionaryGetValue(dndWatched, endpoint->port) == endpoint )
+		CFDictionaryRemoveValue(dndWatched, endpoint->port);
+	pthread_mutex_unlock(&dndWatchedLock);
+
+	// this calls back straight away if the port has already gone
+	if( callout != NULL ) CFMessagePortSetInvalidationCallBack(endpoint->port, _dndMessagePortInvalidated);
+}
+
+static void _dndMessagePortDestroy( dndEndpointRef endpoint )
+{
+	dndMessagePortEndpoint *mpe = (dndMessagePortEndpoint *)endpoint;
+
+	pthread_mutex_lock(&dndWatchedLock);
+	if( (dndWatched != NULL) && (CFDictionaryGetValue(dndWatched, mpe->port) == mpe) )
+		CFDictionaryRemoveValue(dndWatched, mpe->port);
+	pthread_mutex_unlock(&dndWatchedLock);
+
+	if( mpe->callout != NULL ) CFMessagePortInvalidate(mpe->port);
+	CFRelease(mpe->port);
+	free(mpe);
+}
+
+static void _dndMessagePortPerform( void *info )
+{
+	// info holds the callout the source was created with, then its info
+	void **pair = info;
+	((dndSourceCallBack)pair[0])(pair[1]);
+}
+
+static dndSourceRef _dndMessagePortCreateSource( dndSourceCallBack perform, void *info )
+{
+	void **pair = malloc(2 * sizeof(void *));
+	if( pair == NULL ) return NULL;
+	pair[0] = (void *)perform;
+	pair[1] = info;
+
+	CFRunLoopSourceContext context = { 0, pair, NULL, NULL, NULL, NULL, NULL, NULL, NULL, _dndMessagePortPerform };
+	CFRunLoopSourceRef source = CFRunLoopSourceCreate( kCFAllocatorDefault, 0, &context );
+	if( source == NULL )
+	{
+		free(pair);
+		return NULL;
+	}
+	CFRunLoopAddSource( CFRunLoopGetMain(), source, kCFRunLoopCommonModes );
+	return (dndSourceRef)source;
+}
+
+static void _dndMessagePortSignalSource( dndSourceRef source )
+{
+	CFRunLoopSourceSignal((CFRunLoopSourceRef)source);
+	CFRunLoopWakeUp(CFRunLoopGetMain());
+}
+
+const dndTransport dndTransportMessagePort = {
+	"cf",
+	_dndMessagePortCreateLocal,
+	_dndMessagePortCreateRemote,
+	_dndMessagePortSendRequest,
+	_dndMessagePortIsValid,
+	_dndMessagePortSetInvalidationCallBack,
+	_dndMessagePortDestroy,
+	_dndMessagePortCreateSource,
+	_dndMessagePortSignalSource,
+	CFRunLoopRun
+};
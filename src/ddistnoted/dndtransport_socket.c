@@ -0,0 +1,504 @@
+/*
+ *  dndtransport_socket.c
+ *  ddistnoted
+ *
+ *	The Unix domain socket transport. A local endpoint listens on a SOCK_SEQPACKET
+ *	socket at $DDISTNOTED_SOCKET_DIR/<name>.sock and a remote endpoint is a connection
+ *	to one. Each message is a dndSocketHeader followed by the message's data; when
+ *	the sender asks for one, the reply comes back the same way on the same connection.
+ *
+ *	Sockets are watched by the dndEventLoop, which this transport runs in place of
+ *	CFRunLoop: the local endpoint's listening socket and the connections it accepts,
+ *	and a remote endpoint's connection when somebody wants to know about it closing.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "dndtransport.h"
+#include "dndeventloop.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL	0
+#endif
+
+typedef struct dndSocketHeader {
+	SInt32 msgid;
+	SInt32 flags;
+} dndSocketHeader;
+
+#define SOCKET_REPLY	(1 << 0)	// the sender is waiting for a reply
+
+typedef struct dndSocketEndpoint {
+	struct __dndEndpoint base;
+	int fd;
+	Boolean watched;		// TRUE while fd is on the event loop
+	pthread_mutex_t lock;	// held by a remote endpoint's sender until it has its reply
+	volatile Boolean valid;
+	dndEndpointCallBack callout;
+	void *info;
+	dndEndpointInvalidationCallBack invalidation;
+	struct sockaddr_un address;
+} dndSocketEndpoint;
+
+/*
+ *	Work out the path of the socket for the endpoint with this name.
+ */
+static Boolean _dndSocketAddress( CFStringRef name, struct sockaddr_un *address )
+{
+	char chars[sizeof(address->sun_path)];
+	if( !CFStringGetCString(name, chars, sizeof(chars), kCFStringEncodingASCII) ) return FALSE;
+
+	const char *dir = getenv("DDISTNOTED_SOCKET_DIR");
+	if( (dir == NULL) || (*dir == '\0') ) dir = "/tmp";
+
+	memset(address, 0, sizeof(struct sockaddr_un));
+	address->sun_family = AF_UNIX;
+	int length = snprintf(address->sun_path, sizeof(address->sun_path), "%s/%s.sock", dir, chars);
+	return (length > 0) && (length < sizeof(address->sun_path));
+}
+
+/*
+ *	Wait until fd is ready for events or the deadline passes.
+ */
+static Boolean _dndSocketWait( int fd, short events, CFAbsoluteTime deadline )
+{
+	struct pollfd pfd = { fd, events, 0 };
+	while(TRUE)
+	{
+		CFTimeInterval remaining = deadline - CFAbsoluteTimeGetCurrent();
+		if( remaining < 0.0 ) remaining = 0.0;
+		int result = poll(&pfd, 1, (int)(remaining * 1000.0));
+		if( result > 0 ) return TRUE;
+		if( (result == 0) || (errno != EINTR) ) return FALSE;
+	}
+}
+
+/*
+ *	Send a message, waiting until the deadline for room to do so.
+ */
+static SInt32 _dndSocketSend( int fd, SInt32 msgid, SInt32 flags, CFDataRef data, CFAbsoluteTime deadline )
+{
+	dndSocketHeader header = { msgid, flags };
+	struct iovec iov[2];
+	iov[0].iov_base = &header;
+	iov[0].iov_len = sizeof(dndSocketHeader);
+	iov[1].iov_base = (data != NULL) ? (void *)CFDataGetBytePtr(data) : NULL;
+	iov[1].iov_len = (data != NULL) ? CFDataGetLength(data) : 0;
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(struct msghdr));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = (iov[1].iov_len != 0) ? 2 : 1;
+
+	while( sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT) < 0 )
+	{
+		if( errno == EINTR ) continue;
+		if( (errno == EPIPE) || (errno == ECONNRESET) || (errno == ENOTCONN) ) return dndEndpointBecameInvalidError;
+		if( (errno != EAGAIN) && (errno != EWOULDBLOCK) ) return dndEndpointTransportError;
+		if( !_dndSocketWait(fd, POLLOUT, deadline) ) return dndEndpointSendTimeout;
+	}
+	return dndEndpointSuccess;
+}
+
+/*
+ *	Take the next message from fd, if there is one, without waiting for it.
+ *	dndEndpointReceiveTimeout means there wasn't one, dndEndpointIsInvalid that
+ *	the other end has closed the connection.
+ */
+static SInt32 _dndSocketReceive( int fd, dndSocketHeader *header, CFDataRef *data )
+{
+	ssize_t size;
+	do size = recv(fd, NULL, 0, MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT);
+	while( (size < 0) && (errno == EINTR) );
+
+	if( size == 0 ) return dndEndpointIsInvalid;
+	if( size < 0 )
+	{
+		if( (errno == EAGAIN) || (errno == EWOULDBLOCK) ) return dndEndpointReceiveTimeout;
+		if( errno == ECONNRESET ) return dndEndpointIsInvalid;
+		return dndEndpointTransportError;
+	}
+
+	CFIndex length = (size > sizeof(dndSocketHeader)) ? (size - sizeof(dndSocketHeader)) : 0;
+	CFMutableDataRef buffer = CFDataCreateMutable( kCFAllocatorDefault, length );
+	if( buffer == NULL ) return dndEndpointTransportError;
+	CFDataSetLength(buffer, length);
+
+	struct iovec iov[2];
+	iov[0].iov_base = header;
+	iov[0].iov_len = sizeof(dndSocketHeader);
+	iov[1].iov_base = CFDataGetMutableBytePtr(buffer);
+	iov[1].iov_len = length;
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(struct msghdr));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+
+	do size = recvmsg(fd, &msg, MSG_DONTWAIT);
+	while( (size < 0) && (errno == EINTR) );
+
+	if( size < (ssize_t)sizeof(dndSocketHeader) )
+	{
+		CFRelease(buffer);
+		return (size == 0) ? dndEndpointIsInvalid : dndEndpointTransportError;
+	}
+	*data = buffer;
+	return dndEndpointSuccess;
+}
+
+/*
+ *	A connection accepted by a local endpoint. Replies which can't be sent straight
+ *	away wait in its backlog, already framed, until the socket has room for them.
+ */
+typedef struct dndSocketConnection {
+	int fd;
+	dndSocketEndpoint *endpoint;	// retained until the connection is closed
+	CFMutableArrayRef backlog;		// oldest first, or NULL when there's nothing waiting
+	dndTimerRef stall;				// fires if the backlog isn't cleared in time
+} dndSocketConnection;
+
+// how long a client has to take a reply before we give up on it
+#define REPLY_TIMEOUT	1.0
+
+static void _dndSocketConnectionClose( dndSocketConnection *connection )
+{
+	dndEventLoopRemove(connection->fd);
+	close(connection->fd);
+	if( connection->stall != NULL ) dndEventLoopRemoveTimer(connection->stall);
+	if( connection->backlog != NULL ) CFRelease(connection->backlog);
+	dndEndpointRelease((dndEndpointRef)connection->endpoint);
+	free(connection);
+}
+
+static void _dndSocketConnectionStalled( void *info )
+{
+	dndSocketConnection *connection = info;
+	connection->stall = NULL;
+	_dndSocketConnectionClose(connection);
+}
+
+/*
+ *	Send as much of the backlog as there's room for, returning FALSE if the
+ *	connection has failed.
+ */
+static Boolean _dndSocketConnectionFlush( dndSocketConnection *connection )
+{
+	while( connection->backlog != NULL )
+	{
+		CFDataRef frame = CFArrayGetValueAtIndex(connection->backlog, 0);
+		if( send(connection->fd, CFDataGetBytePtr(frame), CFDataGetLength(frame), MSG_NOSIGNAL | MSG_DONTWAIT) < 0 )
+		{
+			if( errno == EINTR ) continue;
+			return (errno == EAGAIN) || (errno == EWOULDBLOCK);
+		}
+
+		CFArrayRemoveValueAtIndex(connection->backlog, 0);
+		if( CFArrayGetCount(connection->backlog) == 0 )
+		{
+			CFRelease(connection->backlog);
+			connection->backlog = NULL;
+			dndEventLoopRemoveTimer(connection->stall);
+			connection->stall = NULL;
+			dndEventLoopSetEvents(connection->fd, dndEventRead);
+		}
+	}
+	return TRUE;
+}
+
+/*
+ *	Send a reply, or add it to the backlog if it has to wait, returning FALSE if
+ *	the connection has failed.
+ */
+static Boolean _dndSocketConnectionReply( dndSocketConnection *connection, SInt32 msgid, CFDataRef reply )
+{
+	if( connection->backlog == NULL )
+	{
+		// a deadline which has already passed means it's sent now or not at all
+		SInt32 result = _dndSocketSend(connection->fd, msgid, 0, reply, 0.0);
+		if( result == dndEndpointSuccess ) return TRUE;
+		if( result != dndEndpointSendTimeout ) return FALSE;
+
+		connection->backlog = CFArrayCreateMutable( kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks );
+		if( connection->backlog == NULL ) return FALSE;
+		connection->stall = dndEventLoopAddTimer(CFAbsoluteTimeGetCurrent() + REPLY_TIMEOUT, _dndSocketConnectionStalled, connection);
+		dndEventLoopSetEvents(connection->fd, dndEventRead | dndEventWrite);
+	}
+
+	dndSocketHeader header = { msgid, 0 };
+	CFMutableDataRef frame = CFDataCreateMutable( kCFAllocatorDefault, 0 );
+	if( frame == NULL ) return FALSE;
+	CFDataAppendBytes( frame, (const UInt8 *)&header, sizeof(dndSocketHeader) );
+	if( reply != NULL ) CFDataAppendBytes( frame, CFDataGetBytePtr(reply), CFDataGetLength(reply) );
+	CFArrayAppendValue(connection->backlog, frame);
+	CFRelease(frame);
+	return TRUE;
+}
+
+/*
+ *	Something has happened on a connection accepted by a local endpoint. Every
+ *	message which has arrived is passed to the endpoint's callout in turn, and its
+ *	reply sent back if one was asked for.
+ */
+static void _dndSocketConnectionEvent( int fd, UInt32 events, void *info )
+{
+	dndSocketConnection *connection = info;
+	dndSocketEndpoint *endpoint = connection->endpoint;
+
+	if( (events & dndEventWrite) && !_dndSocketConnectionFlush(connection) )
+	{
+		_dndSocketConnectionClose(connection);
+		return;
+	}
+	if( (events & (dndEventRead | dndEventHangUp | dndEventError)) == 0 ) return;
+
+	while(TRUE)
+	{
+		dndSocketHeader header;
+		CFDataRef message = NULL;
+		SInt32 result = _dndSocketReceive(fd, &header, &message);
+		if( result == dndEndpointReceiveTimeout ) return;
+		if( result != dndEndpointSuccess )
+		{
+			_dndSocketConnectionClose(connection);
+			return;
+		}
+
+		CFDataRef reply = endpoint->callout((dndEndpointRef)endpoint, header.msgid, message, endpoint->info);
+		CFRelease(message);
+
+		Boolean ok = TRUE;
+		if( header.flags & SOCKET_REPLY ) ok = _dndSocketConnectionReply(connection, header.msgid, reply);
+		if( reply != NULL ) CFRelease(reply);
+		if( !ok )
+		{
+			_dndSocketConnectionClose(connection);
+			return;
+		}
+	}
+}
+
+static void _dndSocketAccept( int fd, UInt32 events, void *info )
+{
+	int client;
+	while( (client = accept(fd, NULL, NULL)) >= 0 )
+	{
+		fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+
+		dndSocketConnection *connection = calloc(1, sizeof(dndSocketConnection));
+		if( connection == NULL )
+		{
+			close(client);
+			continue;
+		}
+		connection->fd = client;
+		connection->endpoint = (dndSocketEndpoint *)dndEndpointRetain((dndEndpointRef)info);
+
+		if( !dndEventLoopAdd(client, dndEventRead, _dndSocketConnectionEvent, connection) )
+		{
+			_dndSocketConnectionClose(connection);
+			continue;
+		}
+	}
+}
+
+static dndEndpointRef _dndSocketCreateLocal( CFStringRef name, dndEndpointCallBack callout, void *info )
+{
+	dndSocketEndpoint *endpoint = calloc(1, sizeof(dndSocketEndpoint));
+	if( endpoint == NULL ) return NULL;
+	if( !_dndSocketAddress(name, &endpoint->address) )
+	{
+		free(endpoint);
+		return NULL;
+	}
+	endpoint->callout = callout;
+	endpoint->info = info;
+	pthread_mutex_init(&endpoint->lock, NULL);
+
+	endpoint->fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if( endpoint->fd < 0 )
+	{
+		free(endpoint);
+		return NULL;
+	}
+
+	// somebody is already listening under this name if we can connect to them,
+	//	otherwise anything at the path has been left behind and can go
+	if( connect(endpoint->fd, (struct sockaddr *)&endpoint->address, sizeof(struct sockaddr_un)) == 0 )
+	{
+		close(endpoint->fd);
+		free(endpoint);
+		return NULL;
+	}
+	unlink(endpoint->address.sun_path);
+
+	if( (bind(endpoint->fd, (struct sockaddr *)&endpoint->address, sizeof(struct sockaddr_un)) != 0)
+	   || (listen(endpoint->fd, SOMAXCONN) != 0) )
+	{
+		close(endpoint->fd);
+		free(endpoint);
+		return NULL;
+	}
+	fcntl(endpoint->fd, F_SETFL, fcntl(endpoint->fd, F_GETFL) | O_NONBLOCK);
+
+	if( !dndEventLoopAdd(endpoint->fd, dndEventRead, _dndSocketAccept, endpoint) )
+	{
+		unlink(endpoint->address.sun_path);
+		close(endpoint->fd);
+		free(endpoint);
+		return NULL;
+	}
+	endpoint->watched = TRUE;
+	endpoint->valid = TRUE;
+
+	return (dndEndpointRef)endpoint;
+}
+
+static dndEndpointRef _dndSocketCreateRemote( CFStringRef name )
+{
+	dndSocketEndpoint *endpoint = calloc(1, sizeof(dndSocketEndpoint));
+	if( endpoint == NULL ) return NULL;
+	if( !_dndSocketAddress(name, &endpoint->address) )
+	{
+		free(endpoint);
+		return NULL;
+	}
+	pthread_mutex_init(&endpoint->lock, NULL);
+
+	endpoint->fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if( endpoint->fd < 0 )
+	{
+		free(endpoint);
+		return NULL;
+	}
+	if( connect(endpoint->fd, (struct sockaddr *)&endpoint->address, sizeof(struct sockaddr_un)) != 0 )
+	{
+		close(endpoint->fd);
+		free(endpoint);
+		return NULL;
+	}
+	endpoint->valid = TRUE;
+
+	return (dndEndpointRef)endpoint;
+}
+
+static SInt32 _dndSocketSendRequest( dndEndpointRef remote, SInt32 msgid, CFDataRef data, CFTimeInterval sendTimeout, CFTimeInterval rcvTimeout, CFDataRef *reply )
+{
+	dndSocketEndpoint *endpoint = (dndSocketEndpoint *)remote;
+	if( !endpoint->valid ) return dndEndpointIsInvalid;
+
+	pthread_mutex_lock(&endpoint->lock);
+	SInt32 result = _dndSocketSend(endpoint->fd, msgid, (reply != NULL) ? SOCKET_REPLY : 0, data, CFAbsoluteTimeGetCurrent() + sendTimeout);
+
+	if( (result == dndEndpointSuccess) && (reply != NULL) )
+	{
+		CFAbsoluteTime deadline = CFAbsoluteTimeGetCurrent() + rcvTimeout;
+		dndSocketHeader header;
+		do {
+			if( !_dndSocketWait(endpoint->fd, POLLIN, deadline) )
+			{
+				result = dndEndpointReceiveTimeout;
+				break;
+			}
+			result = _dndSocketReceive(endpoint->fd, &header, reply);
+		} while( result == dndEndpointReceiveTimeout );
+		if( result == dndEndpointIsInvalid ) result = dndEndpointBecameInvalidError;
+	}
+	pthread_mutex_unlock(&endpoint->lock);
+
+	if( result == dndEndpointBecameInvalidError ) endpoint->valid = FALSE;
+	return result;
+}
+
+static Boolean _dndSocketIsValid( dndEndpointRef endpoint )
+{
+	return ((dndSocketEndpoint *)endpoint)->valid;
+}
+
+/*
+ *	Nothing is sent to a remote endpoint except replies to requests, which are read
+ *	by the sender while it holds the lock, so anything else arriving is a reply which
+ *	came too late and is thrown away. Otherwise the connection has been closed.
+ */
+static void _dndSocketRemoteEvent( int fd, UInt32 events, void *info )
+{
+	dndSocketEndpoint *endpoint = info;
+	Boolean closed = ((events & (dndEventHangUp | dndEventError)) != 0);
+
+	while( !closed && (pthread_mutex_trylock(&endpoint->lock) == 0) )
+	{
+		char byte;
+		ssize_t size = recv(fd, &byte, 1, MSG_DONTWAIT);
+		pthread_mutex_unlock(&endpoint->lock);
+		if( size > 0 ) continue;
+		if( (size < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ) break;
+		if( (size < 0) && (errno == EINTR) ) continue;
+		closed = TRUE;
+	}
+	if( !closed ) return;
+
+	endpoint->valid = FALSE;
+	dndEventLoopRemove(fd);
+	endpoint->watched = FALSE;
+	if( endpoint->invalidation != NULL ) endpoint->invalidation((dndEndpointRef)endpoint);
+}
+
+static void _dndSocketSetInvalidationCallBack( dndEndpointRef remote, dndEndpointInvalidationCallBack callout )
+{
+	dndSocketEndpoint *endpoint = (dndSocketEndpoint *)remote;
+	endpoint->invalidation = callout;
+
+	// stop watching straight away, since the endpoint may next be released on another thread
+	if( callout == NULL )
+	{
+		if( endpoint->watched ) dndEventLoopRemove(endpoint->fd);
+		endpoint->watched = FALSE;
+		return;
+	}
+
+	if( !endpoint->watched && endpoint->valid )
+		endpoint->watched = dndEventLoopAdd(endpoint->fd, dndEventRead, _dndSocketRemoteEvent, endpoint);
+	if( !endpoint->valid ) callout(remote);
+}
+
+static void _dndSocketDestroy( dndEndpointRef endpoint )
+{
+	dndSocketEndpoint *se = (dndSocketEndpoint *)endpoint;
+	if( se->watched ) dndEventLoopRemove(se->fd);
+	if( se->callout != NULL ) unlink(se->address.sun_path);
+	close(se->fd);
+	pthread_mutex_destroy(&se->lock);
+	free(se);
+}
+
+static dndSourceRef _dndSocketCreateSource( dndSourceCallBack perform, void *info )
+{
+	return (dndSourceRef)dndEventSourceCreate(perform, info);
+}
+
+static void _dndSocketSignalSource( dndSourceRef source )
+{
+	dndEventSourceSignal((dndEventSourceRef)source);
+}
+
+const dndTransport dndTransportSocket = {
+	"socket",
+	_dndSocketCreateLocal,
+	_dndSocketCreateRemote,
+	_dndSocketSendRequest,
+	_dndSocketIsValid,
+	_dndSocketSetInvalidationCallBack,
+	_dndSocketDestroy,
+	_dndSocketCreateSource,
+	_dndSocketSignalSource,
+	dndEventLoopRun
+};
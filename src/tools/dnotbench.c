@@ -0,0 +1,453 @@
+/*
+ *  dnotbench.c
+ *  ddistnoted
+ *
+ *	Load generator for ddistnoted. Starts a number of publisher threads, each posting
+ *	straight to the daemon like postdnot, and a number of subscribers, each a local
+ *	endpoint registered like waitdnot's, then reports how many notifications went in
+ *	and came out and how long they took to arrive. Posts carry the time they were due
+ *	to be sent, so a publisher which falls behind its rate is charged for the wait
+ *	instead of hiding it. Results can be appended, as a line of JSON, to a file so that
+ *	runs against different builds can be compared.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "ddistnoted.h"
+#include "dndtransport.h"
+#include "dndhistogram.h"
+
+#define DRAIN_TIMEOUT	2.0		// seconds to wait for stragglers once publishing stops
+
+// what follows the dndNotHeader in every post
+typedef struct dndBenchStamp {
+	UInt64 due;			// dndNanoseconds() when the post was meant to be sent
+	CFIndex publisher;
+	CFIndex seq;
+} dndBenchStamp;
+
+typedef struct dndBenchPublisher {
+	pthread_t thread;
+	CFIndex number;
+	CFIndex posts;		// notifications sent successfully
+	CFIndex errors;		// notifications in sends which failed
+} dndBenchPublisher;
+
+static const dndTransport *benchTransport = NULL;
+static CFIndex benchPublishers = 1;
+static CFIndex benchSubscribers = 1;
+static CFIndex benchFanout = 1;
+static CFIndex benchRate = 0;			// posts per second across every publisher, 0 for flat out
+static CFIndex benchPayload = 0;		// bytes after the header, at least a dndBenchStamp
+static CFIndex benchBatch = 1;			// posts per message
+static CFIndex benchDuration = 5;		// seconds
+static const char *benchOutput = NULL;
+static const char *benchLabel = "";
+
+static long benchSession = 0;
+static CFHashCode *benchNames = NULL;	// one per subscriber, each observed by benchFanout of them
+static CFHashCode benchObject = 0;
+static dndBenchPublisher *benchPublisherList = NULL;
+
+// only touched on the main thread, apart from benchDelivered being watched by the controller
+static dndHistogram benchLatency;
+static volatile CFIndex benchDelivered = 0;
+static UInt64 benchStarted = 0;
+static UInt64 benchLastDelivery = 0;
+static UInt64 benchStopped = 0;
+static dndSourceRef benchDone = NULL;
+
+void usage( void );
+
+void usage( void )
+{
+	printf("\ndnotbench: Measure ddistnoted's throughput and latency.\n");
+	printf("    -p publishers  ~ threads posting notifications (1)\n");
+	printf("    -s subscribers  ~ clients registered to receive them (1)\n");
+	printf("    -f fanout  ~ subscribers receiving each notification, up to -s (1)\n");
+	printf("    -r rate  ~ posts per second across all publishers, 0 for flat out (0)\n");
+	printf("    -z bytes  ~ payload carried by each post (%ld)\n", (long)sizeof(dndBenchStamp));
+	printf("    -b count  ~ posts sent in each NOTIFICATION_BATCH message, up to %d (1)\n", NOTIFICATION_BATCH_MAX);
+	printf("    -d seconds  ~ how long to publish for (5)\n");
+	printf("    -t cf|socket  ~ transport to use\n");
+	printf("    -o file  ~ append the results to file as a line of JSON\n");
+	printf("    -l label  ~ label the results, eg. with the build being measured\n");
+}
+
+static void _benchSleep( UInt64 nanoseconds )
+{
+	struct timespec ts = { (time_t)(nanoseconds / 1000000000ULL), (long)(nanoseconds % 1000000000ULL) };
+	nanosleep(&ts, NULL);
+}
+
+/*
+ *	Subscribers
+ */
+static void _benchReceived( const UInt8 *bytes, CFIndex length, UInt64 now )
+{
+	if( length < (CFIndex)(sizeof(dndNotHeader) + sizeof(dndBenchStamp)) ) return;
+
+	dndBenchStamp stamp;
+	memcpy(&stamp, bytes + sizeof(dndNotHeader), sizeof(dndBenchStamp));
+	dndHistogramRecord(&benchLatency, (now > stamp.due) ? (now - stamp.due) : 0);
+	benchLastDelivery = now;
+	benchDelivered++;
+}
+
+static CFDataRef _benchCallBack( dndEndpointRef local, SInt32 msgid, CFDataRef data, void *info )
+{
+	UInt64 now = dndNanoseconds();
+	const UInt8 *bytes = CFDataGetBytePtr(data);
+	CFIndex length = CFDataGetLength(data);
+
+	if( msgid == NOTIFICATION )
+	{
+		_benchReceived(bytes, length, now);
+		return NULL;
+	}
+	if( msgid != NOTIFICATION_BATCH ) return NULL;
+
+	CFIndex offset = 0;
+	dndFrameHeader frame;
+	while( offset + (CFIndex)sizeof(dndFrameHeader) <= length )
+	{
+		memcpy(&frame, bytes + offset, sizeof(dndFrameHeader));
+		offset += sizeof(dndFrameHeader);
+		if( (frame.length < 0) || (frame.length > length - offset) ) break;
+		_benchReceived(bytes + offset, frame.length, now);
+		offset += frame.length;
+	}
+	return NULL;
+}
+
+/*
+ *	Subscriber i observes names i, i-1, ... i-(fanout-1), wrapping around, so that
+ *	every name is observed by exactly benchFanout subscribers.
+ */
+static Boolean _benchSubscribe( dndEndpointRef remote, CFIndex i )
+{
+	char *uname;
+	asprintf(&uname, "dnotbench-%u-%ld", getpid(), (long)i);
+	CFStringRef name = CFStringCreateWithCString(kCFAllocatorDefault, uname, kCFStringEncodingASCII);
+
+	dndEndpointRef local = dndEndpointCreateLocal(benchTransport, name, _benchCallBack, NULL);
+	CFRelease(name);
+	if( local == NULL )
+	{
+		printf("failed to create local %s port '%s'\n", benchTransport->name, uname);
+		free(uname);
+		return FALSE;
+	}
+
+	// session, port name and what we can handle, as waitdnot sends them
+	CFIndex length = strlen(uname) + 1;
+	CFIndex flags = DND_PORT_BATCH_DELIVERY;
+	CFMutableDataRef dataOut = CFDataCreateMutable(kCFAllocatorDefault, 0);
+	CFDataAppendBytes(dataOut, (const UInt8 *)&benchSession, sizeof(long));
+	CFDataAppendBytes(dataOut, (const UInt8 *)uname, length);
+	CFDataAppendBytes(dataOut, (const UInt8 *)&flags, sizeof(CFIndex));
+	free(uname);
+
+	CFDataRef dataIn = NULL;
+	SInt32 result = dndEndpointSendRequest(remote, REGISTER_PORT, dataOut, 1.0, 1.0, &dataIn);
+	CFRelease(dataOut);
+	if( result || !dataIn || (CFDataGetLength(dataIn) < (CFIndex)sizeof(CFHashCode)) )
+	{
+		printf("failed to register subscriber %ld (%d)\n", (long)i, result);
+		if( dataIn ) CFRelease(dataIn);
+		return FALSE;
+	}
+
+	CFHashCode uid;
+	CFDataGetBytes(dataIn, CFRangeMake(0, sizeof(CFHashCode)), (UInt8 *)&uid);
+	CFRelease(dataIn);
+
+	dndNotReg infos[benchFanout];
+	for( CFIndex j = 0; j < benchFanout; j++ )
+	{
+		infos[j].uid = uid;
+		infos[j].name = benchNames[(i - j + benchSubscribers) % benchSubscribers];
+		infos[j].object = benchObject;
+		infos[j].sb = CFNotificationSuspensionBehaviorDeliverImmediately;
+	}
+	CFDataRef regs = CFDataCreate(kCFAllocatorDefault, (const UInt8 *)infos, benchFanout * sizeof(dndNotReg));
+	result = dndEndpointSendRequest(remote, REGISTER_NOTIFICATIONS, regs, 1.0, 1.0, NULL);
+	CFRelease(regs);
+	if( result )
+	{
+		printf("failed to register notifications for subscriber %ld (%d)\n", (long)i, result);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ *	Publishers. Each sends benchBatch posts per message, in a buffer which is filled
+ *	in place each time round, naming the names in turn. With a rate set each message
+ *	is due an interval after the last, and stamped with when it was due rather than
+ *	when it went, so that latency includes any time spent catching up.
+ */
+static void *_benchPublish( void *arg )
+{
+	dndBenchPublisher *publisher = arg;
+
+	dndEndpointRef remote = dndEndpointCreateRemote(benchTransport, CFSTR("org.puredarwin.ddistnoted"));
+	if( remote == NULL )
+	{
+		printf("publisher %ld failed to connect to ddistnoted\n", (long)publisher->number);
+		return NULL;
+	}
+
+	CFIndex length = sizeof(dndNotHeader) + benchPayload;
+	CFIndex stride = (benchBatch > 1) ? (sizeof(dndFrameHeader) + length) : length;
+	CFMutableDataRef data = CFDataCreateMutable(kCFAllocatorDefault, 0);
+	CFDataSetLength(data, stride * benchBatch); // zero-filled, which is the padding
+	UInt8 *bytes = CFDataGetMutableBytePtr(data);
+
+	dndNotHeader header = { benchSession, 0, benchObject, 0 };
+	dndFrameHeader frame = { length };
+	dndBenchStamp stamp = { 0, publisher->number, 0 };
+
+	UInt64 interval = (benchRate > 0) ? ((1000000000ULL * benchPublishers * benchBatch) / benchRate) : 0;
+	UInt64 end = benchStarted + (UInt64)benchDuration * 1000000000ULL;
+	// stagger the publishers across the first interval
+	UInt64 due = benchStarted + ((interval * publisher->number) / benchPublishers);
+	CFIndex name = publisher->number;
+
+	while( TRUE )
+	{
+		UInt64 now = dndNanoseconds();
+		if( interval == 0 )
+			due = now;
+		else if( due > now )
+		{
+			_benchSleep(due - now);
+			now = due;
+		}
+		if( now >= end ) break;
+
+		UInt8 *p = bytes;
+		stamp.due = due;
+		for( CFIndex i = 0; i < benchBatch; i++ )
+		{
+			if( benchBatch > 1 )
+			{
+				memcpy(p, &frame, sizeof(dndFrameHeader));
+				p += sizeof(dndFrameHeader);
+			}
+			header.name = benchNames[name++ % benchSubscribers];
+			memcpy(p, &header, sizeof(dndNotHeader));
+			memcpy(p + sizeof(dndNotHeader), &stamp, sizeof(dndBenchStamp));
+			stamp.seq++;
+			p += length;
+		}
+
+		SInt32 result = dndEndpointSendRequest(remote, (benchBatch > 1) ? NOTIFICATION_BATCH : NOTIFICATION, data, 1.0, 1.0, NULL);
+		if( result == dndEndpointSuccess )
+			publisher->posts += benchBatch;
+		else
+			publisher->errors += benchBatch;
+
+		due += interval;
+	}
+
+	CFRelease(data);
+	dndEndpointRelease(remote);
+	return NULL;
+}
+
+/*
+ *	Reporting. The controller thread waits for the publishers, then for deliveries to
+ *	catch up with what should have been delivered or stop arriving, then has the main
+ *	thread write up the results.
+ */
+static CFIndex _benchPosts( CFIndex *errors )
+{
+	CFIndex posts = 0;
+	*errors = 0;
+	for( CFIndex i = 0; i < benchPublishers; i++ )
+	{
+		posts += benchPublisherList[i].posts;
+		*errors += benchPublisherList[i].errors;
+	}
+	return posts;
+}
+
+static void *_benchControl( void *arg )
+{
+	for( CFIndex i = 0; i < benchPublishers; i++ )
+		pthread_join(benchPublisherList[i].thread, NULL);
+	benchStopped = dndNanoseconds();
+
+	CFIndex errors;
+	CFIndex expected = _benchPosts(&errors) * benchFanout;
+	CFIndex seen = -1;
+	UInt64 quiet = dndNanoseconds();
+	while( benchDelivered < expected )
+	{
+		if( benchDelivered != seen )
+		{
+			seen = benchDelivered;
+			quiet = dndNanoseconds();
+		}
+		else if( dndNanoseconds() - quiet > (UInt64)(DRAIN_TIMEOUT * 1e9) )
+			break;
+		_benchSleep(10000000ULL);
+	}
+
+	dndSourceSignal(benchTransport, benchDone);
+	return NULL;
+}
+
+static void _benchReport( void *info )
+{
+	CFIndex errors;
+	CFIndex posts = _benchPosts(&errors);
+	CFIndex expected = posts * benchFanout;
+	CFIndex delivered = benchDelivered;
+
+	double publishing = (double)(benchStopped - benchStarted) / 1e9;
+	UInt64 last = (benchLastDelivery > benchStopped) ? benchLastDelivery : benchStopped;
+	double delivering = (double)(last - benchStarted) / 1e9;
+	double postRate = (publishing > 0.0) ? (posts / publishing) : 0.0;
+	double deliveryRate = (delivering > 0.0) ? (delivered / delivering) : 0.0;
+
+	double p50 = dndHistogramPercentile(&benchLatency, 50.0) / 1e3;
+	double p90 = dndHistogramPercentile(&benchLatency, 90.0) / 1e3;
+	double p99 = dndHistogramPercentile(&benchLatency, 99.0) / 1e3;
+	double p999 = dndHistogramPercentile(&benchLatency, 99.9) / 1e3;
+	double min = (benchLatency.count > 0) ? (benchLatency.min / 1e3) : 0.0;
+	double max = benchLatency.max / 1e3;
+	double mean = dndHistogramMean(&benchLatency) / 1e3;
+
+	printf("dnotbench: %s, %ld publishers, %ld subscribers, fan-out %ld, %ld bytes, batches of %ld\n",
+		   benchTransport->name, (long)benchPublishers, (long)benchSubscribers, (long)benchFanout, (long)benchPayload, (long)benchBatch);
+	printf("    posts      %ld (%ld failed) in %.2fs, %.0f/s\n", (long)posts, (long)errors, publishing, postRate);
+	printf("    deliveries %ld of %ld (%ld lost) in %.2fs, %.0f/s\n", (long)delivered, (long)expected, (long)(expected - delivered), delivering, deliveryRate);
+	printf("    latency us min %.1f mean %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n", min, mean, p50, p90, p99, p999, max);
+
+	if( benchOutput != NULL )
+	{
+		FILE *file = fopen(benchOutput, "a");
+		if( file == NULL )
+			printf("couldn't open '%s' for the results\n", benchOutput);
+		else
+		{
+			fprintf(file, "{\"label\":\"%s\",\"transport\":\"%s\",\"publishers\":%ld,\"subscribers\":%ld,\"fanout\":%ld,"
+					"\"rate\":%ld,\"payload\":%ld,\"batch\":%ld,\"duration\":%ld,"
+					"\"posts\":%ld,\"errors\":%ld,\"deliveries\":%ld,\"expected\":%ld,"
+					"\"posts_per_sec\":%.1f,\"deliveries_per_sec\":%.1f,"
+					"\"latency_us\":{\"min\":%.1f,\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}}\n",
+					benchLabel, benchTransport->name, (long)benchPublishers, (long)benchSubscribers, (long)benchFanout,
+					(long)benchRate, (long)benchPayload, (long)benchBatch, (long)benchDuration,
+					(long)posts, (long)errors, (long)delivered, (long)expected,
+					postRate, deliveryRate,
+					min, mean, p50, p90, p99, p999, max);
+			fclose(file);
+		}
+	}
+
+	exit((errors || (delivered < expected)) ? 1 : 0);
+}
+
+int main (int argc, const char * argv[]) {
+
+    benchTransport = dndTransportDefault();
+    benchPayload = sizeof(dndBenchStamp);
+
+    int c;
+    while ((c = getopt (argc, (char * const *)argv, "p:s:f:r:z:b:d:t:o:l:")) != -1) {
+        switch (c) {
+            case 'p':
+                benchPublishers = strtol(optarg, NULL, 10);
+                break;
+            case 's':
+                benchSubscribers = strtol(optarg, NULL, 10);
+                break;
+            case 'f':
+                benchFanout = strtol(optarg, NULL, 10);
+                break;
+            case 'r':
+                benchRate = strtol(optarg, NULL, 10);
+                break;
+            case 'z':
+                benchPayload = strtol(optarg, NULL, 10);
+                break;
+            case 'b':
+                benchBatch = strtol(optarg, NULL, 10);
+                break;
+            case 'd':
+                benchDuration = strtol(optarg, NULL, 10);
+                break;
+            case 't':
+                benchTransport = dndTransportNamed(optarg);
+                break;
+            case 'o':
+                benchOutput = optarg;
+                break;
+            case 'l':
+                benchLabel = optarg;
+                break;
+            default:
+                usage();
+                return -1;
+        }
+    }
+
+    if (!benchTransport || (benchPublishers < 1) || (benchSubscribers < 1) || (benchFanout < 1)
+        || (benchFanout > benchSubscribers) || (benchRate < 0) || (benchBatch < 1) || (benchBatch > NOTIFICATION_BATCH_MAX) || (benchDuration < 1)) {
+        usage();
+        return -1;
+    }
+    if (benchPayload < (CFIndex)sizeof(dndBenchStamp)) benchPayload = sizeof(dndBenchStamp);
+
+    // This works around an issue where calls to CFRunLoopGetCurrent() returns a junk address from the TDS
+    CFRunLoopGetMain();
+
+	benchSession = getuid();
+	if (benchSession == 0) benchSession = 21; // as waitdnot and postdnot do
+
+	benchObject = CFHash(CFSTR("dnotbench"));
+	benchNames = malloc(benchSubscribers * sizeof(CFHashCode));
+	for (CFIndex k = 0; k < benchSubscribers; k++) {
+		CFStringRef name = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("dnotbench.%ld"), (long)k);
+		benchNames[k] = CFHash(name);
+		CFRelease(name);
+	}
+	dndHistogramReset(&benchLatency);
+
+	dndEndpointRef remote = dndEndpointCreateRemote(benchTransport, CFSTR("org.puredarwin.ddistnoted"));
+	if (!remote) {
+		printf("failed to connect to %s port org.puredarwin.ddistnoted\n", benchTransport->name);
+		return 1;
+	}
+	for (CFIndex i = 0; i < benchSubscribers; i++)
+		if (!_benchSubscribe(remote, i)) return 1;
+	dndEndpointRelease(remote);
+
+	benchDone = dndSourceCreate(benchTransport, _benchReport, NULL);
+	benchPublisherList = calloc(benchPublishers, sizeof(dndBenchPublisher));
+	if (!benchDone || !benchPublisherList) {
+		printf("couldn't set up the publishers\n");
+		return 1;
+	}
+
+	// registering notifications doesn't wait for a reply, so give the daemon a moment
+	//	to take them in before anything is posted
+	_benchSleep(200000000ULL);
+
+	benchStarted = dndNanoseconds();
+	for (CFIndex i = 0; i < benchPublishers; i++) {
+		benchPublisherList[i].number = i;
+		pthread_create(&benchPublisherList[i].thread, NULL, _benchPublish, benchPublisherList + i);
+	}
+	pthread_t controller;
+	pthread_create(&controller, NULL, _benchControl, NULL);
+
+	dndTransportRun(benchTransport); // until the report exits
+	return 0;
+}
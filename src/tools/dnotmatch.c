@@ -0,0 +1,329 @@
+/*
+ *  dnotmatch.c
+ *  ddistnoted
+ *
+ *	Microbenchmark for matching posts against records. A table of records is built
+ *	as the daemon keeps one: parallel arrays of name hashes, object hashes and
+ *	sessions, chained by 32 bit links from buckets keyed on name and object, name
+ *	alone and object alone, with each session's wildcards on a chain of their own.
+ *	The same posts are then matched by walking the chains, as the daemon does, and by
+ *	scanning the whole table with each of the match kernels this processor runs.
+ *	Every method has to find the same records, or the run fails.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dndmatch.h"
+#include "dndhistogram.h"
+
+// a table of records, laid out as the daemon's
+typedef struct dndBenchTable {
+	CFIndex count;
+	CFHashCode *names;
+	CFHashCode *objects;
+	long *sessions;
+	SInt32 *next;
+	SInt32 *notIndex;
+	SInt32 *nameIndex;
+	SInt32 *objectIndex;
+	CFIndex mask;
+	SInt32 *wildcards;		// by session number
+} dndBenchTable;
+
+typedef struct dndBenchPost {
+	CFHashCode name;
+	CFHashCode object;
+	long session;
+} dndBenchPost;
+
+static CFIndex benchWildcards = 10;		// percent of records with a 0 name, half of which have a 0 object too
+static CFIndex benchSessions = 1;
+static CFIndex benchPosts = 10000;
+
+void usage( void );
+
+void usage( void )
+{
+	printf("\ndnotmatch: Compare walking chains with scanning by each match kernel.\n");
+	printf("    [-n records]  ~ table size, repeatable (1000, 10000 and 100000)\n");
+	printf("    [-w percent]  ~ records observing any name (%ld)\n", (long)benchWildcards);
+	printf("    [-s sessions]  ~ sessions the records and posts are spread over (%ld)\n", (long)benchSessions);
+	printf("    [-q posts]  ~ posts matched by each method (%ld)\n", (long)benchPosts);
+	printf("    [-k kernel]  ~ only time this kernel: scalar, sse2 or avx2\n");
+}
+
+// xorshift, so runs are repeatable
+static UInt64 _benchRandom( void )
+{
+	static UInt64 state = 0x9E3779B97F4A7C15ULL;
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return state;
+}
+
+// the daemon's chain hash
+static CFHashCode _benchHash( CFHashCode name, CFHashCode object )
+{
+	CFHashCode hash = (name * 2654435761UL) ^ object;
+	return hash ^ (hash >> 16);
+}
+
+static CFHashCode _benchKey( CFHashCode name, CFHashCode object, long session )
+{
+	return _benchHash(_benchHash(name, object), (CFHashCode)session);
+}
+
+static SInt32 *_benchChain( dndBenchTable *table, CFHashCode name, CFHashCode object, long session )
+{
+	if( (name == 0) && (object == 0) ) return table->wildcards + session;
+
+	SInt32 *buckets = (name == 0) ? table->objectIndex : ((object == 0) ? table->nameIndex : table->notIndex);
+	return buckets + (_benchKey(name, object, session) & table->mask);
+}
+
+/*
+ *	Names come from a pool an eighth the size of the table, so a name has a handful
+ *	of observers, and objects mostly 0, as they usually are.
+ */
+static Boolean _benchTableCreate( dndBenchTable *table, CFIndex count, CFHashCode *pool, CFIndex poolSize )
+{
+	CFIndex buckets = 1;
+	while( buckets < count ) buckets *= 2;
+
+	table->count = count;
+	table->mask = buckets - 1;
+	table->names = malloc(count * sizeof(CFHashCode));
+	table->objects = malloc(count * sizeof(CFHashCode));
+	table->sessions = malloc(count * sizeof(long));
+	table->next = malloc(count * sizeof(SInt32));
+	table->notIndex = malloc(buckets * sizeof(SInt32));
+	table->nameIndex = malloc(buckets * sizeof(SInt32));
+	table->objectIndex = malloc(buckets * sizeof(SInt32));
+	table->wildcards = malloc(benchSessions * sizeof(SInt32));
+	if( !table->names || !table->objects || !table->sessions || !table->next || !table->notIndex || !table->nameIndex
+		|| !table->objectIndex || !table->wildcards ) return FALSE;
+
+	for( CFIndex i = 0; i < buckets; i++ ) table->notIndex[i] = table->nameIndex[i] = table->objectIndex[i] = kCFNotFound;
+	for( CFIndex i = 0; i < benchSessions; i++ ) table->wildcards[i] = kCFNotFound;
+
+	for( SInt32 rec = 0; rec < count; rec++ )
+	{
+		Boolean wildcard = (CFIndex)(_benchRandom() % 100) < benchWildcards;
+		table->names[rec] = wildcard ? 0 : pool[_benchRandom() % poolSize];
+		table->objects[rec] = ((_benchRandom() % 4) == 0) ? (CFHashCode)(1 + (_benchRandom() % 16)) : 0;
+		if( wildcard && (_benchRandom() & 1) ) table->objects[rec] = 0;
+		table->sessions[rec] = (long)(_benchRandom() % benchSessions);
+
+		SInt32 *head = _benchChain(table, table->names[rec], table->objects[rec], table->sessions[rec]);
+		table->next[rec] = *head;
+		*head = rec;
+	}
+	return TRUE;
+}
+
+static void _benchTableFree( dndBenchTable *table )
+{
+	free(table->names);
+	free(table->objects);
+	free(table->sessions);
+	free(table->next);
+	free(table->notIndex);
+	free(table->nameIndex);
+	free(table->objectIndex);
+	free(table->wildcards);
+}
+
+// what the daemon does: the four chains a match can be on, testing each record on them
+static CFIndex _benchWalk( dndBenchTable *table, const dndBenchPost *post, SInt32 *found )
+{
+	SInt32 chains[4] = {
+		table->notIndex[_benchKey(post->name, post->object, post->session) & table->mask],
+		table->nameIndex[_benchKey(post->name, 0, post->session) & table->mask],
+		table->objectIndex[_benchKey(0, post->object, post->session) & table->mask],
+		table->wildcards[post->session]
+	};
+	CFIndex count = 0;
+
+	for( int i = 0; i < 4; i++ )
+	{
+		for( SInt32 rec = chains[i]; rec != kCFNotFound; rec = table->next[rec] )
+		{
+			CFHashCode name = table->names[rec], object = table->objects[rec];
+			if( ((name == 0) || (name == post->name)) && ((object == 0) || (object == post->object))
+				&& (table->sessions[rec] == post->session) ) found[count++] = rec;
+		}
+	}
+	return count;
+}
+
+// the other way: every record, a block at a time
+static CFIndex _benchScan( dndBenchTable *table, const dndMatchKernel *kernel, const dndBenchPost *post, SInt32 *found )
+{
+	CFIndex count = 0;
+	for( CFIndex base = 0; base < table->count; base += MATCH_BLOCK )
+	{
+		CFIndex length = ((table->count - base) < MATCH_BLOCK) ? (table->count - base) : MATCH_BLOCK;
+		UInt64 bits = kernel->block(table->names + base, table->objects + base, table->sessions + base, length,
+									post->name, post->object, post->session, FALSE);
+		while( bits != 0 )
+		{
+			found[count++] = (SInt32)(base + __builtin_ctzll(bits));
+			bits &= bits - 1;
+		}
+	}
+	return count;
+}
+
+// which records were found, whatever order they were found in
+static UInt64 _benchSum( const SInt32 *found, CFIndex count )
+{
+	UInt64 sum = (UInt64)count;
+	for( CFIndex i = 0; i < count; i++ ) sum += _benchHash((CFHashCode)found[i] + 1, 0) * 2654435761UL;
+	return sum;
+}
+
+/*
+ *	Match every post with one method, returning nanoseconds per post and adding up
+ *	the records found. Walking the chains records what each post found in sums, and
+ *	the kernels are checked against them.
+ */
+static double _benchRun( dndBenchTable *table, const dndMatchKernel *kernel, const dndBenchPost *posts,
+						 SInt32 *found, UInt64 *sums, CFIndex *total, Boolean *agrees )
+{
+	UInt64 taken = 0;
+	*total = 0;
+	for( CFIndex p = 0; p < benchPosts; p++ )
+	{
+		UInt64 start = dndNanoseconds();
+		CFIndex count = kernel ? _benchScan(table, kernel, posts + p, found) : _benchWalk(table, posts + p, found);
+		taken += dndNanoseconds() - start;
+
+		*total += count;
+		if( kernel == NULL ) sums[p] = _benchSum(found, count);
+		else if( sums[p] != _benchSum(found, count) ) *agrees = FALSE;
+	}
+	return (double)taken / (double)benchPosts;
+}
+
+static Boolean _benchSize( CFIndex count, CFHashCode *pool, const dndMatchKernel *only )
+{
+	CFIndex poolSize = (count / 8) ? (count / 8) : 1;
+	dndBenchTable table;
+	memset(&table, 0, sizeof(table));
+	dndBenchPost *posts = malloc(benchPosts * sizeof(dndBenchPost));
+	SInt32 *found = malloc(count * sizeof(SInt32));
+	UInt64 *sums = malloc(benchPosts * sizeof(UInt64));
+	if( !posts || !found || !sums || !_benchTableCreate(&table, count, pool, poolSize) )
+	{
+		printf("dnotmatch: couldn't allocate a table of %ld records\n", (long)count);
+		return FALSE;
+	}
+
+	for( CFIndex p = 0; p < benchPosts; p++ )
+	{
+		posts[p].name = pool[_benchRandom() % poolSize];
+		posts[p].object = ((_benchRandom() % 4) == 0) ? (CFHashCode)(1 + (_benchRandom() % 16)) : 0;
+		posts[p].session = (long)(_benchRandom() % benchSessions);
+	}
+
+	printf("dnotmatch: %ld records, %ld%% wildcards, %ld sessions, %ld posts\n", (long)count, (long)benchWildcards, (long)benchSessions, (long)benchPosts);
+
+	CFIndex total;
+	Boolean agrees = TRUE;
+	double walk = _benchRun(&table, NULL, posts, found, sums, &total, &agrees);
+	printf("    %-8s %10.1f ns/post %10ld records matched\n", "chains", walk, (long)total);
+
+	const dndMatchKernel *kernels[] = { &dndMatchKernelScalar, &dndMatchKernelSSE2, &dndMatchKernelAVX2 };
+	for( size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++ )
+	{
+		const dndMatchKernel *kernel = kernels[k];
+		if( (only != NULL) && (kernel != only) ) continue;
+		if( !kernel->available() )
+		{
+			printf("    %-8s not supported by this processor\n", kernel->name);
+			continue;
+		}
+
+		double scan = _benchRun(&table, kernel, posts, found, sums, &total, &agrees);
+		printf("    %-8s %10.1f ns/post %10ld records matched, %.2fx chains, %.2f records/ns\n",
+			   kernel->name, scan, (long)total, walk / scan, (double)count / scan);
+	}
+
+	if( !agrees ) printf("dnotmatch: the methods found different records!\n");
+
+	_benchTableFree(&table);
+	free(posts);
+	free(found);
+	free(sums);
+	return agrees;
+}
+
+int main (int argc, const char * argv[]) {
+
+    CFIndex sizes[16];
+    CFIndex sizeCount = 0;
+    const dndMatchKernel *only = NULL;
+
+    int c;
+    while ((c = getopt (argc, (char * const *)argv, "n:w:s:q:k:")) != -1) {
+        switch (c) {
+            case 'n':
+                if (sizeCount < 16) sizes[sizeCount++] = strtol(optarg, NULL, 10);
+                break;
+            case 'w':
+                benchWildcards = strtol(optarg, NULL, 10);
+                break;
+            case 's':
+                benchSessions = strtol(optarg, NULL, 10);
+                break;
+            case 'q':
+                benchPosts = strtol(optarg, NULL, 10);
+                break;
+            case 'k':
+                only = dndMatchKernelNamed(optarg);
+                if (!only) {
+                    printf("dnotmatch: no kernel '%s' this processor can run\n", optarg);
+                    return -1;
+                }
+                break;
+            default:
+                usage();
+                return -1;
+        }
+    }
+    if ((benchWildcards < 0) || (benchWildcards > 100) || (benchSessions < 1) || (benchPosts < 1)) {
+        usage();
+        return -1;
+    }
+    if (sizeCount == 0) {
+        sizes[sizeCount++] = 1000;
+        sizes[sizeCount++] = 10000;
+        sizes[sizeCount++] = 100000;
+    }
+    for (CFIndex i = 0; i < sizeCount; i++) {
+        if ((sizes[i] < 1) || (sizes[i] > INT32_MAX)) {
+            usage();
+            return -1;
+        }
+    }
+
+	// name hashes which are never 0, shared by every table
+	CFIndex largest = 0;
+	for (CFIndex i = 0; i < sizeCount; i++) if (sizes[i] > largest) largest = sizes[i];
+	CFIndex poolSize = (largest / 8) ? (largest / 8) : 1;
+	CFHashCode *pool = malloc(poolSize * sizeof(CFHashCode));
+	if (!pool) return 1;
+	for (CFIndex i = 0; i < poolSize; i++) pool[i] = (CFHashCode)(_benchRandom() | 1);
+
+	Boolean agrees = TRUE;
+	for (CFIndex i = 0; i < sizeCount; i++) {
+		if (i) printf("\n");
+		agrees = _benchSize(sizes[i], pool, only) && agrees;
+	}
+
+	free(pool);
+	return agrees ? 0 : 1;
+}
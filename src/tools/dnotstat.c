@@ -0,0 +1,255 @@
+/*
+ *  dnotstat.c
+ *  ddistnoted
+ *
+ *	Ask a running ddistnoted for its statistics. Once, the totals since it started
+ *	are printed; with an interval, each report after the first gives the rates over
+ *	that interval instead.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ddistnoted.h"
+#include "dndtransport.h"
+
+// a STATS reply, split into its parts
+typedef struct dndStatsReply {
+	CFDataRef data;
+	const dndStats *stats;
+	const dndStatsShard *shards;
+	const dndStatsName *names;
+	const dndStatsTiming *timings;
+} dndStatsReply;
+
+typedef struct dndStatRate {
+	CFHashCode name;
+	double rate;
+} dndStatRate;
+
+void usage( void );
+
+void usage( void )
+{
+	printf("\ndnotstat: Report on a running ddistnoted.\n");
+	printf("    [-i seconds]  ~ report every so many seconds, with rates, until interrupted\n");
+	printf("    [-k names]  ~ show at most this many of the busiest names (10)\n");
+	printf("    [-l]  ~ also show latencies, by message type and for matching and sending\n");
+	printf("    [-t cf|socket]  ~ transport to use\n");
+}
+
+static Boolean _statFetch( dndEndpointRef remote, dndStatsReply *reply )
+{
+	CFDataRef data = NULL;
+	SInt32 result = dndEndpointSendRequest(remote, STATS, NULL, 1.0, 1.0, &data);
+	if( result || (data == NULL) )
+	{
+		printf("dnotstat: STATS request failed (%d)\n", result);
+		return FALSE;
+	}
+
+	// check the whole thing is there before trusting any of the counts in it
+	const UInt8 *bytes = CFDataGetBytePtr(data);
+	CFIndex length = CFDataGetLength(data);
+	const dndStats *stats = (const dndStats *)bytes;
+	if( (length < (CFIndex)sizeof(dndStats)) || (stats->size != sizeof(dndStats))
+		|| (length != (CFIndex)(sizeof(dndStats) + (stats->shardCount * sizeof(dndStatsShard)) + (stats->nameCount * sizeof(dndStatsName))
+							  + (stats->timingCount * sizeof(dndStatsTiming)))) )
+	{
+		printf("dnotstat: didn't understand the daemon's reply (%ld bytes)\n", (long)length);
+		CFRelease(data);
+		return FALSE;
+	}
+
+	reply->data = data;
+	reply->stats = stats;
+	reply->shards = (const dndStatsShard *)(bytes + sizeof(dndStats));
+	reply->names = (const dndStatsName *)(reply->shards + stats->shardCount);
+	reply->timings = (const dndStatsTiming *)(reply->names + stats->nameCount);
+	return TRUE;
+}
+
+// the posts seen for a name by an earlier snapshot, or -1 if it wasn't among the busiest then
+static CFIndex _statNamePosts( const dndStatsReply *reply, CFHashCode name )
+{
+	for( CFIndex i = 0; i < reply->stats->nameCount; i++ )
+		if( reply->names[i].name == name ) return reply->names[i].posts;
+	return -1;
+}
+
+// fastest first
+static int _statRateCompare( const void *a, const void *b )
+{
+	double x = ((const dndStatRate *)a)->rate, y = ((const dndStatRate *)b)->rate;
+	return (x > y) ? -1 : ((x < y) ? 1 : 0);
+}
+
+/*
+ *	Print a snapshot. With a previous one, counters are shown per second since then,
+ *	otherwise as totals.
+ */
+static void _statPrint( const dndStatsReply *now, const dndStatsReply *then, CFIndex top )
+{
+	const dndStats *s = now->stats;
+	const dndStats *p = (then != NULL) ? then->stats : NULL;
+	double seconds = (p != NULL) ? ((double)(s->uptime - p->uptime) / 1e9) : 1.0;
+	if( seconds <= 0.0 ) seconds = 1.0;
+
+	#define RATE(field) ((p != NULL) ? ((double)(s->field - p->field) / seconds) : (double)s->field)
+
+	printf("ddistnoted up %.0fs, %ld dispatch threads, %ld workers\n", s->uptime / 1e9, (long)s->dispatchThreads, (long)s->workerThreads);
+	printf("  %s\n", (p != NULL) ? "per second:" : "since starting:");
+	printf("    posts %.0f in %.0f messages, %.0f matched a client, %.0f matches\n", RATE(posts), RATE(postMessages), RATE(matched), RATE(matches));
+	printf("    queued %.0f (%.0f urgent), held %.0f, dropped %.0f, coalesced %.0f\n", RATE(queued), RATE(urgent), RATE(held), RATE(dropped), RATE(coalesced));
+	printf("    sends %.0f delivering %.0f, failed %.0f (%.0f timeouts), disconnects %.0f\n", RATE(sends), RATE(delivered), RATE(sendFailures), RATE(sendTimeouts), RATE(disconnects));
+	printf("    clients parked %.0f, recovered %.0f\n", RATE(breakerTrips), RATE(breakerRecoveries));
+
+	#undef RATE
+
+	printf("  clients %ld of %ld slots (port map %ld), %ld suspended, %ld parked, %ld ready\n", (long)s->clients, (long)s->clientCapacity, (long)s->portMapSize, (long)s->suspended, (long)s->parked, (long)s->readyClients);
+	printf("  queued %ld, longest queue %ld, held %ld\n", (long)s->queueDepth, (long)s->queueDepthMax, (long)s->heldDepth);
+	for( CFIndex i = 0; i < s->shardCount; i++ )
+	{
+		const dndStatsShard *shard = now->shards + i;
+		printf("  shard %ld: %ld records of %ld in %ld sessions, %ld buckets, room for %ld clients, %ld posts waiting\n",
+			   (long)i, (long)shard->records, (long)shard->capacity, (long)shard->sessions, (long)shard->buckets, (long)shard->clients, (long)shard->backlog);
+	}
+
+	if( s->nameCount == 0 ) return;
+	if( p == NULL )
+	{
+		printf("  busiest names, posts:\n");
+		for( CFIndex i = 0; (i < s->nameCount) && (i < top); i++ )
+			printf("    %016lX %ld (+/- %ld)\n", (unsigned long)now->names[i].name, (long)now->names[i].posts, (long)now->names[i].error);
+		return;
+	}
+
+	// names new to the busiest since last time have no rate yet, and go last
+	dndStatRate rates[s->nameCount];
+	for( CFIndex i = 0; i < s->nameCount; i++ )
+	{
+		CFIndex before = _statNamePosts(then, now->names[i].name);
+		rates[i].name = now->names[i].name;
+		rates[i].rate = (before < 0) ? -1.0 : ((double)(now->names[i].posts - before) / seconds);
+	}
+	qsort(rates, s->nameCount, sizeof(dndStatRate), _statRateCompare);
+
+	printf("  busiest names, posts per second:\n");
+	for( CFIndex i = 0; (i < s->nameCount) && (i < top); i++ )
+	{
+		if( rates[i].rate < 0.0 )
+			printf("    %016lX new\n", (unsigned long)rates[i].name);
+		else
+			printf("    %016lX %.0f\n", (unsigned long)rates[i].name, rates[i].rate);
+	}
+}
+
+static const char *_statMessageName( CFIndex msgid )
+{
+	switch(msgid)
+	{
+		case NOTIFICATION: return "NOTIFICATION";
+		case REGISTER_PORT: return "REGISTER_PORT";
+		case UNREGISTER_PORT: return "UNREGISTER_PORT";
+		case REGISTER_NOTIFICATION: return "REGISTER_NOTIFICATION";
+		case UNREGISTER_NOTIFICATION: return "UNREGISTER_NOTIFICATION";
+		case SUSPEND: return "SUSPEND";
+		case RESUME: return "RESUME";
+		case REGISTER_NOTIFICATIONS: return "REGISTER_NOTIFICATIONS";
+		case UNREGISTER_NOTIFICATIONS: return "UNREGISTER_NOTIFICATIONS";
+		case NOTIFICATION_BATCH: return "NOTIFICATION_BATCH";
+		case STATS: return "STATS";
+		case TRACE: return "TRACE";
+	}
+	return "unknown";
+}
+
+/*
+ *	Print the latency summaries, which always cover everything since the daemon
+ *	started. The handlers are timed on the main thread; matching, waiting and
+ *	sending on the threads which do them, so with workers or a slow client most
+ *	of a notification's time shows up there rather than under its handler.
+ */
+static void _statPrintTimings( const dndStatsReply *now )
+{
+	printf("  latencies since starting, microseconds:\n");
+	printf("    %-26s %10s %9s %9s %9s %9s %9s %9s\n", "", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+	for( CFIndex i = 0; i < now->stats->timingCount; i++ )
+	{
+		const dndStatsTiming *t = now->timings + i;
+		const char *name;
+		switch(t->timing)
+		{
+			case TIMING_HANDLER: name = _statMessageName(t->msgid); break;
+			case TIMING_MATCH: name = "matching"; break;
+			case TIMING_WAIT: name = "waiting to send"; break;
+			case TIMING_URGENT_WAIT: name = "waiting, urgent"; break;
+			case TIMING_SEND: name = "sending"; break;
+			default: name = "unknown"; break;
+		}
+		printf("    %-26s %10ld %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", name, (long)t->count,
+			   t->mean / 1e3, t->p50 / 1e3, t->p90 / 1e3, t->p99 / 1e3, t->p999 / 1e3, t->max / 1e3);
+	}
+}
+
+int main (int argc, const char * argv[]) {
+
+    const dndTransport *transport = dndTransportDefault();
+    CFIndex interval = 0;
+    CFIndex top = 10;
+    Boolean latency = FALSE;
+
+    int c;
+    while ((c = getopt (argc, (char * const *)argv, "i:k:lt:")) != -1) {
+        switch (c) {
+            case 'i':
+                interval = strtol(optarg, NULL, 10);
+                break;
+            case 'k':
+                top = strtol(optarg, NULL, 10);
+                break;
+            case 'l':
+                latency = TRUE;
+                break;
+            case 't':
+                transport = dndTransportNamed(optarg);
+                break;
+            default:
+                usage();
+                return -1;
+        }
+    }
+    if (!transport || (interval < 0) || (top < 0)) {
+        usage();
+        return -1;
+    }
+
+    // This works around an issue where calls to CFRunLoopGetCurrent() returns a junk address from the TDS
+    CFRunLoopGetMain();
+
+	dndEndpointRef remote = dndEndpointCreateRemote(transport, CFSTR("org.puredarwin.ddistnoted"));
+	if (!remote) {
+		printf("failed to connect to %s port org.puredarwin.ddistnoted\n", transport->name);
+		return 1;
+	}
+
+	dndStatsReply now, then;
+	if (!_statFetch(remote, &now)) return 1;
+	_statPrint(&now, NULL, top);
+	if (latency) _statPrintTimings(&now);
+
+	while (interval > 0) {
+		sleep(interval);
+		then = now;
+		if (!_statFetch(remote, &now)) return 1;
+		printf("\n");
+		_statPrint(&now, &then, top);
+		if (latency) _statPrintTimings(&now);
+		CFRelease(then.data);
+	}
+
+	CFRelease(now.data);
+	dndEndpointRelease(remote);
+	return 0;
+}
@@ -0,0 +1,181 @@
+/*
+ *  dnottrace.c
+ *  ddistnoted
+ *
+ *	Print ddistnoted's trace, either fetched from the running daemon with a TRACE
+ *	request or read from a file it wrote on SIGUSR2.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ddistnoted.h"
+#include "dndtransport.h"
+#include "dndtrace.h"
+
+void usage( void );
+
+void usage( void )
+{
+	printf("\ndnottrace: Print ddistnoted's recent trace events.\n");
+	printf("    [-n events]  ~ how many of the most recent to ask for (%d)\n", TRACE_EVENTS);
+	printf("    [-f file]  ~ read a trace the daemon wrote on SIGUSR2 instead of asking it\n");
+	printf("    [-t cf|socket]  ~ transport to use\n");
+}
+
+static CFDataRef _traceFetch( const dndTransport *transport, CFIndex limit )
+{
+	dndEndpointRef remote = dndEndpointCreateRemote(transport, CFSTR("org.puredarwin.ddistnoted"));
+	if( remote == NULL )
+	{
+		printf("failed to connect to %s port org.puredarwin.ddistnoted\n", transport->name);
+		return NULL;
+	}
+
+	CFDataRef request = CFDataCreate(kCFAllocatorDefault, (const UInt8 *)&limit, sizeof(CFIndex));
+	CFDataRef reply = NULL;
+	SInt32 result = dndEndpointSendRequest(remote, TRACE, request, 1.0, 5.0, &reply);
+	CFRelease(request);
+	dndEndpointRelease(remote);
+
+	if( result || (reply == NULL) )
+	{
+		printf("dnottrace: TRACE request failed (%d)\n", result);
+		return NULL;
+	}
+	return reply;
+}
+
+static CFDataRef _traceRead( const char *path )
+{
+	FILE *file = fopen(path, "r");
+	if( file == NULL )
+	{
+		printf("dnottrace: couldn't open '%s'\n", path);
+		return NULL;
+	}
+
+	CFMutableDataRef data = CFDataCreateMutable(kCFAllocatorDefault, 0);
+	UInt8 buffer[65536];
+	size_t length;
+	while( (length = fread(buffer, 1, sizeof(buffer), file)) > 0 )
+		CFDataAppendBytes(data, buffer, length);
+	fclose(file);
+	return data;
+}
+
+static const char *_traceName( UInt16 event )
+{
+	switch(event)
+	{
+		case TRACE_RECEIVED: return "received";
+		case TRACE_MATCHED: return "matched";
+		case TRACE_QUEUED: return "queued";
+		case TRACE_HELD: return "held";
+		case TRACE_DROPPED: return "dropped";
+		case TRACE_SENT: return "sent";
+		case TRACE_SEND_FAILED: return "send-failed";
+		case TRACE_DISCONNECTED: return "disconnected";
+		case TRACE_PARKED: return "parked";
+		case TRACE_RECOVERED: return "recovered";
+	}
+	return "unknown";
+}
+
+/*
+ *	One line per event: microseconds before the trace was taken, the thread, what
+ *	happened and its details.
+ */
+static void _tracePrint( const dndTraceHeader *header, const dndTraceEvent *event )
+{
+	double ago = ((double)header->time - (double)event->time) / 1e3;
+	printf("%14.1fus  T%-3u %-13s", -ago, event->thread, _traceName(event->event));
+
+	switch(event->event)
+	{
+		case TRACE_RECEIVED:
+			printf("msgid %u, %llu bytes\n", event->value, (unsigned long long)event->hash);
+			break;
+		case TRACE_MATCHED:
+			printf("name %016llX, %u clients\n", (unsigned long long)event->hash, event->value);
+			break;
+		case TRACE_QUEUED:
+		case TRACE_DROPPED:
+			printf("client %016llX, %u queued\n", (unsigned long long)event->hash, event->value);
+			break;
+		case TRACE_HELD:
+			printf("client %016llX, %u held\n", (unsigned long long)event->hash, event->value);
+			break;
+		case TRACE_SENT:
+			printf("client %016llX, %u notifications\n", (unsigned long long)event->hash, event->value);
+			break;
+		case TRACE_SEND_FAILED:
+			printf("client %016llX, error %d\n", (unsigned long long)event->hash, (SInt32)event->value);
+			break;
+		case TRACE_DISCONNECTED:
+		case TRACE_RECOVERED:
+			printf("client %016llX, %u queued\n", (unsigned long long)event->hash, event->value);
+			break;
+		case TRACE_PARKED:
+			printf("client %016llX, for %ums\n", (unsigned long long)event->hash, event->value);
+			break;
+		default:
+			printf("%u %016llX\n", event->value, (unsigned long long)event->hash);
+			break;
+	}
+}
+
+int main (int argc, const char * argv[]) {
+
+    const dndTransport *transport = dndTransportDefault();
+    CFIndex limit = TRACE_EVENTS;
+    const char *path = NULL;
+
+    int c;
+    while ((c = getopt (argc, (char * const *)argv, "n:f:t:")) != -1) {
+        switch (c) {
+            case 'n':
+                limit = strtol(optarg, NULL, 10);
+                break;
+            case 'f':
+                path = optarg;
+                break;
+            case 't':
+                transport = dndTransportNamed(optarg);
+                break;
+            default:
+                usage();
+                return -1;
+        }
+    }
+    if (!transport || (limit < 1)) {
+        usage();
+        return -1;
+    }
+
+    // This works around an issue where calls to CFRunLoopGetCurrent() returns a junk address from the TDS
+    CFRunLoopGetMain();
+
+	CFDataRef data = path ? _traceRead(path) : _traceFetch(transport, limit);
+	if (!data) return 1;
+
+	dndTraceHeader header;
+	CFIndex length = CFDataGetLength(data);
+	if (length >= (CFIndex)sizeof(dndTraceHeader))
+		memcpy(&header, CFDataGetBytePtr(data), sizeof(dndTraceHeader));
+	if ((length < (CFIndex)sizeof(dndTraceHeader)) || (header.magic != TRACE_MAGIC) || (header.eventSize != sizeof(dndTraceEvent))
+		|| (length != (CFIndex)(sizeof(dndTraceHeader) + (header.count * sizeof(dndTraceEvent))))) {
+		printf("dnottrace: not a trace this version understands (%ld bytes)\n", (long)length);
+		CFRelease(data);
+		return 1;
+	}
+
+	const dndTraceEvent *events = (const dndTraceEvent *)(CFDataGetBytePtr(data) + sizeof(dndTraceHeader));
+	for (CFIndex i = 0; i < header.count; i++)
+		_tracePrint(&header, events + i);
+	printf("dnottrace: %ld events\n", (long)header.count);
+
+	CFRelease(data);
+	return 0;
+}
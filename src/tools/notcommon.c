@@ -6,7 +6,9 @@
  */
 
 #include <CoreFoundation/CoreFoundation.h>
+#include <unistd.h>
 #include "notcommon.h"
+#include "dndhistogram.h"
 
 Boolean parseArgs( int argc, const char * argv[] ) 
 {
@@ -24,6 +26,8 @@ Boolean parseArgs( int argc, const char * argv[] )
 	all = FALSE;
 	immediately = FALSE;
 	cf = FALSE;
+	useSocket = FALSE;
+	latency = FALSE;
 	
 	//printf("what?\n");
 	
@@ -51,6 +55,14 @@ Boolean parseArgs( int argc, const char * argv[] )
 		{
 			cf = TRUE;
 		}
+		else if( strncmp("-s", argv[i], 2) == 0 )
+		{
+			useSocket = TRUE;
+		}
+		else if( strncmp("-l", argv[i], 2) == 0 )
+		{
+			latency = TRUE;
+		}
 		else if( strncmp("-t", argv[i], 2) == 0 )
 		{
 			printf("times\n");
@@ -90,3 +102,37 @@ Boolean parseArgs( int argc, const char * argv[] )
 
 	return TRUE; 
 }
+
+CFDictionaryRef createStamp( CFIndex sequence )
+{
+	SInt64 now = (SInt64)dndNanoseconds();
+	SInt32 sender = getpid();
+
+	const void *keys[3] = { STAMP_TIME, STAMP_SENDER, STAMP_SEQUENCE };
+	const void *values[3];
+	values[0] = CFNumberCreate( kCFAllocatorDefault, kCFNumberSInt64Type, &now );
+	values[1] = CFNumberCreate( kCFAllocatorDefault, kCFNumberSInt32Type, &sender );
+	values[2] = CFNumberCreate( kCFAllocatorDefault, kCFNumberCFIndexType, &sequence );
+
+	CFDictionaryRef stamp = CFDictionaryCreate( kCFAllocatorDefault, keys, values, 3, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks );
+	for( int i = 0; i < 3; i++ ) CFRelease(values[i]);
+	return stamp;
+}
+
+// returns FALSE if userInfo isn't a stamp made by createStamp()
+Boolean readStamp( CFDictionaryRef userInfo, UInt64 *time, SInt32 *sender, CFIndex *sequence )
+{
+	if( (userInfo == NULL) || (CFGetTypeID(userInfo) != CFDictionaryGetTypeID()) ) return FALSE;
+
+	CFNumberRef t = CFDictionaryGetValue(userInfo, STAMP_TIME);
+	CFNumberRef s = CFDictionaryGetValue(userInfo, STAMP_SENDER);
+	CFNumberRef q = CFDictionaryGetValue(userInfo, STAMP_SEQUENCE);
+	if( (t == NULL) || (s == NULL) || (q == NULL) ) return FALSE;
+
+	SInt64 when;
+	CFNumberGetValue(t, kCFNumberSInt64Type, &when);
+	CFNumberGetValue(s, kCFNumberSInt32Type, sender);
+	CFNumberGetValue(q, kCFNumberCFIndexType, sequence);
+	*time = (UInt64)when;
+	return TRUE;
+}
@@ -11,6 +11,15 @@
 
 CFArrayRef names, objects;
 CFIndex times, p;
-Boolean all, immediately, cf;
+Boolean all, immediately, cf, useSocket, latency;
+
+// keys postdnot puts in the userInfo of everything it posts, so that waitdnot can
+//	tell how long each notification took to arrive and spot those which didn't
+#define STAMP_TIME		CFSTR("DNDStampTime")		// dndNanoseconds() when it was posted
+#define STAMP_SENDER	CFSTR("DNDStampSender")		// the posting process's pid
+#define STAMP_SEQUENCE	CFSTR("DNDStampSequence")	// which round of posts it was in, from 0
 
 Boolean parseArgs( int argc, const char * argv[] );
+
+CFDictionaryRef createStamp( CFIndex sequence );
+Boolean readStamp( CFDictionaryRef userInfo, UInt64 *time, SInt32 *sender, CFIndex *sequence );
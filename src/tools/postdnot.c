@@ -10,6 +10,7 @@
 #include <CoreFoundation/CoreFoundation.h>
 #include <unistd.h>
 #include "ddistnoted.h"
+#include "dndtransport.h"
 #include "notcommon.h"
 #include "sigseg_handler.h"
 
@@ -25,8 +26,11 @@ void usage( void )
 	printf("    [-all]  ~ deliver to all sessions\n");
 	printf("    [-immediately]  ~ deliver immediately\n");
 	printf("    [-cf]  ~ post using a CFNotificationCenter\n");
+	printf("    [-socket]  ~ talk to ddistnoted over a unix domain socket\n");
 	printf("    [-times x]  ~ repeate all notifications x times\n");
 	printf("    [-pause y]  ~ wait y seconds between posting each notification\n");
+	printf("Each notification's userInfo is stamped with the time and round it was posted in,\n");
+	printf("for waitdnot -latency to measure.\n");
 	printf("Options can be abbreviated to their first letter (eg. '-n').\n");
 }
 
@@ -39,6 +43,7 @@ void postCF( CFOptionFlags options )
     }
 	
 	CFIndex count = times;
+	CFIndex sequence = 0;
 	int nameCount = CFArrayGetCount(names);
 	int objectCount = CFArrayGetCount(objects);
 	
@@ -49,30 +54,47 @@ void postCF( CFOptionFlags options )
 			for ( int i = 0; i < nameCount; i++ ) {
                 CFStringRef name = CFArrayGetValueAtIndex(names, i);
                 CFStringRef object = CFArrayGetValueAtIndex(objects, j);
-				CFNotificationCenterPostNotificationWithOptions( center, name, object, NULL, options );
+				CFDictionaryRef stamp = createStamp(sequence);
+				CFNotificationCenterPostNotificationWithOptions( center, name, object, stamp, options );
+				CFRelease(stamp);
                 printf("posted name: %s, object: %s\n", CFStringGetCStringPtr(name, kCFStringEncodingUTF8), CFStringGetCStringPtr(object, kCFStringEncodingUTF8));
 			}
 		}
+		sequence++;
 		if ( p != 0 ) sleep(p);
 	}
 }
 
 void postDirect( CFOptionFlags options )
 {
-	CFMessagePortRef remote = CFMessagePortCreateRemote( kCFAllocatorDefault, CFSTR("org.puredarwin.ddistnoted") );
+	const dndTransport *transport = useSocket ? &dndTransportSocket : dndTransportDefault();
+	dndEndpointRef remote = dndEndpointCreateRemote( transport, CFSTR("org.puredarwin.ddistnoted") );
 	if( remote == NULL ) return;
 
 	CFIndex count = 0;
+	CFIndex sequence = 0;
 	int nameCount = CFArrayGetCount(names);
 	int objectCount = CFArrayGetCount(objects);
 	dndNotHeader header;
+	CFDictionaryRef stamp;
+
+	// the session waitdnot registers in, so that posts which aren't to all sessions reach it
+	long session = getuid();
+	if( session == 0 ) session = 21;
 
 	CFMutableArrayRef array = CFArrayCreateMutable( kCFAllocatorDefault, 3, NULL );
 	CFArrayAppendValue(array, kCFBooleanFalse);
 	CFArrayAppendValue(array, kCFBooleanFalse);
-	CFArrayAppendValue(array, kCFBooleanFalse); // so we don't have to reset this...
+	CFArrayAppendValue(array, kCFBooleanFalse); // replaced by each notification's stamp
 	CFWriteStreamRef ws;
 	CFDataRef data;
+	dndFrameHeader frame;
+	
+	// when posting more than one notification each round they go in batches, of as
+	//	many as the daemon will take in one
+	Boolean batch = ((nameCount * objectCount) > 1);
+	CFMutableDataRef frames = batch ? CFDataCreateMutable( kCFAllocatorDefault, 0 ) : NULL;
+	CFIndex framed = 0;
 	
 	while((times == 0) || (count++ != times))
 	{
@@ -87,7 +109,11 @@ void postDirect( CFOptionFlags options )
 				header.name = CFHash(CFArrayGetValueAtIndex(names, i));
 				header.object = CFHash(CFArrayGetValueAtIndex(objects, j));
 				header.flags = options;
-				header.session = geteuid();
+				header.session = session;
+				
+				// stamped as late as we can, so the time is as close to sending as possible
+				stamp = createStamp(sequence);
+				CFArraySetValueAtIndex(array, 2, stamp);
 				
 				ws = CFWriteStreamCreateWithAllocatedBuffers( kCFAllocatorDefault, kCFAllocatorDefault );
 				CFWriteStreamOpen(ws);
@@ -96,16 +122,41 @@ void postDirect( CFOptionFlags options )
 				CFWriteStreamClose(ws);
 				data = CFWriteStreamCopyProperty( ws, kCFStreamPropertyDataWritten );
 				CFRelease(ws);
+				CFRelease(stamp);
 				
-				if( data == NULL ) return;
+				if( data == NULL )
+				{
+					if( frames != NULL ) CFRelease(frames);
+					return;
+				}
 				
-				CFMessagePortSendRequest( remote, NOTIFICATION, data, 1.0, 1.0, NULL, NULL );
+				if(batch)
+				{
+					frame.length = CFDataGetLength(data);
+					CFDataAppendBytes( frames, (const UInt8 *)&frame, sizeof(dndFrameHeader) );
+					CFDataAppendBytes( frames, CFDataGetBytePtr(data), frame.length );
+					if( ++framed == NOTIFICATION_BATCH_MAX )
+					{
+						dndEndpointSendRequest( remote, NOTIFICATION_BATCH, frames, 1.0, 1.0, NULL );
+						CFDataSetLength(frames, 0);
+						framed = 0;
+					}
+				}
+				else dndEndpointSendRequest( remote, NOTIFICATION, data, 1.0, 1.0, NULL );
 				
 				CFRelease(data);
 			}
 		}
+		if( framed != 0 )
+		{
+			dndEndpointSendRequest( remote, NOTIFICATION_BATCH, frames, 1.0, 1.0, NULL );
+			CFDataSetLength(frames, 0);
+			framed = 0;
+		}
+		sequence++;
 		if(p != 0) sleep(p);
 	}
+	if( frames != NULL ) CFRelease(frames);
 }
 
 int main (int argc, const char * argv[]) 
@@ -128,6 +179,8 @@ int main (int argc, const char * argv[])
 	else printf("     immediately = FALSE\n");
 	if(cf) printf("     cf = TRUE\n");
 	else printf("     cf = FALSE\n");
+	if(useSocket) printf("     socket = TRUE\n");
+	else printf("     socket = FALSE\n");
 
 	CFShow(names);
 	CFShow(objects);
@@ -7,18 +7,34 @@
 
 #include <CoreFoundation/CoreFoundation.h>
 #include <unistd.h>
+#include <signal.h>
 #include "ddistnoted.h"
+#include "dndtransport.h"
+#include "dndhistogram.h"
 #include "notcommon.h"
 #include "sigseg_handler.h"
 
 #include <pthread/pthread.h>
 
+// what we've seen of notifications stamped by postdnot. only touched on the main thread
+static dndHistogram latencies;
+static CFIndex received = 0;
+static CFIndex stamped = 0;
+static CFIndex gaps = 0;		// sequence numbers skipped over
+static CFIndex late = 0;		// sequence numbers seen after a later one, or twice
+static CFMutableDictionaryRef streams = NULL; // sender, name and object to the next sequence number expected
+
 void usage( void );
 void waitCF( CFNotificationSuspensionBehavior sb );
 void waitDirect( void );
+void waitStamp( CFHashCode name, CFHashCode object, CFDictionaryRef userInfo );
+void waitRecord( const UInt8 *bytes, CFIndex length );
+void waitReport( void *info );
+void *waitSignals( void *info );
+void waitWatchSignals( const dndTransport *transport );
 
 void waitCFCallBack( CFNotificationCenterRef center, void *observer, CFStringRef name, const void *object, CFDictionaryRef userInfo );
-CFDataRef waitDirectCallBack( CFMessagePortRef local, SInt32 msgid, CFDataRef data, void *info );
+CFDataRef waitDirectCallBack( dndEndpointRef local, SInt32 msgid, CFDataRef data, void *info );
 
 void usage( void )
 {
@@ -26,19 +42,147 @@ void usage( void )
 	printf("    -name notificationName[,notificationName]\n");
 	printf("    -object objectName[,objectName]\n");
 	printf("    [-cf]  ~ wait using a CFNotificationCenter\n");
+	printf("    [-socket]  ~ talk to ddistnoted over a unix domain socket\n");
 	printf("    [-times x]  ~ wait for x matching notifications\n");
 	printf("    [-pause y]  ~ wait for up to y seconds for each repeate notification\n");
+	printf("    [-latency]  ~ don't report each notification, just measure those from postdnot\n");
+	printf("Latency percentiles and any missed notifications are reported on SIGUSR1, and on\n");
+	printf("exit by SIGINT or SIGTERM.\n");
 	printf("Options can be abbreviated to their first letter (eg. '-n').\n");
 }
 
+/*
+ *	Record how long a notification took to arrive, if postdnot stamped it, and check
+ *	its sequence number against the last one seen from the same sender for the same
+ *	name and object. The first from each is taken as the start of the sequence.
+ */
+void waitStamp( CFHashCode name, CFHashCode object, CFDictionaryRef userInfo )
+{
+	UInt64 now = dndNanoseconds();
+	UInt64 time;
+	SInt32 sender;
+	CFIndex sequence;
+	
+	received++;
+	if( !readStamp(userInfo, &time, &sender, &sequence) ) return;
+	
+	stamped++;
+	dndHistogramRecord(&latencies, (now > time) ? (now - time) : 0);
+	
+	if( streams == NULL ) streams = CFDictionaryCreateMutable( kCFAllocatorDefault, 0, NULL, NULL );
+	const void *key = (const void *)(((CFHashCode)sender * 2654435761UL) ^ name ^ (object << 1));
+	const void *next;
+	if( CFDictionaryGetValueIfPresent(streams, key, &next) )
+	{
+		if( sequence < (CFIndex)next )
+		{
+			late++;
+			return;
+		}
+		gaps += sequence - (CFIndex)next;
+	}
+	CFDictionarySetValue(streams, key, (const void *)(sequence + 1));
+}
+
+// the notification after a dndNotHeader is a property list of its name, object and userInfo
+void waitRecord( const UInt8 *bytes, CFIndex length )
+{
+	if( length < sizeof(dndNotHeader) ) return;
+	
+	dndNotHeader header;
+	memcpy(&header, bytes, sizeof(dndNotHeader));
+	
+	CFDataRef data = CFDataCreateWithBytesNoCopy( kCFAllocatorDefault, bytes + sizeof(dndNotHeader), length - sizeof(dndNotHeader), kCFAllocatorNull );
+	CFPropertyListRef plist = CFPropertyListCreateWithData( kCFAllocatorDefault, data, kCFPropertyListImmutable, NULL, NULL );
+	CFRelease(data);
+	
+	CFDictionaryRef userInfo = NULL;
+	if( (plist != NULL) && (CFGetTypeID(plist) == CFArrayGetTypeID()) && (CFArrayGetCount(plist) > 2) )
+		userInfo = CFArrayGetValueAtIndex(plist, 2);
+	waitStamp(header.name, header.object, userInfo);
+	
+	if( plist != NULL ) CFRelease(plist);
+}
+
+void waitReport( void *info )
+{
+	printf("waitdnot: %ld notifications, %ld stamped, %ld missed, %ld late or repeated\n", (long)received, (long)stamped, (long)gaps, (long)late);
+	if( stamped != 0 )
+		printf("waitdnot: latency us p50 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+			   dndHistogramPercentile(&latencies, 50.0) / 1e3, dndHistogramPercentile(&latencies, 99.0) / 1e3,
+			   dndHistogramPercentile(&latencies, 99.9) / 1e3, latencies.max / 1e3);
+	fflush(stdout);
+	
+	if( info != NULL ) exit(0);
+}
+
+/*
+ *	The signals we report on are blocked for every thread and taken here instead, so
+ *	the report can be made on the main thread, where the figures are kept.
+ */
+static dndSourceRef reportSource = NULL;
+static dndSourceRef exitSource = NULL;
+static const dndTransport *signalTransport = NULL;
+
+void *waitSignals( void *info )
+{
+	sigset_t *set = info;
+	int sig;
+	
+	while( sigwait(set, &sig) == 0 )
+		dndSourceSignal(signalTransport, (sig == SIGUSR1) ? reportSource : exitSource);
+	return NULL;
+}
+
+void waitWatchSignals( const dndTransport *transport )
+{
+	static sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGUSR1);
+	
+	signalTransport = transport;
+	reportSource = dndSourceCreate(transport, waitReport, NULL);
+	exitSource = dndSourceCreate(transport, waitReport, (void *)TRUE);
+	if( (reportSource == NULL) || (exitSource == NULL) ) return;
+	
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	pthread_t thread;
+	pthread_create(&thread, NULL, waitSignals, &set);
+}
+
 void waitCFCallBack( CFNotificationCenterRef center, void *observer, CFStringRef name, const void *object, CFDictionaryRef userInfo )
 {
-    printf("waitdnot: Got a CF notification!\n");
+	waitStamp(CFHash(name), (object != NULL) ? CFHash(object) : 0, userInfo);
+    if (!latency) printf("waitdnot: Got a CF notification!\n");
 }
 
-CFDataRef waitDirectCallBack( CFMessagePortRef local, SInt32 msgid, CFDataRef data, void *info )
+CFDataRef waitDirectCallBack( dndEndpointRef local, SInt32 msgid, CFDataRef data, void *info )
 {
-    printf("waitdnot: Got a notification!\n");
+	if( msgid != NOTIFICATION_BATCH )
+	{
+		waitRecord(CFDataGetBytePtr(data), CFDataGetLength(data));
+		if( !latency ) printf("waitdnot: Got a notification!\n");
+		return NULL;
+	}
+	
+	// we registered for batch delivery, so several may arrive together
+	const UInt8 *bytes = CFDataGetBytePtr(data);
+	CFIndex length = CFDataGetLength(data);
+	CFIndex offset = 0, count = 0;
+	dndFrameHeader frame;
+	
+	while( offset + sizeof(dndFrameHeader) <= length )
+	{
+		memcpy(&frame, bytes + offset, sizeof(dndFrameHeader));
+		offset += sizeof(dndFrameHeader);
+		if( (frame.length < 0) || (frame.length > length - offset) ) break;
+		waitRecord(bytes + offset, frame.length);
+		offset += frame.length;
+		count++;
+	}
+	if( !latency ) printf("waitdnot: Got %ld notifications in a batch!\n", (long)count);
 	return NULL;
 }
 
@@ -74,31 +218,24 @@ void WaitDirect(void) {
     printf("message port name will be '%s'\n", uname);
 	CFStringRef name = CFStringCreateWithCStringNoCopy(kCFAllocatorDefault, uname, kCFStringEncodingASCII, NULL);
 	
-	// create the local port now, because the daemon will look for it
-	CFMessagePortContext context = { 0, NULL, NULL, NULL, NULL };
-	CFMessagePortRef local = CFMessagePortCreateLocal( kCFAllocatorDefault, name, waitDirectCallBack, &context, NULL );
+	// create the local port now, because the daemon will look for it. it's added to the main runloop
+	const dndTransport *transport = useSocket ? &dndTransportSocket : dndTransportDefault();
+	dndEndpointRef local = dndEndpointCreateLocal( transport, name, waitDirectCallBack, NULL );
 	if (!local) {
-		printf("CFMessagePortCreateLocal() failed to create a local message port\n");
+		printf("failed to create a local %s port\n", transport->name);
 		return;
 	}
 	
-	CFRunLoopSourceRef rls = CFMessagePortCreateRunLoopSource( kCFAllocatorDefault, local, 0 );
-    if (!rls) {
-        printf("CFMessagePortCreateRunLoopSource() failed\n");
-        return;
-    }
-	CFRunLoopAddSource( CFRunLoopGetMain(), rls, kCFRunLoopCommonModes );
-	
 	// create the remote port
-	CFMessagePortRef remote = CFMessagePortCreateRemote(kCFAllocatorDefault, CFSTR("org.puredarwin.ddistnoted"));
+	dndEndpointRef remote = dndEndpointCreateRemote( transport, CFSTR("org.puredarwin.ddistnoted") );
 	if (!remote) {
-		printf("CFMessagePortCreateRemote() failed to connect to message port org.puredarwin.ddistnoted\n");
+		printf("failed to connect to %s port org.puredarwin.ddistnoted\n", transport->name);
 		return;
 	}
 	
 	// squeeze our unique name, as ASCII, into a data object...
 	CFIndex length = CFStringGetLength(name);
-	UInt8 data[(++length + sizeof(long))];
+	UInt8 data[(++length + sizeof(long) + sizeof(CFIndex))];
 	
 	// if this isn't set -- and on other platforms -- we could maybe use userIds
 	long session = getuid();
@@ -114,14 +251,19 @@ void WaitDirect(void) {
 	//printf("and getsid() reports %u\n", getsid(0));
 	
 	CFStringGetCString(name, (char *)(data + sizeof(long)), length, kCFStringEncodingASCII);
-	CFDataRef dataOut = CFDataCreate( kCFAllocatorDefault, (const UInt8 *)data, (length + sizeof(long)) );
+	
+	// ...followed by what we can handle...
+	CFIndex flags = DND_PORT_BATCH_DELIVERY;
+	memcpy(data + sizeof(long) + length, &flags, sizeof(CFIndex));
+	
+	CFDataRef dataOut = CFDataCreate( kCFAllocatorDefault, (const UInt8 *)data, (length + sizeof(long) + sizeof(CFIndex)) );
 	//printf("'unique' name: '%s'\n", data);
 	
 	// ...send the register message...
 	CFDataRef dataIn = NULL;
-	SInt32 result = CFMessagePortSendRequest( remote, REGISTER_PORT, dataOut, 1.0, 1.0, kCFRunLoopDefaultMode, &dataIn);
+	SInt32 result = dndEndpointSendRequest( remote, REGISTER_PORT, dataOut, 1.0, 1.0, &dataIn);
     if (result || !dataIn || !CFDataGetLength(dataIn)) {
-        printf("CFMessagePortSendRequest() failed (%d)\n", result);
+        printf("dndEndpointSendRequest() failed (%d)\n", result);
         return;
     }
 	
@@ -133,34 +275,38 @@ void WaitDirect(void) {
 	
 	int nameCount = CFArrayGetCount(names);
 	int objectCount = CFArrayGetCount(objects);
-	dndNotReg info = { hash, 0, 0 };
+	CFIndex count = 0;
+	dndNotReg infos[nameCount * objectCount];
 	CFStringRef str;
 	
 	for( int j = 0; j < objectCount; j++ )
 	{
 		for( int i = 0; i < nameCount; i++ )
 		{
+			dndNotReg *info = infos + count++;
+			info->uid = hash;
+			info->sb = CFNotificationSuspensionBehaviorDeliverImmediately;
+			
 			str = CFArrayGetValueAtIndex(names, i);
 			if( kCFCompareEqualTo == CFStringCompare(str, CFSTR("_"), 0) )
-				info.name = 0;
+				info->name = 0;
 			else
-				info.name = CFHash(str);
+				info->name = CFHash(str);
 			
 			str = CFArrayGetValueAtIndex(objects, j);
 			if( kCFCompareEqualTo == CFStringCompare(str, CFSTR("_"), 0) )
-				info.object = 0;
+				info->object = 0;
 			else
-				info.object = CFHash(str);
-			
-			dataIn = CFDataCreate( kCFAllocatorDefault, (const UInt8 *)&info, sizeof(dndNotReg) );
-				
-			CFMessagePortSendRequest( remote, REGISTER_NOTIFICATION, dataIn, 1.0, 1.0, NULL, NULL );
-				
-			CFRelease(dataIn);
+				info->object = CFHash(str);
 		}
 	}
 	
-	CFRunLoopRun(); // forever
+	// register for everything in one message, unless there's just the one
+	dataIn = CFDataCreate( kCFAllocatorDefault, (const UInt8 *)infos, count * sizeof(dndNotReg) );
+	dndEndpointSendRequest( remote, (count == 1) ? REGISTER_NOTIFICATION : REGISTER_NOTIFICATIONS, dataIn, 1.0, 1.0, NULL );
+	CFRelease(dataIn);
+	
+	dndTransportRun(transport); // forever
 }
 
 int main (int argc, const char * argv[]) {
@@ -181,6 +327,7 @@ int main (int argc, const char * argv[]) {
     printf("     all = %s\n", all ? "TRUE" : "FALSE");
     printf("     immediately = %s\n", immediately ? "TRUE" : "FALSE");
     printf("     cf = %s\n", cf ? "TRUE" : "FALSE");
+    printf("     socket = %s\n", useSocket ? "TRUE" : "FALSE");
 
     printf("names: ");
     for (int i = 0; i < CFArrayGetCount(names); i++) {
@@ -196,6 +343,10 @@ int main (int argc, const char * argv[]) {
         printf("%s\n", CFStringGetCStringPtr(name, kCFStringEncodingUTF8));
     }
 	
+	// before any other threads are started, so they all leave these signals to us
+	dndHistogramReset(&latencies);
+	waitWatchSignals(cf ? &dndTransportMessagePort : (useSocket ? &dndTransportSocket : dndTransportDefault()));
+	
     if (cf) {
 		waitCF(0);
     } else {